@@ -3429,6 +3429,12 @@ void* mspace_malloc(mspace msp, size_t bytes) {
   return 0;
 }
 
+#if FOOTERS
+mspace mspace_of(void* mem) {
+  return (mspace)get_mstate_for(mem2chunk(mem));
+}
+#endif /* FOOTERS */
+
 void mspace_free(mspace msp, void* mem) {
   if (mem != 0) {
     mchunkptr p  = mem2chunk(mem);
@@ -1047,6 +1047,14 @@ void* mspace_malloc(mspace msp, size_t bytes);
 */
 void mspace_free(mspace msp, void* mem);
 
+#if FOOTERS
+/*
+  mspace_of returns the space that an allocated chunk belongs to,
+  including the space behind plain malloc.
+*/
+mspace mspace_of(void* mem);
+#endif /* FOOTERS */
+
 /*
   mspace_realloc behaves as realloc, but operates within
   the given space.
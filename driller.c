@@ -13,33 +13,120 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 #include <assert.h>
 #include <dlfcn.h>
 #include <ucontext.h>
 #include <signal.h>
 #include <sys/resource.h>
-#include <search.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include <pthread.h>
+#ifdef linux
+#include <sys/syscall.h>
+#endif
 
 #include "tunables.h"
 #include "driller.h"
 #include "driller_internal.h"
 #include "log.h"
 #include "dlmalloc.h"
+#include "spinlock.h"
 
-static int driller_initialized = 0;
-static int driller_malloc_installed = 0;
+#ifndef MAP_STACK
+#define MAP_STACK 0
+#endif
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0
+#endif
 
-/* root for the sorted tree of map structs */
-static void *map_root = NULL;
+static int driller_initialized = 0;
+/* set by driller_init_selective: existing maps, the heap and thread
+ * stacks are left alone, and anonymous maps below map_threshold are
+ * not drilled */
+static int driller_selective = 0;
+static size_t map_threshold = 0;
+/* one lock for our maps and for driller_mspace: driller allocates,
+ * and the allocator enters driller to get memory, so the thread that
+ * holds it may take it again */
+static struct spinlock driller_lock = SPINLOCK_INIT;
+static __thread int driller_lock_depth = 0;
+/* non-zero while this thread runs driller code */
+static __thread int driller_malloc_installed = 0;
+
+/* index of map structs sorted by address: the start addresses are
+ * kept in an array of their own, so that lookups touch few cache
+ * lines; driller_lookup_map reads it without the lock, and retries if
+ * map_seq changed meanwhile (it is odd while the index changes) */
+static void **map_starts = NULL;
+static struct map_rec **map_recs = NULL;
+static int map_count = 0;
+static int map_alloc = 0;
+static volatile unsigned int map_seq;
+/* most recent hit of this thread, valid while map_seq is map_last_seq */
+static __thread struct map_rec *map_last = NULL;
+static __thread unsigned int map_last_seq;
+
+/* map records are never freed, so that a lookup may read one that is
+ * being unmapped; the records it returns are pinned until
+ * driller_put_map, and those of maps that went away meanwhile are
+ * only recycled by the last put */
+enum map_state {
+	MAP_LIVE,
+	MAP_DEAD,	/* unmapped, still pinned */
+	MAP_FREE,	/* in map_nodes_free */
+};
+struct map_node {
+	struct map_rec mn_map;
+	int mn_pins;
+	volatile int mn_state;
+	struct map_node *mn_next;
+};
+static struct map_node *map_nodes_free;
 /* maps for the user stack and heap */
 static struct map_rec *map_stack = NULL;
 static struct map_rec *map_heap = NULL;
+/* current break, below the end of map_heap when it has a window */
+static void *heap_brk;
+static int heap_windowed;
 /* cache call to sysconf(_SC_PAGESIZE) */
 static unsigned int page_size;
 
+static inline size_t page_round(size_t length) {
+	return (length + page_size - 1) & ~((size_t)page_size - 1);
+}
+
+/* pool file for anonymous maps (fd < 0 when not used),
+ * and its free ranges, sorted by offset */
+struct pool_extent {
+	off_t pe_start;
+	off_t pe_end;
+	struct pool_extent *pe_next;
+};
+static struct map_rec map_pool = { .fd = -1 };
+static struct pool_extent *pool_free;
+
+/* emptied files of unmapped segments (fd < 0 when free),
+ * and the map being recycled while map_invalidate_cb runs */
+struct fd_cache_ent {
+	int fe_fd;
+	int fe_class;
+	off_t fe_size;
+	void *fe_user_data;
+};
+static struct fd_cache_ent fd_cache[MAP_FD_CACHE_SIZE];
+static struct map_rec *map_recycled;
+
+/* files shared by the pieces of split maps, each with a record
+ * spanning the whole file, and the number of pieces left */
+struct split_file {
+	struct map_rec sf_map;
+	int sf_count;
+	struct split_file *sf_next;
+};
+static struct split_file *split_files;
+
 /* overloaded routines have to be called */
 static void *(*old_mmap)(void *start, size_t length, int prot, int flags,
 			 int fd, off_t offset);
@@ -50,11 +137,37 @@ static void *(*old_mremap)(void *old_address, size_t old_size,
 #endif
 static int (*old_brk)(void *end_data_segment);
 static void *(*old_sbrk)(intptr_t increment);
+static int (*old_pthread_create)(pthread_t *thread,
+				 const pthread_attr_t *attr,
+				 void *(*start_routine)(void *), void *arg);
+static int (*old_pthread_join)(pthread_t thread, void **retval);
+static int (*old_pthread_detach)(pthread_t thread);
+
+/* stacks of threads that we mapped, unmapped on pthread_join, or
+ * once a thread given to pthread_detach is gone */
+struct thread_stack {
+	pthread_t ts_thread;
+	void *ts_addr;
+	size_t ts_size;
+	void *(*ts_start)(void *);
+	void *ts_arg;
+	volatile pid_t ts_tid;	/* set by the thread when it starts */
+	int ts_created;		/* pthread_create returned */
+	int ts_detached;
+	struct thread_stack *ts_next;
+};
+static struct thread_stack *thread_stacks;
+
+/* bytes written to the files of rebuilt maps, and left as holes */
+static size_t rebuild_copied, rebuild_skipped;
 
 /* temp stack for stack rebuild,
  * and for segfault handler used for stack growth */
 static char *altstack;
 
+/* set when the stack is mapped up to its limit already */
+static int stack_reserved;
+
 /* previous (fallback) handler for sigsegv */
 static struct sigaction old_segv_sigaction;
 
@@ -64,172 +177,494 @@ static void (*map_invalidate_cb)(struct map_rec *map);
 /*
  * since driller can be entered from an allocator calling mmap,
  * and we may have to allocate maps from here,
- * let's define our own allocation space, and use malloc hooks
+ * let's define our own allocation space: while a thread runs driller
+ * code, its allocations are served from there, while other threads
+ * keep using the regular allocator; chunks carry footers that tell
+ * their space, so they can be freed from anywhere
  */
 static mspace driller_mspace;
-#ifdef linux
-static void *(*old_malloc_hook)(size_t bytes, const void *caller);
-static void (*old_free_hook)(void *mem, const void *caller);
-static void *(*old_realloc_hook)(void *mem, size_t bytes, const void *caller);
-static void *(*old_memalign_hook)(size_t align, size_t bytes, const void *caller);
-#endif
 
 /*
- * including both malloc.h and dlmalloc.h is not possible, 
- * so duplicate the following hook declarations
+ * the regular allocator is split in stripes, each with its own lock,
+ * so that threads rarely wait for each other: stripe 0 is the main
+ * dlmalloc space (which owns the heap), the others are mspaces made
+ * on first use; a thread sticks to the stripe of its first allocation
+ *
+ * a stripe lock is held while its space calls mmap, i.e. while it
+ * takes driller_lock, so driller code must never wait for a stripe
+ * lock: the chunks it frees are queued on their stripe, and freed by
+ * the next thread that releases the stripe
  */
-#ifdef linux
-extern void *(*__malloc_hook)(size_t bytes, const void *caller);
-extern void (*__free_hook)(void *mem, const void *caller);
-extern void *(*__realloc_hook)(void *mem, size_t bytes, const void *caller);
-extern void *(*__memalign_hook)(size_t align, size_t bytes, const void *caller);
-#endif /* linux */
+struct malloc_stripe {
+	struct spinlock ms_lock;
+	mspace ms_space;	/* NULL for the main space */
+	void *ms_deferred;	/* chunks to free, linked by their first word */
+};
+static struct malloc_stripe malloc_stripes[MALLOC_STRIPES] = {
+	[0 ... MALLOC_STRIPES - 1] = { .ms_lock = SPINLOCK_INIT },
+};
+static unsigned int malloc_stripe_next;
+static __thread struct malloc_stripe *malloc_stripe;
+
+static inline void driller_lock_get(void) {
+	if(driller_lock_depth++ == 0)
+		spin_lock(&driller_lock);
+}
 
-/******************/
+static inline void driller_lock_put(void) {
+	if(--driller_lock_depth == 0)
+		spin_unlock(&driller_lock);
+}
 
 /*
- * hooks and allocation routines for cases when the regular malloc/free
- * cannot be used, because they are calling us
+ * enter driller code: take the lock, and have this thread allocate
+ * from driller_mspace; calls may be nested
  */
+static void driller_malloc_install(void){
+	if(driller_mspace == NULL)
+		return;
 
-void *driller_malloc(size_t bytes) {
-	return mspace_malloc(driller_mspace, bytes);
+	driller_lock_get();
+	driller_malloc_installed++;
 }
 
-void driller_free(void *mem) {
-	mspace_free(driller_mspace, mem);
+static void driller_malloc_restore(void){
+	if(driller_mspace == NULL)
+		return;
+
+	driller_malloc_installed--;
+	driller_lock_put();
 }
 
-static inline void *driller_realloc(void *mem, size_t bytes) {
-	return mspace_realloc(driller_mspace, mem, bytes);
+/*
+ * lock and return the stripe of the current thread
+ */
+static struct malloc_stripe *stripe_get(void) {
+	struct malloc_stripe *ms = malloc_stripe;
+
+	if(ms == NULL) {
+		ms = &malloc_stripes[__sync_fetch_and_add(&malloc_stripe_next, 1)
+				     % MALLOC_STRIPES];
+		malloc_stripe = ms;
+	}
+	spin_lock(&ms->ms_lock);
+	if(ms->ms_space == NULL && ms != &malloc_stripes[0]) {
+		/* no locking inside, ms_lock protects it */
+		ms->ms_space = create_mspace(0, 0);
+		if(ms->ms_space == NULL) {
+			/* out of memory, share the main space */
+			spin_unlock(&ms->ms_lock);
+			ms = malloc_stripe = &malloc_stripes[0];
+			spin_lock(&ms->ms_lock);
+		}
+	}
+	return ms;
 }
 
-#ifdef linux
-static void *driller_malloc_hook(size_t bytes, const void *caller) {
-	return driller_malloc(bytes);
+/*
+ * free the chunks queued on stripe ms, and unlock it
+ */
+static void stripe_put(struct malloc_stripe *ms) {
+	void *mem, *next;
+
+	while(ms->ms_deferred != NULL) {
+		mem = __sync_lock_test_and_set(&ms->ms_deferred, NULL);
+		for(; mem != NULL; mem = next) {
+			next = *(void **)mem;
+			dlfree(mem);
+		}
+	}
+	spin_unlock(&ms->ms_lock);
 }
 
-static void driller_free_hook(void *mem, const void *caller) {
-	driller_free(mem);
+/*
+ * return the stripe that owns space msp
+ */
+static struct malloc_stripe *stripe_of(mspace msp) {
+	int i;
+
+	/* most often, our own */
+	if(malloc_stripe != NULL && malloc_stripe->ms_space == msp)
+		return malloc_stripe;
+	for(i = 1; i < MALLOC_STRIPES; i++)
+		if(malloc_stripes[i].ms_space == msp)
+			return &malloc_stripes[i];
+	return &malloc_stripes[0];
 }
 
-static void *driller_realloc_hook(void *mem, size_t bytes, const void *caller) {
-	return driller_realloc(mem, bytes);
+/*
+ * free mem, from stripe ms, in driller code
+ */
+static void stripe_defer_free(struct malloc_stripe *ms, void *mem) {
+	void *head;
+
+	do {
+		head = ms->ms_deferred;
+		*(void **)mem = head;
+	} while(!__sync_bool_compare_and_swap(&ms->ms_deferred, head, mem));
 }
 
-static void *driller_memalign_hook(size_t align, size_t bytes, const void *caller) {
-	return mspace_memalign(driller_mspace, align, bytes);
+/******************/
+
+void *driller_malloc(size_t bytes) {
+	void *mem;
+
+	driller_malloc_install();
+	mem = mspace_malloc(driller_mspace, bytes);
+	driller_malloc_restore();
+	return mem;
 }
-#else
+
+void driller_free(void *mem) {
+	driller_malloc_install();
+	mspace_free(driller_mspace, mem);
+	driller_malloc_restore();
+}
+
+/*
+ * in the allocation routines, driller_malloc_installed means that
+ * driller_lock is held, and that memory comes from driller_mspace
+ */
+
 void *malloc(size_t bytes) {
+	struct malloc_stripe *ms;
+	void *mem;
+
 	if(driller_malloc_installed)
 		return mspace_malloc(driller_mspace, bytes);
+
+	ms = stripe_get();
+	if(ms->ms_space != NULL)
+		mem = mspace_malloc(ms->ms_space, bytes);
 	else
-		return dlmalloc(bytes);
+		mem = dlmalloc(bytes);
+	stripe_put(ms);
+	return mem;
 }
 
 void free(void *mem) {
-	if(driller_malloc_installed)
-		mspace_free(driller_mspace, mem);
-	else
+	struct malloc_stripe *ms;
+	mspace msp;
+
+	if(mem == NULL)
+		return;
+	msp = mspace_of(mem);
+	if(msp == driller_mspace) {
+		driller_lock_get();
 		dlfree(mem);
+		driller_lock_put();
+		return;
+	}
+
+	ms = stripe_of(msp);
+	if(driller_malloc_installed) {
+		stripe_defer_free(ms, mem);
+		return;
+	}
+	spin_lock(&ms->ms_lock);
+	dlfree(mem);
+	stripe_put(ms);
 }
 
 void *realloc(void *mem, size_t bytes) {
+	struct malloc_stripe *ms;
+	mspace msp;
+	void *new;
+
+	if(mem == NULL)
+		return malloc(bytes);
+
+	msp = mspace_of(mem);
+	if(msp == driller_mspace) {
+		driller_lock_get();
+		mem = dlrealloc(mem, bytes);
+		driller_lock_put();
+		return mem;
+	}
+
+	ms = stripe_of(msp);
+	if(driller_malloc_installed) {
+		/* move it to driller_mspace */
+		new = mspace_malloc(driller_mspace, bytes);
+		if(new != NULL) {
+			memcpy(new, mem, min(bytes, dlmalloc_usable_size(mem)));
+			stripe_defer_free(ms, mem);
+		}
+		return new;
+	}
+	spin_lock(&ms->ms_lock);
+	mem = dlrealloc(mem, bytes);
+	stripe_put(ms);
+	return mem;
+}
+
+void *calloc(size_t n, size_t size) {
+	struct malloc_stripe *ms;
+	void *mem;
+
 	if(driller_malloc_installed)
-		return mspace_realloc(driller_mspace, mem, bytes);
+		return mspace_calloc(driller_mspace, n, size);
+
+	ms = stripe_get();
+	if(ms->ms_space != NULL)
+		mem = mspace_calloc(ms->ms_space, n, size);
 	else
-		return dlrealloc(mem, bytes);
+		mem = dlcalloc(n, size);
+	stripe_put(ms);
+	return mem;
 }
 
 void *memalign(size_t align, size_t bytes) {
+	struct malloc_stripe *ms;
+	void *mem;
+
 	if(driller_malloc_installed)
 		return mspace_memalign(driller_mspace, align, bytes);
+
+	ms = stripe_get();
+	if(ms->ms_space != NULL)
+		mem = mspace_memalign(ms->ms_space, align, bytes);
 	else
-		return dlmemalign(align, bytes);
+		mem = dlmemalign(align, bytes);
+	stripe_put(ms);
+	return mem;
 }
-#endif
 
-static void driller_malloc_install(void){
-	if(!driller_initialized || driller_malloc_installed)
-		return;
+int posix_memalign(void **memptr, size_t align, size_t bytes) {
+	void *mem;
 
-#ifdef linux
-	old_malloc_hook = __malloc_hook;
-	old_free_hook = __free_hook;
-	old_realloc_hook = __realloc_hook;
-	old_memalign_hook = __memalign_hook;
-
-	__malloc_hook = driller_malloc_hook;
-	__free_hook = driller_free_hook;
-	__realloc_hook = driller_realloc_hook;
-	__memalign_hook = driller_memalign_hook;
-#endif
+	mem = memalign(align, bytes);
+	if(mem == NULL)
+		return ENOMEM;
+	*memptr = mem;
+	return 0;
+}
 
-	driller_malloc_installed = 1;
+void *aligned_alloc(size_t align, size_t bytes) {
+	return memalign(align, bytes);
 }
 
-static void driller_malloc_restore(void){
-	if(!driller_initialized)
+void *valloc(size_t bytes) {
+	return memalign(sysconf(_SC_PAGESIZE), bytes);
+}
+
+/* only reads the header of an allocated chunk, no lock needed */
+size_t malloc_usable_size(void *mem) {
+	return dlmalloc_usable_size(mem);
+}
+
+/******************/
+
+static inline struct map_node *map_node(struct map_rec *map) {
+	return (struct map_node *)map;
+}
+
+/*
+ * return a zeroed map record, recycled if possible
+ */
+static struct map_rec *map_rec_alloc(void) {
+	struct map_node *mn = map_nodes_free;
+
+	if(mn != NULL)
+		/* a lookup that raced with its unmap may still pin and
+		 * put it: keep its count */
+		map_nodes_free = mn->mn_next;
+	else {
+		mn = malloc(sizeof(*mn));
+		assert(mn != NULL);
+		mn->mn_pins = 0;
+	}
+	memset(&mn->mn_map, 0, sizeof(mn->mn_map));
+	mn->mn_state = MAP_LIVE;
+	return &mn->mn_map;
+}
+
+/*
+ * recycle the record of a map that went away, unless it is pinned
+ */
+static void map_rec_recycle(struct map_node *mn) {
+	if(mn->mn_state != MAP_DEAD || mn->mn_pins != 0)
 		return;
+	mn->mn_state = MAP_FREE;
+	free(mn->mn_map.path);
+	mn->mn_map.path = NULL;
+	mn->mn_next = map_nodes_free;
+	map_nodes_free = mn;
+}
 
-#ifdef linux
-	__malloc_hook = old_malloc_hook;
-	__free_hook = old_free_hook;
-	__realloc_hook = old_realloc_hook;
-	__memalign_hook = old_memalign_hook;
-#endif
+/*
+ * the record of a map removed from the index is no longer used by us
+ */
+static void map_rec_free(struct map_rec *map) {
+	struct map_node *mn = map_node(map);
+
+	mn->mn_state = MAP_DEAD;
+	/* either we see the pin of a lookup, or it sees map_seq change
+	 * and puts the record back */
+	__sync_synchronize();
+	map_rec_recycle(mn);
+}
 
-	driller_malloc_installed = 0;
+static inline void map_index_write_begin(void) {
+	map_seq++;
+	mb();
 }
 
-/******************/
+static inline void map_index_write_end(void) {
+	mb();
+	map_seq++;
+}
 
-static int map_cmp(const void *a, const void *b) {
-	const struct map_rec *left = a;
-	const struct map_rec *right = b;
+/*
+ * return the number of maps that start below addr
+ */
+static int map_index_find(void *addr) {
+	int lo = 0, hi = map_count, mid;
+	void **starts;
+
+	/* arrays are published before the count that needs them */
+	mb();
+	starts = map_starts;
+	while(lo < hi) {
+		mid = (lo + hi) / 2;
+		if(starts[mid] < addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
 
-	assert(left->start <= left->end);
-	assert(right->start <= right->end);
+static void map_index_insert(struct map_rec *map) {
+	void **starts;
+	struct map_rec **recs;
+	int i;
+
+	if(map_count == map_alloc) {
+		/* lookups may still read the old arrays, so they are
+		 * kept: all of them take less room than the new ones */
+		map_alloc = map_alloc ? 2 * map_alloc : MAP_TABLE_INITIAL_SIZE;
+		starts = malloc(map_alloc * sizeof(*starts));
+		recs = malloc(map_alloc * sizeof(*recs));
+		assert(starts != NULL && recs != NULL);
+		if(map_count > 0) {
+			memcpy(starts, map_starts,
+			       map_count * sizeof(*starts));
+			memcpy(recs, map_recs, map_count * sizeof(*recs));
+		}
+		mb();
+		map_starts = starts;
+		map_recs = recs;
+	}
 
-	if(left->end <= right->start)
-		return -1;
-	if(left->start >= right->end)
-		return 1;
-	/* "equality" here means a and b have a common interval */
-	return 0;
+	i = map_index_find(map->start);
+	/* maps never overlap */
+	assert(i == 0 || map_recs[i-1]->end <= map->start);
+	assert(i == map_count || map->end <= map_starts[i]);
+
+	map_index_write_begin();
+	memmove(map_starts + i + 1, map_starts + i,
+		(map_count - i) * sizeof(*map_starts));
+	memmove(map_recs + i + 1, map_recs + i,
+		(map_count - i) * sizeof(*map_recs));
+	map_starts[i] = map->start;
+	map_recs[i] = map;
+	map_count++;
+	map_index_write_end();
+}
+
+static void map_index_remove(struct map_rec *map) {
+	int i;
+
+	i = map_index_find(map->start);
+	assert(i < map_count && map_recs[i] == map);
+
+	map_index_write_begin();
+	map_count--;
+	memmove(map_starts + i, map_starts + i + 1,
+		(map_count - i) * sizeof(*map_starts));
+	memmove(map_recs + i, map_recs + i + 1,
+		(map_count - i) * sizeof(*map_recs));
+	map_index_write_end();
+}
+
+/*
+ * move the start of a map, which must not cross other maps
+ */
+static void map_index_set_start(struct map_rec *map, void *start) {
+	int i;
+
+	i = map_index_find(map->start);
+	assert(i < map_count && map_recs[i] == map);
+	map_index_write_begin();
+	map_starts[i] = start;
+	map->start = start;
+	map_index_write_end();
+}
+
+/*
+ * find the map record for a given memory range, in the index as of
+ * map_seq seq
+ */
+static struct map_rec *map_lookup(void *start, void *end, unsigned int seq) {
+	struct map_rec *map;
+	int i;
+
+	/* consecutive lookups often hit the same map */
+	map = map_last;
+	if(map != NULL && map_last_seq == seq
+	   && map->start < end && start < map->end)
+		return map;
+
+	/* the last map that starts below end is the only candidate:
+	 * those before it end before it starts */
+	i = map_index_find(end);
+	if(i == 0)
+		return NULL;
+	map = map_recs[i-1];
+	if(map->end <= start)
+		return NULL;
+	map_last = map;
+	map_last_seq = seq;
+	return map;
 }
 
 /*
  * record a description of a memory segment that is/will become
- * a file-backed memory mapping - uses tsearch(3)
+ * a file-backed memory mapping
  */
-void map_record(void *start, void *end, int prot, off_t offset,
-		char *path, int fd) {
+struct map_rec *map_record(void *start, void *end, int prot, off_t offset,
+			   char *path, int fd) {
 	struct map_rec *map;
-	void *rc;
 
 	if(strcmp(path, "[vdso]") == 0)
 		/* ignore gate page */
-		return;
+		return NULL;
+	if(strncmp(path, "[vvar", strlen("[vvar")) == 0)
+		/* data of the gate page ([vvar], [vvar_vclock]...),
+		 * kept up to date by the kernel */
+		return NULL;
 #if __i386__
 	if(start == (void*)0xffffe000)
 		/* ignore gate page */
-		return;
+		return NULL;
 #endif
 	if(!(prot & PROT_READ))
 		/* not readable, ignore */
-		return;
+		return NULL;
 #ifdef DONT_MAP_TEXT
 	if((prot & PROT_EXEC) && !(prot & PROT_WRITE))
 		/* prefer to keep text as is, otherwise oprofile can't get
 		 * symbol information
 		 * a side effect is that rodata may not be shared */
-		return;
+		return NULL;
 #endif
 	if(strncmp(path, "/dev/", strlen("/dev/")) == 0)
 		/* special files are not welcome */
-		return;
+		return NULL;
+	if(strncmp(path, "/memfd:", strlen("/memfd:")) == 0)
+		/* already shared memory, like files in /dev/shm */
+		return NULL;
 #if __x86_64__
 	if(offset > (2L << 40))
 		/* some strange offsets in /proc/self/maps */
@@ -238,10 +673,7 @@ void map_record(void *start, void *end, int prot, off_t offset,
 
 	/* now we have something to do */
 
-	map = malloc(sizeof(*map));
-	assert(map != NULL);
-	memset(map, 0, sizeof(*map));
-
+	map = map_rec_alloc();
 	map->start = start;
 	map->end = end;
 	map->prot = prot;
@@ -250,8 +682,64 @@ void map_record(void *start, void *end, int prot, off_t offset,
 	assert(map->path != NULL);
 	map->fd = fd;
 
-	rc = tsearch((void *)map, &map_root, map_cmp);
-	assert(rc != NULL);
+	map_index_insert(map);
+	return map;
+}
+
+static void map_copy_run(int fd, char *start, char *end, off_t offset) {
+	ssize_t rc;
+
+	rc = pwrite(fd, start, end - start, offset);
+	if(rc < 0)
+		perr("pwrite");
+	if(rc < end - start)
+		err("short write (%zd instead of %zd)", rc, end - start);
+	rebuild_copied += rc;
+}
+
+/*
+ * copy length bytes at start to fd at offset, leaving holes in the
+ * file for pages that only hold zeroes: those that read as zeroes, and
+ * for anonymous memory, those never touched, without reading them
+ */
+static void map_copy(int fd, void *start, size_t length, off_t offset,
+		     int anon) {
+	unsigned char used[MAP_PAGES_CHUNK];
+	char *p = start, *end = p + length, *run = NULL;
+	size_t i, n, len;
+	struct stat st;
+
+	/* the file may be larger already, e.g. the pool */
+	if(fstat(fd, &st) != 0)
+		perr("fstat");
+	if(st.st_size < offset + length
+	   && ftruncate(fd, offset + length) != 0)
+		perr("ftruncate");
+
+	while(p < end) {
+		n = min((size_t)(end - p + page_size - 1) / page_size,
+			(size_t)MAP_PAGES_CHUNK);
+		if(!anon || map_pages_used(p, n, used) != 0)
+			memset(used, 1, n);
+
+		for(i = 0; i < n; i++, p += len) {
+			len = min((size_t)(end - p), (size_t)page_size);
+			if(used[i] && (p[0] != 0
+				       || memcmp(p, p + 1, len - 1) != 0)) {
+				if(run == NULL)
+					run = p;
+				continue;
+			}
+			rebuild_skipped += len;
+			if(run != NULL) {
+				map_copy_run(fd, run, p,
+					     offset + (run - (char *)start));
+				run = NULL;
+			}
+		}
+	}
+	if(run != NULL)
+		map_copy_run(fd, run, end, offset + (run - (char *)start));
 }
 
 /*
@@ -271,6 +759,42 @@ static void map_overload(void *start, size_t length, int prot, int flags,
 		perr("mmap");
 }
 
+/*
+ * map a large window over the heap file beyond the break, once: brk
+ * then only has to size the file, and the heap map that peers see
+ * doesn't change as the heap grows
+ * return 0 if the window is not free
+ */
+static int heap_window(void) {
+	size_t size;
+	void *rc;
+	char *s;
+
+	s = getenv("DRILLER_HEAP_WINDOW");
+	if(!USE_HEAP_WINDOW || (s != NULL && strcmp(s, "0") == 0))
+		return 0;
+
+	size = page_round(map_heap->end - map_heap->start);
+	if(size >= HEAP_WINDOW_SIZE)
+		return 0;
+
+	/* without MAP_FIXED_NOREPLACE, the address is only a hint;
+	 * pages beyond the end of the file fault until brk covers them */
+	rc = mmap(map_heap->start + size, HEAP_WINDOW_SIZE - size,
+		  map_heap->prot, MAP_SHARED | MAP_FIXED_NOREPLACE,
+		  map_heap->fd, map_heap->offset + size);
+	if(rc != map_heap->start + size) {
+		if(rc != MAP_FAILED
+		   && munmap(rc, HEAP_WINDOW_SIZE - size) != 0)
+			perr("munmap");
+		dbg("no room for heap window above %p", map_heap->end);
+		return 0;
+	}
+
+	map_heap->end = map_heap->start + HEAP_WINDOW_SIZE;
+	return 1;
+}
+
 /*
  * create a guard zone below the stack (mapped area with no access rights)
  * this is required on some platforms to detect (and handle) stack growth
@@ -282,31 +806,66 @@ static void stack_guard_map(void) {
 #endif
 }
 
+/*
+ * map the whole window allowed by the stack limit below the stack, from
+ * the sparse stack file: pages are only allocated when touched, and the
+ * stack never has to be grown from the segv handler
+ * return 0 if the window is not free
+ */
+static int stack_reserve(void) {
+	struct rlimit rl;
+	size_t size, limit;
+	void *start, *rc;
+	char *s;
+
+	s = getenv("DRILLER_STACK_RESERVE");
+	if(!USE_STACK_RESERVE || (s != NULL && strcmp(s, "0") == 0))
+		return 0;
+
+	if(getrlimit(RLIMIT_STACK, &rl) != 0)
+		perr("getrlimit");
+	limit = min(rl.rlim_cur, (rlim_t)STACK_MAP_OFFSET);
+	limit &= ~((size_t)page_size - 1);
+	size = map_stack->end - map_stack->start;
+	if(limit <= size)
+		return 0;
+
+	/* without MAP_FIXED_NOREPLACE, start is only a hint */
+	start = map_stack->end - limit;
+	rc = mmap(start, limit - size, map_stack->prot,
+		  MAP_SHARED | MAP_FIXED_NOREPLACE, map_stack->fd,
+		  STACK_MAP_OFFSET - limit);
+	if(rc != start) {
+		if(rc != MAP_FAILED && munmap(rc, limit - size) != 0)
+			perr("munmap");
+		dbg("no room to reserve stack below %p", map_stack->start);
+		return 0;
+	}
+
+	map_index_set_start(map_stack, start);
+	map_stack->offset = STACK_MAP_OFFSET - limit;
+	return 1;
+}
+
 /*
  * overloading the stack requires running this function from a separate stack
  */
 static void map_overload_stack(void) {
 	uintptr_t size;
-	int rc;
 
 	/* we're on a separate stack, but globals are still here */
 	size = map_stack->end - map_stack->start;
 
 	/* the new stack is at the end of a large sparse file */
 	map_stack->offset = STACK_MAP_OFFSET - size;
-	if(lseek(map_stack->fd, map_stack->offset, SEEK_SET) < 0)
-		perr("lseek");
 
 	/* copy mapped area to file */
-	rc = write(map_stack->fd, map_stack->start, size);
-	if(rc < 0)
-		perr("write");
-	if(rc < size)
-		err("short write (%d instead of %zd)", rc, size);
+	map_copy(map_stack->fd, map_stack->start, size, map_stack->offset, 1);
 
 	map_overload(map_stack->start, size, map_stack->prot,
 		     MAP_SHARED | MAP_FIXED, map_stack->fd,
 		     map_stack->offset, 0);
+	stack_reserved = stack_reserve();
 	stack_guard_map();
 
 	dbg("remapped stack at %p", map_stack->start);
@@ -376,11 +935,19 @@ static void segv_sigaction(int signum, siginfo_t *si, void *uctx) {
 		goto out_raise;
 	}
 
+	if(stack_reserved) {
+		err_noabort("stack limit exceeded");
+		goto out_raise;
+	}
+
 	/* grow stack by at least STACK_MIN_GROW */
 	addr = (void*)((uintptr_t)addr & ~((unsigned long)page_size - 1));
-	map_stack->start = min(addr, map_stack->start - STACK_MIN_GROW);
+	driller_malloc_install();
+	map_index_set_start(map_stack,
+			    min(addr, map_stack->start - STACK_MIN_GROW));
 	size = map_stack->end - map_stack->start;
 	map_stack->offset = STACK_MAP_OFFSET - size;
+	driller_malloc_restore();
 
 	if(getrlimit(RLIMIT_STACK, &rl) != 0)
 		perr("getrlimit");
@@ -389,53 +956,433 @@ static void segv_sigaction(int signum, siginfo_t *si, void *uctx) {
 		goto out_raise;
 	}
 
-	rc = mmap(map_stack->start, size, map_stack->prot,
-		  MAP_SHARED | MAP_FIXED, map_stack->fd,
-		  map_stack->offset);
-	if(rc == MAP_FAILED)
-		perr("mmap");
-	stack_guard_map();
+	rc = mmap(map_stack->start, size, map_stack->prot,
+		  MAP_SHARED | MAP_FIXED, map_stack->fd,
+		  map_stack->offset);
+	if(rc == MAP_FAILED)
+		perr("mmap");
+	stack_guard_map();
+
+	dbg("stack grows to %p", map_stack->start);
+	errno = errno_sav;
+	return;
+
+out_raise:
+	/* let the previous handler run, usually the default action
+	 * if a core is produced, it will have the right stack (not this one) */
+	if(sigaction(signum, &old_segv_sigaction, NULL) != 0)
+		perr("sigaction");
+	errno = errno_sav;
+}
+
+/*
+ * return a new fd to a file suitable for memory mapping, named after
+ * fmt (for debugging, the name doesn't have to be unique)
+ *
+ * an anonymous memfd costs no path lookup and no dentry, and doesn't
+ * depend on the size of TMPDIR; if the kernel has none, fall back to
+ * a file in TMPDIR, unlinked immediately
+ */
+int driller_create_fd(char *fmt, ...) {
+	static int use_memfd = USE_MEMFD;
+	char name[MAP_FD_NAME_MAX];
+	char filename[sizeof(TMPDIR) + MAP_FD_NAME_MAX];
+	va_list ap;
+	int fd;
+
+	va_start(ap, fmt);
+	vsnprintf(name, sizeof(name), fmt, ap);
+	va_end(ap);
+
+#ifdef SYS_memfd_create
+	if(use_memfd) {
+		fd = syscall(SYS_memfd_create, name, 0);
+		if(fd >= 0)
+			return fd;
+		if(errno != ENOSYS && errno != EINVAL && errno != EPERM)
+			perr("memfd_create");
+		dbg("no memfd, using files in %s", TMPDIR);
+		use_memfd = 0;
+	}
+#endif
+
+	snprintf(filename, sizeof(filename), "%s/%s", TMPDIR, name);
+	fd = open(filename, O_CREAT | O_TRUNC | O_RDWR, 0600);
+	if(fd < 0)
+		perr("open");
+	if(unlink(filename))
+		perr("unlink");
+
+	return fd;
+}
+
+/*
+ * map pool
+ *
+ * anonymous maps are carved out of one large sparse file instead of
+ * each getting a file of its own: an mmap then costs a single syscall,
+ * we don't run out of fds, and peers only need to open one file; the
+ * space of unmapped ranges is given back by punching holes in the file
+ */
+
+static inline int map_is_pooled(struct map_rec *map) {
+	return map_pool.fd >= 0 && map->fd == map_pool.fd;
+}
+
+static void map_pool_init(void) {
+	char *s;
+	int fd;
+
+	s = getenv("DRILLER_MAP_POOL");
+	if(!USE_MAP_POOL || (s != NULL && strcmp(s, "0") == 0))
+		return;
+
+	fd = driller_create_fd("shmem-%d-pool", getpid());
+	if(ftruncate(fd, MAP_POOL_SIZE) != 0) {
+		perr_noabort("ftruncate");
+		if(close(fd) != 0)
+			perr("close");
+		return;
+	}
+
+	pool_free = malloc(sizeof(*pool_free));
+	assert(pool_free != NULL);
+	pool_free->pe_start = 0;
+	pool_free->pe_end = MAP_POOL_SIZE;
+	pool_free->pe_next = NULL;
+
+	map_pool.start = NULL;
+	map_pool.end = (void *)MAP_POOL_SIZE;
+	map_pool.prot = PROT_READ | PROT_WRITE;
+	map_pool.offset = 0;
+	map_pool.path = "";
+	map_pool.fd = fd;
+	dbg("map pool of %ld MB", (long)(MAP_POOL_SIZE >> 20));
+}
+
+/*
+ * return the offset of length free bytes in the pool, or -1
+ */
+static off_t map_pool_alloc(size_t length) {
+	struct pool_extent *pe, **pprev;
+	off_t offset;
+
+	if(map_pool.fd < 0)
+		return -1;
+	length = page_round(length);
+
+	/* first fit */
+	for(pprev = &pool_free; (pe = *pprev) != NULL; pprev = &pe->pe_next)
+		if(pe->pe_end - pe->pe_start >= length)
+			break;
+	if(pe == NULL)
+		return -1;
+
+	offset = pe->pe_start;
+	pe->pe_start += length;
+	if(pe->pe_start == pe->pe_end) {
+		*pprev = pe->pe_next;
+		free(pe);
+	}
+	return offset;
+}
+
+/*
+ * grow the range at offset in place from old_length to new_length
+ * bytes, return 0 if the bytes after it are not free
+ */
+static int map_pool_extend(off_t offset, size_t old_length,
+			   size_t new_length) {
+	struct pool_extent *pe, **pprev;
+	off_t end = offset + page_round(old_length);
+
+	new_length = page_round(new_length);
+	for(pprev = &pool_free; (pe = *pprev) != NULL; pprev = &pe->pe_next)
+		if(pe->pe_start >= end)
+			break;
+	if(pe == NULL || pe->pe_start != end
+	   || pe->pe_end < offset + new_length)
+		return 0;
+
+	pe->pe_start = offset + new_length;
+	if(pe->pe_start == pe->pe_end) {
+		*pprev = pe->pe_next;
+		free(pe);
+	}
+	return 1;
+}
+
+/*
+ * give length bytes at offset back to the pool, and their memory
+ * back to the system
+ */
+static void map_pool_release(off_t offset, size_t length) {
+	struct pool_extent *pe, *prev, *new;
+	off_t end;
+
+	length = page_round(length);
+	if(length == 0)
+		return;
+	end = offset + length;
+
+#ifdef linux
+	if(fallocate(map_pool.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		     offset, length) != 0)
+		perr("fallocate");
+#endif
+
+	for(prev = NULL, pe = pool_free; pe != NULL;
+	    prev = pe, pe = pe->pe_next)
+		if(pe->pe_start >= end)
+			break;
+	assert(prev == NULL || prev->pe_end <= offset);
+
+	/* merge with neighbours if possible */
+	if(prev != NULL && prev->pe_end == offset) {
+		prev->pe_end = end;
+		if(pe != NULL && pe->pe_start == end) {
+			prev->pe_end = pe->pe_end;
+			prev->pe_next = pe->pe_next;
+			free(pe);
+		}
+		return;
+	}
+	if(pe != NULL && pe->pe_start == end) {
+		pe->pe_start = offset;
+		return;
+	}
+
+	new = malloc(sizeof(*new));
+	assert(new != NULL);
+	new->pe_start = offset;
+	new->pe_end = end;
+	new->pe_next = pe;
+	if(prev != NULL)
+		prev->pe_next = new;
+	else
+		pool_free = new;
+}
+
+/*
+ * split maps
+ *
+ * when a hole is punched in the middle of a map, the piece after it
+ * gets a record of its own, on the same file at a different offset;
+ * the file then works as a small pool for its pieces: its memory is
+ * released by punching holes, and it goes away with the last piece
+ */
+
+static struct split_file *map_split_file(struct map_rec *map) {
+	struct split_file *sf;
+
+	for(sf = split_files; sf != NULL; sf = sf->sf_next)
+		if(sf->sf_map.fd == map->fd)
+			return sf;
+	return NULL;
+}
+
+/*
+ * release the memory of length bytes at offset in the file of map,
+ * which is shared with other maps
+ */
+static void map_file_release(struct map_rec *map, off_t offset,
+			     size_t length) {
+	if(map_is_pooled(map)) {
+		map_pool_release(offset, length);
+		return;
+	}
+#ifdef linux
+	length = page_round(length);
+	if(length > 0
+	   && fallocate(map->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			offset, length) != 0)
+		perr("fallocate");
+#endif
+}
+
+/*
+ * remove [start-end] from the middle of map
+ */
+static void map_split(struct map_rec *map, void *start, void *end) {
+	struct map_rec *tail, hole;
+	struct split_file *sf = NULL;
+
+	/* the kernel unmaps whole pages */
+	end = (void *)page_round((size_t)end);
+
+	if(!map_is_pooled(map)) {
+		sf = map_split_file(map);
+		if(sf == NULL) {
+			/* first split: the file now belongs to the pieces,
+			 * and so does what the user knows about it */
+			sf = malloc(sizeof(*sf));
+			assert(sf != NULL);
+			memcpy(&sf->sf_map, map, sizeof(*map));
+			sf->sf_map.start = NULL;
+			sf->sf_map.end = (void *)(map->offset
+						  + (map->end - map->start));
+			sf->sf_map.offset = 0;
+			sf->sf_map.path = "";
+			sf->sf_count = 1;
+			sf->sf_next = split_files;
+			split_files = sf;
+			map->user_data = NULL;
+		}
+		sf->sf_count++;
+	}
+	dbg("split %p-%p at %p-%p", map->start, map->end, start, end);
+
+	/* notify user of the end of the hole only */
+	memcpy(&hole, map, sizeof(hole));
+	hole.start = start;
+	hole.end = end;
+	hole.offset = map->offset + (start - map->start);
+	if(map_invalidate_cb != NULL)
+		map_invalidate_cb(&hole);
+
+	tail = map_rec_alloc();
+	memcpy(tail, map, sizeof(*tail));
+	tail->start = end;
+	tail->offset = map->offset + (end - map->start);
+	tail->path = strdup(map->path);
+	assert(tail->path != NULL);
+	tail->user_data = NULL;
+
+	map->end = start;
+	map_file_release(map, hole.offset, end - start);
+	map_index_insert(tail);
+}
+
+/*
+ * a piece of a split map is gone, and its memory released: drop the
+ * file with the last piece
+ */
+static void map_split_put(struct split_file *sf) {
+	struct split_file **pprev;
+
+	if(--sf->sf_count > 0)
+		return;
+	for(pprev = &split_files; *pprev != sf; pprev = &(*pprev)->sf_next)
+		;
+	*pprev = sf->sf_next;
+
+	/* unlinked already, so the user sees the end of the file */
+	if(map_invalidate_cb != NULL)
+		map_invalidate_cb(&sf->sf_map);
+	if(ftruncate(sf->sf_map.fd, 0) != 0)
+		perr("ftruncate");
+	if(close(sf->sf_map.fd) != 0)
+		perr("close");
+	free(sf);
+}
+
+/*
+ * return the record for the whole file if map shares it with other
+ * maps, i.e. if map is part of the pool or a piece of a split map, so
+ * that peers can map the file once rather than each map; the
+ * invalidate callback is still called for these maps, but the file
+ * remains until its record itself is invalidated (never for the pool)
+ */
+struct map_rec *driller_map_pool(struct map_rec *map) {
+	struct split_file *sf;
+
+	if(map_is_pooled(map))
+		return &map_pool;
+	sf = map_split_file(map);
+	return sf != NULL ? &sf->sf_map : NULL;
+}
+
+/*
+ * fd cache
+ *
+ * when a map goes away, its file is emptied but kept open, and reused
+ * by the next anonymous map of the same size class: this saves the
+ * creation and sizing of a new file, and since the fd and the file
+ * stay the same, peers that have it mapped need not drop it
+ */
+
+static int fd_cache_class(off_t size) {
+	int class = 0;
+
+	/* log2 of the size in pages, rounded up */
+	for(size = (size - 1) / page_size; size != 0; size >>= 1)
+		class++;
+	return class;
+}
 
-	dbg("stack grows to %p", map_stack->start);
-	errno = errno_sav;
-	return;
+static void fd_cache_init(void) {
+	int i;
 
-out_raise:
-	/* let the previous handler run, usually the default action
-	 * if a core is produced, it will have the right stack (not this one) */
-	if(sigaction(signum, &old_segv_sigaction, NULL) != 0)
-		perr("sigaction");
-	errno = errno_sav;
+	for(i = 0; i < MAP_FD_CACHE_SIZE; i++)
+		fd_cache[i].fe_fd = -1;
 }
 
 /*
- * return a new fd to a file suitable for memory mapping
+ * return a free cache entry if the file of map can be kept, or NULL
  */
-static int map_create_fd(char *fmt, ...) {
-	char *filename;
-	int len;
-	va_list ap;
-	int fd;
+static struct fd_cache_ent *fd_cache_slot(struct map_rec *map) {
+	int i;
 
-	va_start(ap, fmt);
-	len = vsnprintf(NULL, 0, fmt, ap);
-	va_end(ap);
+	if(map->fd < 0 || map_is_pooled(map))
+		return NULL;
+	for(i = 0; i < MAP_FD_CACHE_SIZE; i++)
+		if(fd_cache[i].fe_fd < 0)
+			return &fd_cache[i];
+	return NULL;
+}
 
-	filename = malloc(len+1);
-	assert(filename != NULL);
+/*
+ * release the memory of map, keeping its file in entry fe
+ */
+static void fd_cache_put(struct fd_cache_ent *fe, struct map_rec *map) {
+	off_t size = map->offset + (map->end - map->start);
 
-	va_start(ap, fmt);
-	vsprintf(filename, fmt, ap);
-	va_end(ap);
+#ifdef linux
+	if(fallocate(map->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		     0, size) != 0)
+		perr("fallocate");
+#else
+	if(ftruncate(map->fd, 0) != 0)
+		perr("ftruncate");
+	size = 0;
+#endif
+	fe->fe_fd = map->fd;
+	fe->fe_class = fd_cache_class(size);
+	fe->fe_size = size;
+	fe->fe_user_data = map->user_data;
+}
 
-	fd = open(filename, O_CREAT | O_TRUNC | O_RDWR, 0600);
-	if(fd < 0)
-		perr("open");
-	if(unlink(filename))
-		perr("unlink");
-	free(filename);
+/*
+ * return the entry of a cached file of at least length bytes,
+ * or NULL if none is available; the entry is only freed by the
+ * caller, once the file is in use
+ */
+static struct fd_cache_ent *fd_cache_get(size_t length) {
+	struct fd_cache_ent *fe;
+	int i, class;
+
+	class = fd_cache_class(length);
+	for(i = 0; i < MAP_FD_CACHE_SIZE; i++) {
+		fe = &fd_cache[i];
+		if(fe->fe_fd < 0 || fe->fe_class != class)
+			continue;
+		/* the file may be a bit smaller than needed */
+		if(fe->fe_size < length) {
+			if(ftruncate(fe->fe_fd, length) != 0)
+				return NULL;
+			fe->fe_size = length;
+		}
+		return fe;
+	}
+	return NULL;
+}
 
-	return fd;
+/*
+ * tell map_invalidate_cb whether the file of map is kept for reuse,
+ * in which case its fd remains valid, with the same user data
+ */
+int driller_map_recycled(struct map_rec *map) {
+	return map == map_recycled;
 }
 
 static int map_is_stack(struct map_rec *map) {
@@ -468,7 +1415,6 @@ static int map_is_heap(struct map_rec *map) {
  */
 static void map_rebuild(struct map_rec *map, int index) {
 	size_t size;
-	int rc;
 	enum overload_t type;
 	stack_t ss;
 	struct sigaction sa;
@@ -484,9 +1430,8 @@ static void map_rebuild(struct map_rec *map, int index) {
 	//XXX todo: improve handling of read mappings to existing files (optim)
 
 	/* create file, unlink immediately */
-	map->fd = map_create_fd("%s/shmem-%d-%d%s",
-				TMPDIR, getpid(), index,
-				type == OVERLOAD_REG ? "" : map->path);
+	map->fd = driller_create_fd("shmem-%d-%d%s", getpid(), index,
+				    type == OVERLOAD_REG ? "" : map->path);
 
 	switch (type) {
 	case OVERLOAD_HEAP:
@@ -500,25 +1445,26 @@ static void map_rebuild(struct map_rec *map, int index) {
 	case OVERLOAD_REG:
 		size = map->end - map->start;
 
-		/* copy mapped area to file */
-		if(lseek(map->fd, map->offset, SEEK_SET) < 0)
-			perr("lseek");
-		rc = write(map->fd, map->start, size);
-		if(rc < 0)
-			perr("write");
-		if(rc < size)
-			err("short write (%d instead of %zd)", rc, size);
+		/* copy mapped area to file, only file maps can hold data
+		 * in pages that were never touched */
+		map_copy(map->fd, map->start, size, map->offset,
+			 map->path[0] != '/');
 
 		/* map file over original area */
 		map_overload(map->start, size, map->prot,
 			     MAP_SHARED | MAP_FIXED, map->fd, map->offset,
 			     (type == OVERLOAD_HEAP) );
+		if(type == OVERLOAD_HEAP) {
+			heap_brk = map->end;
+			heap_windowed = heap_window();
+		}
 		break;
 
 	case OVERLOAD_STACK:
 		map_stack = map;
 		//XXX stack may grow after map_parse - but how much??
-		map_stack->start = min(stack_base(), map_stack->start);
+		map_index_set_start(map_stack,
+				    min(stack_base(), map_stack->start));
 		dbg("switching to new stack: %p-%p", map->start, map->end);
 
 		/* overload current stack: use alternate stack */
@@ -548,33 +1494,58 @@ static void map_rebuild(struct map_rec *map, int index) {
  */
 static void map_invalidate_range(void *start, void *end) {
 	struct map_rec *map;
+	struct fd_cache_ent *fe;
+	struct split_file *sf;
 
 	/* loop over all maps that intersect with [start-end] */
 	while(1) {
-		map = driller_lookup_map(start, end-start);
+		map = map_lookup(start, end, map_seq);
 		if(map == NULL)
 			return;
 
+		if( (map->start < start)
+		    && (end < map->end) ) {
+			/* nothing else can intersect */
+			map_split(map, start, end);
+			return;
+		}
+
+		sf = map_is_pooled(map) ? NULL : map_split_file(map);
+		fe = NULL;
+		if( (start <= map->start)
+		    && (map->end <= end)
+		    && sf == NULL )
+			fe = fd_cache_slot(map);
+
 		/* notify user of the end of this map as it knows it */
+		map_recycled = (fe != NULL ? map : NULL);
 		if(map_invalidate_cb != NULL)
 			map_invalidate_cb(map);
+		map_recycled = NULL;
 
 		if( (start <= map->start)
 		    && (map->end <= end) ) {
 			/* map has disappeared completely */
-			void *rc;
-
-			rc = tdelete(map, &map_root, map_cmp);
-			assert(rc != NULL);
-
-			/* make sure memory is released *now* */
-			if(ftruncate(map->fd, 0) != 0)
-				perr("ftruncate");
-
-			if(close(map->fd) != 0)
-				perr("close");
-			free(map->path);
-			free(map);
+			map_index_remove(map);
+
+			if(map_is_pooled(map)) {
+				map_pool_release(map->offset,
+						 map->end - map->start);
+			} else if(sf != NULL) {
+				map_file_release(map, map->offset,
+						 map->end - map->start);
+				map_split_put(sf);
+			} else if(fe != NULL) {
+				fd_cache_put(fe, map);
+			} else {
+				/* make sure memory is released *now* */
+				if(ftruncate(map->fd, 0) != 0)
+					perr("ftruncate");
+
+				if(close(map->fd) != 0)
+					perr("close");
+			}
+			map_rec_free(map);
 			continue;
 		}
 
@@ -584,18 +1555,26 @@ static void map_invalidate_range(void *start, void *end) {
 
 			/* trim the start */
 			new_start = min(end, map->end);
+			if(map_is_pooled(map) || sf != NULL)
+				map_file_release(map, map->offset,
+						 new_start - map->start);
 			map->offset += new_start - map->start;
-			map->start = new_start;
+			map_index_set_start(map, new_start);
 		} else if(map->end <= end) {
 			/* trim the end */
+			void *old_end = map->end;
+
 			map->end = max(start, map->start);
-			if(ftruncate(map->fd,
-				     map->offset + map->end - map->start) != 0)
+			if(map_is_pooled(map) || sf != NULL) {
+				off_t off = page_round(map->end - map->start);
+
+				map_file_release(map, map->offset + off,
+						 page_round(old_end - map->start)
+						 - off);
+			} else if(ftruncate(map->fd, map->offset
+					    + map->end - map->start) != 0)
 				perr("ftruncate");
-		} else
-			/* we should split the map!
-			 * this can be done but seems very unlikely */
-			err("unexpected condition: should split mapping");
+		}
 	}
 }
 
@@ -612,6 +1591,10 @@ void *mmap(void *start, size_t length, int prot, int flags,
 	void *rc = MAP_FAILED;
 	int new_flags;
 	int errno_sav;
+	off_t pool_offset;
+	struct fd_cache_ent *fe = NULL;
+	void *user_data = NULL;
+	struct map_rec *map;
 
 	if(!driller_initialized || driller_malloc_installed
 	   || !(flags & MAP_ANONYMOUS)
@@ -623,25 +1606,52 @@ void *mmap(void *start, size_t length, int prot, int flags,
 
 	driller_malloc_install();
 
-	fd = map_create_fd("%s/shmem-%d-anon", TMPDIR, getpid());
-	if(ftruncate(fd, offset + length) != 0) {
+	if(length < map_threshold) {
+		/* too small to be worth sharing, but it may replace
+		 * some of our maps */
+		rc = old_mmap(start, length, prot, flags, fd, offset);
 		errno_sav = errno;
-		if(close(fd) != 0)
-			perr("close");
+		if(rc != MAP_FAILED)
+			map_invalidate_range(rc, rc + length);
 		goto out_restore;
 	}
 
+	pool_offset = map_pool_alloc(length);
+	if(pool_offset >= 0) {
+		fd = map_pool.fd;
+		offset = pool_offset;
+	} else if(offset == 0 && (fe = fd_cache_get(length)) != NULL) {
+		/* no pool, or pool full: reuse a file */
+		fd = fe->fe_fd;
+	} else {
+		fd = driller_create_fd("shmem-%d-anon", getpid());
+		if(ftruncate(fd, offset + length) != 0) {
+			errno_sav = errno;
+			if(close(fd) != 0)
+				perr("close");
+			goto out_restore;
+		}
+	}
+
 	new_flags = (flags & ~(MAP_ANONYMOUS|MAP_PRIVATE)) | MAP_SHARED;
 	rc = old_mmap(start, length, prot, new_flags, fd, offset);
 	errno_sav = errno;
 	if(rc == MAP_FAILED) {
-		if(close(fd) != 0)
+		if(pool_offset >= 0)
+			map_pool_release(pool_offset, length);
+		else if(fe == NULL && close(fd) != 0)
 			perr("close");
 		goto out_restore;
 	}
 
+	if(fe != NULL) {
+		user_data = fe->fe_user_data;
+		fe->fe_fd = -1;
+	}
 	map_invalidate_range(rc, rc + length);
-	map_record(rc, rc + length, prot, offset, "", fd);
+	map = map_record(rc, rc + length, prot, offset, "", fd);
+	if(map != NULL)
+		map->user_data = user_data;
 out_restore:
 	driller_malloc_restore();
 out:
@@ -706,6 +1716,69 @@ static void * driller_mremap(struct map_rec *map,
 }
 #endif
 
+#ifdef linux
+/*
+ * mremap for a pooled map: the pool file is never truncated, so the
+ * map grows in place if the space after it is free, or else its
+ * contents move to a new range of the pool
+ */
+static void *map_pool_mremap(struct map_rec *map, size_t new_size,
+			     int flags) {
+	size_t old_size = map->end - map->start;
+	off_t offset;
+	void *rc;
+	int errno_sav;
+
+	if(page_round(new_size) <= page_round(old_size)) {
+		if(new_size < old_size && map_invalidate_cb != NULL)
+			map_invalidate_cb(map);
+		rc = old_mremap(map->start, old_size, new_size, flags);
+		if(rc != MAP_FAILED)
+			map_pool_release(map->offset + page_round(new_size),
+					 page_round(old_size)
+					 - page_round(new_size));
+		return rc;
+	}
+
+	if(map_pool_extend(map->offset, old_size, new_size)) {
+		rc = old_mremap(map->start, old_size, new_size, flags);
+		if(rc == MAP_FAILED) {
+			errno_sav = errno;
+			map_pool_release(map->offset + page_round(old_size),
+					 page_round(new_size)
+					 - page_round(old_size));
+			errno = errno_sav;
+		}
+		return rc;
+	}
+
+	offset = -1;
+	if(flags & MREMAP_MAYMOVE)
+		offset = map_pool_alloc(new_size);
+	if(offset < 0) {
+		errno = ENOMEM;
+		return MAP_FAILED;
+	}
+	rc = old_mmap(NULL, new_size, map->prot, MAP_SHARED,
+		      map_pool.fd, offset);
+	if(rc == MAP_FAILED) {
+		errno_sav = errno;
+		map_pool_release(offset, new_size);
+		errno = errno_sav;
+		return rc;
+	}
+
+	if(map_invalidate_cb != NULL)
+		map_invalidate_cb(map);
+	memcpy(rc, map->start, old_size);
+	if(old_munmap(map->start, old_size) != 0)
+		perr("munmap");
+	map_pool_release(map->offset, old_size);
+	map->offset = offset;
+	return rc;
+}
+#endif
+
 /*
  * overload the regular mremap
  */
@@ -725,8 +1798,8 @@ void * mremap(void *old_address, size_t old_size ,
 #endif
 	void *rc;
 	int errno_sav;
-	struct map_rec key;
-	struct map_rec *map, **mptr;
+	struct map_rec *map;
+	struct split_file *sf = NULL;
 
 #ifdef linux
 	if(!driller_initialized || driller_malloc_installed) {
@@ -746,52 +1819,71 @@ void * mremap(void *old_address, size_t old_size ,
 	assert(flags == 0);
 #endif
 
-	/* identify affected mapping */
-	key.start = old_address;
-	key.end = key.start + old_size;
+	driller_malloc_install();
 
-	mptr = tfind(&key, &map_root, map_cmp);
-	map = (mptr != NULL ? *mptr : NULL);
+	/* identify affected mapping */
+	map = map_lookup(old_address, old_address + old_size, map_seq);
 	if(map == NULL)
 		/* not one of our mappings, ignore it */
 		goto do_remap;
 
-	/* rule out unlikely corner cases */
-	assert(map->start == key.start);
-	assert(map->end == key.end);
+	/* dlmalloc merges adjacent segments, so it may try to trim
+	 * a range made of several maps: refuse, it then falls back
+	 * to munmap, which knows how to handle that */
+	if(map->start != old_address
+	   || map->end != old_address + old_size) {
+		rc = MAP_FAILED;
+		errno_sav = ENOMEM;
+		goto out_restore;
+	}
+
+	/* a piece of a split map can only grow into the file if it
+	 * comes last there */
+	sf = map_is_pooled(map) ? NULL : map_split_file(map);
+	if(sf != NULL && new_size > old_size
+	   && map->offset + old_size != (off_t)sf->sf_map.end) {
+		rc = MAP_FAILED;
+		errno_sav = ENOMEM;
+		goto out_restore;
+	}
 
 do_remap:
 #ifdef linux
-	rc = old_mremap(old_address, old_size, new_size, flags);
+	if(map != NULL && map_is_pooled(map))
+		rc = map_pool_mremap(map, new_size, flags);
+	else
+		rc = old_mremap(old_address, old_size, new_size, flags);
 #else
 	rc = driller_mremap(map, new_size);
 #endif
 	errno_sav = errno;
 	if(rc == MAP_FAILED || map == NULL)
-		goto out;
+		goto out_restore;
 
 	/* file size must agree with mapping size */
-	if(ftruncate(map->fd, map->offset + new_size) != 0)
+	if(sf != NULL && map->offset + old_size != (off_t)sf->sf_map.end)
+		map_file_release(map, map->offset + page_round(new_size),
+				 page_round(old_size) - page_round(new_size));
+	else if(!map_is_pooled(map)
+		&& ftruncate(map->fd, map->offset + new_size) != 0)
 		perr("ftruncate");
+	if(sf != NULL && map->offset + old_size == (off_t)sf->sf_map.end)
+		sf->sf_map.end = (void *)(map->offset + new_size);
 
 	/* update map */
 	if(old_address == rc)
 		/* map did not move */
 		map->end = map->start + new_size;
 	else {
-		/* need to reinsert map to keep the map tree sorted */
-		void *rc2;
-
-		driller_malloc_install();
-		rc2 = tdelete(map, &map_root, map_cmp);
-		assert(rc2 != NULL);
+		/* need to reinsert map to keep the map index sorted */
+		map_index_remove(map);
 		map->start = rc;
 		map->end = map->start + new_size;
-		rc2 = tsearch((void *)map, &map_root, map_cmp);
-		assert(rc2 != NULL);
-		driller_malloc_restore();
+		map_index_insert(map);
 	}
 
+out_restore:
+	driller_malloc_restore();
 out:
 	dbg("mremap(%p, %zd, %zd, %x) = %p",
 	    old_address, old_size, new_size, flags, rc);
@@ -806,17 +1898,29 @@ out:
 static int driller_brk(void *end_data_segment){
 	uintptr_t new_size;
 
-	if(end_data_segment == map_heap->end)
+	/* there was no heap when we started: refuse to grow one that
+	 * we could not share, allocators fall back to mmap */
+	if(map_heap == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	if(end_data_segment == heap_brk)
 		return 0;
 	if(end_data_segment <= map_heap->start)
 		return 0;
 	new_size = end_data_segment - map_heap->start;
 	if(ftruncate(map_heap->fd, map_heap->offset + new_size) != 0)
 		perr("ftruncate");
-	if(mremap(map_heap->start, map_heap->end - map_heap->start,
-		  new_size, 0) == MAP_FAILED)
-		perr("mremap");
-	map_heap->end = end_data_segment;
+
+	/* the map only follows the break beyond the window, if any */
+	if(!heap_windowed || end_data_segment > map_heap->end) {
+		if(mremap(map_heap->start, map_heap->end - map_heap->start,
+			  new_size, 0) == MAP_FAILED)
+			perr("mremap");
+		map_heap->end = end_data_segment;
+		heap_windowed = 0;
+	}
+	heap_brk = end_data_segment;
 	dbg("heap end moves to %p", end_data_segment);
 	return 0;
 }
@@ -825,7 +1929,7 @@ int brk(void *end_data_segment){
 	int rc;
 
 	dbg("brk(%p)", end_data_segment);
-	if(!driller_initialized)
+	if(!driller_initialized || driller_selective)
 		return old_brk(end_data_segment);
 
 	driller_malloc_install();
@@ -837,7 +1941,13 @@ int brk(void *end_data_segment){
 static void *driller_sbrk(intptr_t increment){
 	void *old_brk;
 
-	old_brk = map_heap->end;
+	if(map_heap == NULL) {
+		if(increment == 0)
+			return old_sbrk(0);
+		errno = ENOMEM;
+		return (void*)-1;
+	}
+	old_brk = heap_brk;
 	if(increment == 0)
 		return old_brk;
 	if(driller_brk(old_brk + increment) == 0)
@@ -850,7 +1960,7 @@ void *sbrk(intptr_t increment){
 	void *rc;
 
 	dbg("sbrk(%ld)", increment);
-	if(!driller_initialized)
+	if(!driller_initialized || driller_selective)
 		return old_sbrk(increment);
 
 	driller_malloc_install();
@@ -859,6 +1969,223 @@ void *sbrk(intptr_t increment){
 	return rc;
 }
 
+/*
+ * copy the attributes of a new thread, except its stack,
+ * return 0 if the thread must keep the stack it would get from src
+ */
+static int thread_attr_copy(pthread_attr_t *dst, const pthread_attr_t *src) {
+	struct sched_param param;
+	size_t size;
+	void *addr;
+	int i;
+
+	/* thread has its own stack? glibc reports NULL - stacksize
+	 * when no stack was set */
+	if(pthread_attr_getstack(src, &addr, &size) != 0
+	   || (addr != NULL && addr + size != NULL))
+		return 0;
+
+	return pthread_attr_getdetachstate(src, &i) == 0
+		&& pthread_attr_setdetachstate(dst, i) == 0
+		&& pthread_attr_getstacksize(src, &size) == 0
+		&& pthread_attr_setstacksize(dst, size) == 0
+		&& pthread_attr_getguardsize(src, &size) == 0
+		&& pthread_attr_setguardsize(dst, size) == 0
+		&& pthread_attr_getscope(src, &i) == 0
+		&& pthread_attr_setscope(dst, i) == 0
+		&& pthread_attr_getinheritsched(src, &i) == 0
+		&& pthread_attr_setinheritsched(dst, i) == 0
+		&& pthread_attr_getschedpolicy(src, &i) == 0
+		&& pthread_attr_setschedpolicy(dst, i) == 0
+		&& pthread_attr_getschedparam(src, &param) == 0
+		&& pthread_attr_setschedparam(dst, &param) == 0;
+}
+
+/*
+ * start a thread with a stack of ours, recording who it is, so that
+ * we can tell when it is gone if it gets detached
+ */
+static void *thread_start(void *arg) {
+	struct thread_stack *ts = arg;
+
+	ts->ts_thread = pthread_self();
+#ifdef linux
+	ts->ts_tid = syscall(SYS_gettid);
+#endif
+	return ts->ts_start(ts->ts_arg);
+}
+
+/*
+ * unmap the stacks of detached threads that are gone: their task no
+ * longer exists, so the kernel is done clearing their tid, the last
+ * write to their stack; elsewhere, such stacks are never reclaimed
+ */
+static void thread_stacks_reap(void) {
+#ifdef linux
+	struct thread_stack *ts, **pts, *dead = NULL;
+
+	driller_malloc_install();
+	for(pts = &thread_stacks; (ts = *pts) != NULL; ) {
+		if(ts->ts_created && ts->ts_detached && ts->ts_tid != 0
+		   && syscall(SYS_tgkill, getpid(), ts->ts_tid, 0) != 0
+		   && errno == ESRCH) {
+			*pts = ts->ts_next;
+			ts->ts_next = dead;
+			dead = ts;
+		} else
+			pts = &ts->ts_next;
+	}
+	driller_malloc_restore();
+
+	/* not from driller code, munmap must see these maps */
+	while((ts = dead) != NULL) {
+		dead = ts->ts_next;
+		dbg("reap thread stack %p-%p", ts->ts_addr,
+		    ts->ts_addr + ts->ts_size);
+		if(munmap(ts->ts_addr, ts->ts_size) != 0)
+			perr("munmap");
+		free(ts);
+	}
+#endif
+}
+
+/*
+ * overload pthread_create
+ * the thread library maps stacks without calling mmap, so map them
+ * here instead, which makes them file-backed like any anonymous map
+ */
+int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+		   void *(*start_routine)(void *), void *arg) {
+	pthread_attr_t new_attr;
+	struct thread_stack *ts, **pts;
+	size_t size, guard;
+	void *addr;
+	int rc, detached;
+
+	if(!driller_initialized || driller_malloc_installed
+	   || driller_selective)
+		return old_pthread_create(thread, attr, start_routine, arg);
+
+	thread_stacks_reap();
+
+	if(pthread_attr_init(&new_attr) != 0)
+		return old_pthread_create(thread, attr, start_routine, arg);
+	if(attr != NULL && !thread_attr_copy(&new_attr, attr))
+		goto out_default;
+
+	if(pthread_attr_getstacksize(&new_attr, &size) != 0
+	   || pthread_attr_getguardsize(&new_attr, &guard) != 0
+	   || pthread_attr_getdetachstate(&new_attr, &detached) != 0)
+		goto out_default;
+	size = page_round(size);
+	guard = page_round(guard);
+
+	addr = mmap(NULL, guard + size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+	if(addr == MAP_FAILED)
+		goto out_default;
+	if(guard != 0 && mprotect(addr, guard, PROT_NONE) != 0)
+		perr("mprotect");
+	if(pthread_attr_setstack(&new_attr, addr + guard, size) != 0) {
+		if(munmap(addr, guard + size) != 0)
+			perr("munmap");
+		goto out_default;
+	}
+
+	/* listed before the thread starts, it may detach itself */
+	driller_malloc_install();
+	ts = malloc(sizeof(*ts));
+	assert(ts != NULL);
+	memset(ts, 0, sizeof(*ts));
+	ts->ts_addr = addr;
+	ts->ts_size = guard + size;
+	ts->ts_start = start_routine;
+	ts->ts_arg = arg;
+	/* reaped once gone, like threads given to pthread_detach */
+	ts->ts_detached = (detached == PTHREAD_CREATE_DETACHED);
+	ts->ts_next = thread_stacks;
+	thread_stacks = ts;
+	driller_malloc_restore();
+
+	rc = old_pthread_create(thread, &new_attr, thread_start, ts);
+	pthread_attr_destroy(&new_attr);
+	if(rc != 0) {
+		driller_malloc_install();
+		for(pts = &thread_stacks; *pts != ts; pts = &(*pts)->ts_next)
+			;
+		*pts = ts->ts_next;
+		driller_malloc_restore();
+		free(ts);
+		if(munmap(addr, guard + size) != 0)
+			perr("munmap");
+		return rc;
+	}
+	/* ts can be reaped from now on */
+	driller_malloc_install();
+	ts->ts_thread = *thread;
+	ts->ts_created = 1;
+	driller_malloc_restore();
+
+	dbg("thread stack %p-%p", addr + guard, addr + guard + size);
+	return rc;
+
+out_default:
+	/* let the thread library provide the stack */
+	dbg("thread gets an undrilled stack");
+	pthread_attr_destroy(&new_attr);
+	return old_pthread_create(thread, attr, start_routine, arg);
+}
+
+/*
+ * overload pthread_join
+ * unmap the stack of the thread if we mapped it
+ */
+int pthread_join(pthread_t thread, void **retval) {
+	struct thread_stack *ts, **pts;
+	int rc;
+
+	rc = old_pthread_join(thread, retval);
+	if(rc != 0 || !driller_initialized)
+		return rc;
+
+	driller_malloc_install();
+	for(pts = &thread_stacks; (ts = *pts) != NULL; pts = &ts->ts_next)
+		if(pthread_equal(ts->ts_thread, thread)) {
+			*pts = ts->ts_next;
+			break;
+		}
+	driller_malloc_restore();
+
+	if(ts != NULL) {
+		if(munmap(ts->ts_addr, ts->ts_size) != 0)
+			perr("munmap");
+		free(ts);
+	}
+	thread_stacks_reap();
+	return rc;
+}
+
+/*
+ * overload pthread_detach
+ * the stack of the thread, if we mapped it, is unmapped once the
+ * thread is gone, by a later pthread_create or pthread_join
+ */
+int pthread_detach(pthread_t thread) {
+	struct thread_stack *ts;
+	int rc;
+
+	rc = old_pthread_detach(thread);
+	if(rc != 0 || !driller_initialized)
+		return rc;
+
+	driller_malloc_install();
+	for(ts = thread_stacks; ts != NULL; ts = ts->ts_next)
+		if(pthread_equal(ts->ts_thread, thread))
+			ts->ts_detached = 1;
+	driller_malloc_restore();
+	return rc;
+}
+
 /******************/
 
 static void * get_sym(const char *symbol) {
@@ -883,47 +2210,140 @@ static void driller_init_syms(void) {
 #endif
 	old_brk = get_sym("brk");
 	old_sbrk = get_sym("sbrk");
-}
-
-static void
-map_rebuild_action(const void *nodep, const VISIT which, const int depth) {
-	static int map_idx;
-
-	switch(which) {
-	case preorder:
-		break;
-	case postorder:
-		map_rebuild(*(struct map_rec**)nodep, map_idx++);
-		break;
-	case endorder:
-		break;
-	case leaf:
-		map_rebuild(*(struct map_rec**)nodep, map_idx++);
-		break;
-	}
+	old_pthread_create = get_sym("pthread_create");
+	old_pthread_join = get_sym("pthread_join");
+	old_pthread_detach = get_sym("pthread_detach");
 }
 
 void driller_init(void) {
+	void * volatile p;
+	int i;
 
 	page_size = sysconf(_SC_PAGESIZE);
 
-	/* force first call to brk, so heap becomes visible */
-	free(malloc(1));
+	/* force first call to brk, so heap becomes visible
+	 * (volatile: the compiler would drop a plain malloc/free pair) */
+	p = malloc(1);
+	free(p);
 
+	/* no locking inside, driller_lock protects it */
 	driller_mspace = create_mspace(0, 0);
 	driller_malloc_install();
 
+	map_pool_init();
+	fd_cache_init();
+
 	/* analyze own mappings */
 	map_parse();
 
 	/* replace own mappings */
-	twalk(map_root, map_rebuild_action);
+	for(i = 0; i < map_count; i++)
+		map_rebuild(map_recs[i], i);
+	map_pages_done();
+	dbg("rebuild copied %zd kB, skipped %zd kB",
+	    rebuild_copied >> 10, rebuild_skipped >> 10);
+
+	driller_malloc_restore();
+
+	driller_initialized = 1;
+}
+
+/*
+ * tell how many bytes of the maps found at init were copied to their
+ * new files, and how many were left as holes
+ */
+void driller_rebuild_stats(size_t *copied, size_t *skipped) {
+	*copied = rebuild_copied;
+	*skipped = rebuild_skipped;
+}
+
+/*
+ * initialize driller without touching any existing map: only regions
+ * given to driller_register_region, and anonymous maps of at least
+ * threshold bytes created from now on, are shared; the heap and the
+ * stacks remain private
+ */
+void driller_init_selective(size_t threshold) {
+	page_size = sysconf(_SC_PAGESIZE);
+
+	/* no locking inside, driller_lock protects it */
+	driller_mspace = create_mspace(0, 0);
+	driller_malloc_install();
+
+	map_pool_init();
+	fd_cache_init();
 
 	driller_malloc_restore();
 
+	map_threshold = max(threshold, (size_t)1);
+	driller_selective = 1;
 	driller_initialized = 1;
 }
 
+/*
+ * share the existing memory in [start-start+length], rounded to
+ * pages, which must be private and readable, with the same protection
+ * all along, which it keeps; it must not be written meanwhile (e.g. by
+ * another thread, or as the current stack frame)
+ * return 0 on success, or -1 with errno set
+ */
+int driller_register_region(void *start, size_t length) {
+	void *end;
+	off_t offset;
+	struct map_rec *map;
+	int fd, prot, rc = 0, errno_sav;
+
+	end = (void *)page_round((uintptr_t)start + length);
+	start = (void *)((uintptr_t)start & ~((uintptr_t)page_size - 1));
+	if(!driller_initialized || start == end) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	driller_malloc_install();
+
+	map = map_lookup(start, end, map_seq);
+	if(map != NULL) {
+		/* shared already, but it can't be extended */
+		if(map->start > start || map->end < end) {
+			rc = -1;
+			errno_sav = EINVAL;
+		}
+		goto out;
+	}
+
+	prot = map_prot(start, end);
+	if(prot < 0 || !(prot & PROT_READ)) {
+		rc = -1;
+		errno_sav = EACCES;
+		goto out;
+	}
+
+	offset = map_pool_alloc(end - start);
+	if(offset >= 0)
+		fd = map_pool.fd;
+	else {
+		offset = 0;
+		fd = driller_create_fd("shmem-%d-region", getpid());
+	}
+
+	/* the region may be part of a file map, whose untouched pages
+	 * aren't empty */
+	map_copy(fd, start, end - start, offset, 0);
+	if(old_mmap(start, end - start, prot,
+		    MAP_SHARED | MAP_FIXED, fd, offset) == MAP_FAILED)
+		perr("mmap");
+	map = map_record(start, end, prot, offset, "", fd);
+	assert(map != NULL);
+	dbg("registered region %p-%p", start, end);
+
+out:
+	driller_malloc_restore();
+	if(rc != 0)
+		errno = errno_sav;
+	return rc;
+}
+
 /*
  * register a callback
  * this callback notifies the user that a map has been changed or removed
@@ -933,18 +2353,42 @@ void driller_register_map_invalidate_cb(void (*f)(struct map_rec *map)) {
 }
 
 /*
- * find the map record for a given memory range
+ * find the map record for a given memory range, without taking the
+ * lock: the record is pinned, it stays valid until the caller gives
+ * it to driller_put_map, even if the map goes away meanwhile
  */
 struct map_rec *driller_lookup_map(void *start, size_t length) {
-	struct map_rec key, **mptr;
+	struct map_rec *map;
+	unsigned int seq;
+
+	for(;;) {
+		while((seq = map_seq) & 1)
+			nop();
+		mb();
+		map = map_lookup(start, start + length, seq);
+		if(map != NULL)
+			__sync_fetch_and_add(&map_node(map)->mn_pins, 1);
+		mb();
+		if(map_seq == seq)
+			return map;
+		/* the index changed, what we found may be stale */
+		if(map != NULL)
+			driller_put_map(map);
+	}
+}
 
-	key.start = start;
-	key.end = key.start + length;
-	mptr = tfind(&key, &map_root, map_cmp);
-	if(mptr == NULL)
-		return NULL;
-	else
-		return *mptr;
+/*
+ * unpin a record from driller_lookup_map
+ */
+void driller_put_map(struct map_rec *map) {
+	struct map_node *mn = map_node(map);
+
+	if(__sync_sub_and_fetch(&mn->mn_pins, 1) != 0
+	   || mn->mn_state != MAP_DEAD)
+		return;
+	driller_malloc_install();
+	map_rec_recycle(mn);
+	driller_malloc_restore();
 }
 
 /*
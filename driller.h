@@ -22,11 +22,18 @@ struct map_rec {
 };
 
 extern void driller_init(void);
+extern void driller_init_selective(size_t threshold);
+extern int driller_register_region(void *start, size_t length);
 extern void driller_register_map_invalidate_cb(void (*f)(struct map_rec *map));
 extern struct map_rec *driller_lookup_map(void *start, size_t length);
+extern void driller_put_map(struct map_rec *map);
 extern void *driller_install_map(struct map_rec *map);
 extern void driller_remove_map(struct map_rec *map, void *p);
 extern void *driller_malloc(size_t bytes);
 extern void driller_free(void *mem);
+extern int driller_create_fd(char *fmt, ...);
+extern struct map_rec *driller_map_pool(struct map_rec *map);
+extern int driller_map_recycled(struct map_rec *map);
+extern void driller_rebuild_stats(size_t *copied, size_t *skipped);
 
 #endif /* DRILLER_H */
@@ -17,8 +17,11 @@ enum overload_t {
 	OVERLOAD_STACK,
 };
 
-extern void map_record(void *start, void *end, int prot, off_t offset,
+extern struct map_rec *map_record(void *start, void *end, int prot, off_t offset,
 		       char *path, int fd);
 extern void map_parse(void);
+extern int map_prot(void *start, void *end);
+extern int map_pages_used(void *start, size_t npages, unsigned char *used);
+extern void map_pages_done(void);
 
 #endif /* DRILLER_INTERNAL_H */
@@ -13,22 +13,99 @@
  */
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <assert.h>
 #include <poll.h>
-#include <search.h>
+#include <stdint.h>
+#ifdef linux
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#endif
 
 #include "log.h"
 #include "tunables.h"
 #include "fdproxy.h"
 #include "fdproxy_internal.h"
+#include "keyhash.h"
+#include "spinlock.h"
 
 static int fdproxy_id;
 static int client_sock = -1;
 static int server_sock = -1;
-static int fdtable_hsize = FDTABLE_HSIZE_INIT;
-static char keystr_buf[30];
+static struct keyhash fdtable;
+static char keystr_buf[40];
+
+/* client: fds fetched from the daemon, until it tells us to drop them */
+static struct keyhash fdcache;
+static unsigned int fdkey_gen;
+
+/* daemon: connection table, slots of closed connections have sock -1 */
+static struct connection_context *clients;
+static int nclients;	/* slots in use or free */
+static int maxclients;	/* slots allocated */
+static int nactive;	/* open connections */
+
+/*
+ * pidfd mode: on Linux 5.6 and later, a client can pull a fd straight
+ * out of its owner with pidfd_getfd(2), so keys made by
+ * fdproxy_client_send_fd are never registered with the daemon: they
+ * already hold the owner (pid, fd), which is all a peer needs
+ *
+ * each client maps a key table, TMPDIR/fdproxy-<id>-<pid>, where the
+ * entry for a fd num holds the generation of the key made for it, or 0
+ * once invalidated: the owner clears it before it closes the fd, so a
+ * peer that finds it unchanged after pidfd_getfd knows that it got the
+ * right file, and not one that reused the fd num; the daemon removes
+ * the table when its owner disconnects
+ *
+ * the daemon remains in charge of well-known keys, and of fds too
+ * large for the key table; other keys are never registered there, so
+ * if pidfd_getfd fails, the key is just not found; the mode is decided
+ * with tests that give the same answer to all processes of a job on a
+ * given host (kernel, yama policy, environment), so that no client
+ * ever asks the daemon for a key its owner did not register there
+ */
+#if defined(linux) && defined(SYS_pidfd_open) && defined(SYS_pidfd_getfd)
+#define HAVE_PIDFD 1
+#endif
+
+#ifdef HAVE_PIDFD
+static int fdproxy_pidfd;
+
+#define KEYTAB_BYTES (FDPROXY_KEYTAB_SIZE * sizeof(unsigned int))
+
+/* our own key table */
+static unsigned int *keytab;
+
+/* pidfds and key tables of the peers we fetched fds from */
+static struct pidfd_peer {
+	pid_t pid;
+	int pidfd;
+	unsigned int *keytab;
+} pidfd_cache[PIDFD_CACHE_SIZE];
+static int pidfd_cache_next;
+
+static void keytab_path(char *path, pid_t pid) {
+	snprintf(path, PATH_MAX, "%s/fdproxy-%d-%d",
+		 TMPDIR, fdproxy_id, (int)pid);
+}
+
+/*
+ * tell if key is served by its owner through pidfd_getfd,
+ * rather than by the daemon
+ */
+static int pidfd_key(struct fdkey *key) {
+	return fdproxy_pidfd && key->pid != FDKEY_WELLKNOWN
+		&& key->fd >= 0 && key->fd < FDPROXY_KEYTAB_SIZE;
+}
+#else
+#define fdproxy_pidfd 0
+#define pidfd_key(key) 0
+#endif
 
 /*
  * give a specific id to a fd key
@@ -36,6 +113,7 @@ static char keystr_buf[30];
 void fdproxy_set_key_id(struct fdkey *key, int id) {
 	key->pid = FDKEY_WELLKNOWN;
 	key->fd = id;
+	key->gen = 0;
 }
 
 /*
@@ -45,125 +123,126 @@ char *fdproxy_keystr(struct fdkey *key) {
 	int len;
 
 	len = snprintf(keystr_buf, sizeof(keystr_buf),
-		       "%d/%d", key->pid, key->fd);
+		       "%d/%d/%u", key->pid, key->fd, key->gen);
 	assert(len < sizeof(keystr_buf));
 	return keystr_buf;
 }
 
 static void fdtable_init(void) {
-	int rc;
+	keyhash_init(&fdtable, FDTABLE_HSIZE_INIT);
+}
+
+static void fdproxy_push(int slot, struct fdkey *key);
 
-	rc = hcreate(fdtable_hsize);
-	assert(rc != 0);
+/*
+ * tell the clients that fetched the fd of fe, except client except,
+ * to drop it, then close it
+ */
+static void fdtable_release(struct fdtable_entry *fe, struct fdkey *key,
+			    int except) {
+	int i;
+
+	for(i = 0; i < fe->nsubs; i++)
+		if(fe->subs[i] != except)
+			fdproxy_push(fe->subs[i], key);
+	fe->nsubs = 0;
+	if(close(fe->fd) != 0)
+		perr("close");
 }
 
 /*
  * record a (key, fd) pair
  */
 static void fdtable_hash(int fd, struct fdkey *key) {
-	char *buf;
-	ENTRY e, *ep;
-
-	buf = fdproxy_keystr(key);
-
-	dbg("add <%s> = %d", buf, fd);
-
-	e.key = buf;
-	ep = hsearch(e, FIND);
-	if(ep != NULL) {
-		ep->data = (void*)(long)fd;
+	struct fdtable_entry *fe;
+	void *data;
+
+	dbg("add <%s> = %d", fdproxy_keystr(key), fd);
+	if(keyhash_find(&fdtable, key, &data)) {
+		/* a well-known id sent again, the old fd is stale */
+		fe = data;
+		fdtable_release(fe, key, -1);
+		fe->fd = fd;
 		return;
 	}
 
-	e.key = strdup(buf);
-	e.data = (void*)(long)fd;
-	assert(e.key != NULL);
-	ep = hsearch(e, ENTER);
-	if(ep == NULL) {
-		/* retry with larger htable */
-		fdtable_hsize += fdtable_hsize/2;
-		if(hcreate(fdtable_hsize) == 0)
-			err("cannot grow htable (size=%d)",
-			    fdtable_hsize);
-		ep = hsearch(e, ENTER);
-		if(ep == NULL)
-			err("cannot insert into htable (size=%d)",
-			    fdtable_hsize);
-	}
+	fe = malloc(sizeof(*fe));
+	if(fe == NULL)
+		err("cannot allocate fd table entry");
+	fe->fd = fd;
+	fe->nsubs = 0;
+	fe->maxsubs = 0;
+	fe->subs = NULL;
+	keyhash_insert(&fdtable, key, fe);
 }
 
 /*
- * find and return fd matching key
+ * find and return entry matching key
  */
-static int fdtable_lookup(struct fdkey *key) {
-	char *buf;
-	ENTRY e, *ep;
-	int fd;
-
-	buf = fdproxy_keystr(key);
-
-	e.key = buf;
-	ep = hsearch(e, FIND);
-	if(ep != NULL)
-		fd = (int)(long)ep->data;
-	else {
-		dbg("cannot find '%s' in htable", buf);
-		fd = -1;
-	}
-	dbg("lookup <%s> = %d", buf, fd);
-	return fd;
+static struct fdtable_entry *fdtable_lookup(struct fdkey *key) {
+	void *data;
+
+	if(!keyhash_find(&fdtable, key, &data))
+		data = NULL;
+	dbg("lookup <%s> = %d", fdproxy_keystr(key),
+	    data ? ((struct fdtable_entry *)data)->fd : -1);
+	return data;
 }
 
 /*
- * remove record of (key, fd) pair
+ * remember that a client fetched the fd of fe
  */
-static int fdtable_unhash(struct fdkey *key) {
-	char *buf;
-	ENTRY e, *ep;
-	int fd;
+static void fdtable_subscribe(struct fdtable_entry *fe, int slot) {
+	int i;
 
-	buf = fdproxy_keystr(key);
-
-	e.key = buf;
-	ep = hsearch(e, FIND);
-	if(ep != NULL) {
-		fd = (int)(long)ep->data;
-		ep->data = (void*)(long)-1;
-	} else {
-		dbg("cannot find '%s' in htable", buf);
-		fd = -1;
+	for(i = 0; i < fe->nsubs; i++)
+		if(fe->subs[i] == slot)
+			return;
+	if(fe->nsubs == fe->maxsubs) {
+		fe->maxsubs = fe->maxsubs ? 2 * fe->maxsubs : 4;
+		fe->subs = realloc(fe->subs, fe->maxsubs * sizeof(*fe->subs));
+		if(fe->subs == NULL)
+			err("cannot grow subscriber table to %d", fe->maxsubs);
 	}
-	dbg("unhash <%s> = %d", buf, fd);
-	return fd;
+	fe->subs[fe->nsubs++] = slot;
 }
 
 /*
- * unhash and close fd for the given key
+ * unhash and close fd for the given key, on behalf of client except
  */
-static void fdtable_invalidate(struct fdkey *key) {
-	int fd;
+static void fdtable_invalidate(struct fdkey *key, int except) {
+	struct fdtable_entry *fe;
+	void *data;
 
 	dbg("invalidate <%s>", fdproxy_keystr(key));
-	fd = fdtable_unhash(key);
-	if(fd != -1) {
-		if(close(fd) != 0)
-			perr("close");
-	}
+	if(!keyhash_remove(&fdtable, key, &data))
+		return;
+	fe = data;
+	fdtable_release(fe, key, except);
+	free(fe->subs);
+	free(fe);
 }
 
 /* recv_request, send_request implement fd passing with UNIX socket ancillary data
-   see unix(7) cmsg(3) recvmsg(2) readv(2) */
-static void recv_request(int sock, void *buf, size_t buflen,
-			 int *fds, size_t fd_len) {
+   see unix(7) cmsg(3) recvmsg(2) readv(2)
+   sockets are SOCK_SEQPACKET, so each call moves one whole request
+   along with all its fds */
+
+/*
+ * receive one request, and its fds into fds (FDPROXY_MAX_BATCH slots)
+ * return the request length, 0 on EOF, or -1 if flags has MSG_DONTWAIT
+ * and there is nothing to read
+ */
+static ssize_t recv_request(int sock, struct fdproxy_request *req,
+			    int *fds, int *nfds, int flags) {
 	struct msghdr msgh;
 	struct iovec iov;
 	struct cmsghdr *cmsg;
-	size_t ctl_size = sizeof(*fds) * fd_len;
-	char ctl_buf[CMSG_SPACE(ctl_size)];
-	size_t len;
+	char ctl_buf[CMSG_SPACE(sizeof(*fds) * FDPROXY_MAX_BATCH)];
+	ssize_t len;
 
-	iov.iov_base = buf;
-	iov.iov_len = buflen;
+	iov.iov_base = req;
+	iov.iov_len = sizeof(*req);
 
 	memset(&msgh, 0, sizeof(msgh));
 	msgh.msg_iov = &iov;
@@ -171,17 +250,27 @@ static void recv_request(int sock, void *buf, size_t buflen,
 	msgh.msg_control = ctl_buf;
 	msgh.msg_controllen = sizeof(ctl_buf);
 
-	len = recvmsg(sock, &msgh, 0);
-	if(len == (size_t) (-1))
+	*nfds = 0;
+	len = recvmsg(sock, &msgh, flags);
+	if(len < 0) {
+		if(errno == EAGAIN && (flags & MSG_DONTWAIT))
+			return -1;
+		/* the peer closed without reading all our messages */
+		if(errno == ECONNRESET)
+			return 0;
 		perr("recvmsg");
-	if(len != buflen)
-		err("len (%zd) != buflen (%zd)", len, buflen);
-	if(fd_len == 0)
-		return;
+	}
+	if(len == 0)
+		return 0;
+	if(msgh.msg_flags & MSG_TRUNC)
+		err("request too long");
 	if(msgh.msg_flags & MSG_CTRUNC)
 		err("msgh.flags has MSG_CTRUNC:"
 		    " check the number of open file descriptors");
-	assert(msgh.msg_controllen >= sizeof(struct cmsghdr));
+	if(len < REQUEST_HDR_SIZE || req->magic != REQUEST_MAGIC)
+		err("bad request (%zd bytes)", len);
+	if(req->count < 0 || req->count > FDPROXY_MAX_BATCH)
+		err("bad request count %d", req->count);
 
 	for(cmsg = CMSG_FIRSTHDR(&msgh);
 	     cmsg != NULL;
@@ -189,237 +278,720 @@ static void recv_request(int sock, void *buf, size_t buflen,
 
 		if(cmsg->cmsg_level == SOL_SOCKET
 		   && cmsg->cmsg_type == SCM_RIGHTS) {
-			assert(cmsg->cmsg_len == CMSG_LEN(ctl_size));
-			memcpy(fds, CMSG_DATA(cmsg), ctl_size);
-			return;
+			*nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(*fds);
+			memcpy(fds, CMSG_DATA(cmsg), *nfds * sizeof(*fds));
+			break;
 		}
 	}
-
-	err("inconsistent cmsg structure");
+	return len;
 }
 
-static void send_request(int sock, void *buf, size_t buflen,
-			 int *fds, size_t fd_len) {
+static void send_request(int sock, struct fdproxy_request *req, size_t len,
+			 int *fds, int nfds) {
 	struct msghdr msgh;
 	struct iovec iov;
 	struct cmsghdr *cmsg;
-	size_t ctl_size = sizeof(*fds) * fd_len;
-	char ctl_buf[CMSG_SPACE(ctl_size)];
-	size_t len;
+	size_t ctl_size = sizeof(*fds) * nfds;
+	char ctl_buf[CMSG_SPACE(sizeof(*fds) * FDPROXY_MAX_BATCH)];
+	ssize_t rc;
 
-	iov.iov_base = buf;
-	iov.iov_len = buflen;
+	assert(nfds <= FDPROXY_MAX_BATCH);
+	req->magic = REQUEST_MAGIC;
+	iov.iov_base = req;
+	iov.iov_len = len;
 
 	memset(&msgh, 0, sizeof(msgh));
 	msgh.msg_iov = &iov;
 	msgh.msg_iovlen = 1;
-	msgh.msg_control = ctl_buf;
-	msgh.msg_controllen = sizeof(ctl_buf);
-
-	cmsg = CMSG_FIRSTHDR(&msgh);
-	cmsg->cmsg_level = SOL_SOCKET;
-	cmsg->cmsg_type = SCM_RIGHTS;
-	cmsg->cmsg_len = CMSG_LEN(ctl_size);
-	msgh.msg_controllen = cmsg->cmsg_len;
-	memcpy(CMSG_DATA(cmsg), fds, ctl_size);
+	if(nfds > 0) {
+		msgh.msg_control = ctl_buf;
+		msgh.msg_controllen = CMSG_SPACE(ctl_size);
+		cmsg = CMSG_FIRSTHDR(&msgh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(ctl_size);
+		msgh.msg_controllen = cmsg->cmsg_len;
+		memcpy(CMSG_DATA(cmsg), fds, ctl_size);
+	}
 
-	len = sendmsg(sock, &msgh, 0);
-	if(len == (size_t) (-1))
+	rc = sendmsg(sock, &msgh, 0);
+	if(rc < 0)
 		perr("sendmsg");
-	if(len != buflen)
-		err("sendmsg returned %zd expected %zd", len, buflen);
+	if(rc != len)
+		err("sendmsg returned %zd expected %zd", rc, len);
 }
 
 /*
- * daemon: receive fd after reception of FD_NEW_KEY
+ * daemon: return the type of the next request of a client without
+ * consuming it, or -1 if there is none
  */
-static int fdproxy_server_get_fd(int sock, struct fdkey *key) {
+static int peek_request_type(int sock) {
 	struct fdproxy_request req;
-	int fd;
+	ssize_t len;
 
-	/* expect FD_ADD_KEY with ancillary fd */
-	recv_request(sock, &req, sizeof(req), &fd, 1);
-	assert(req.magic == REQUEST_MAGIC);
-	assert(req.type == FD_ADD_KEY);
-	assert(memcmp(&req.key, key, sizeof(*key)) == 0);
-	return fd;
+	/* no room for ancillary data: peeked fds are not installed */
+	len = recv(sock, &req, REQUEST_HDR_SIZE, MSG_PEEK | MSG_DONTWAIT);
+	if(len < REQUEST_HDR_SIZE)
+		return -1;
+	return req.type;
 }
 
+#ifdef linux
+static int epoll_fd = -1;
+#endif
+static int push_pending;	/* some client has queued pushes */
+
 /*
- * daemon: send ACK after reception of FD_ADD_KEY
+ * daemon: wait for a client socket to be writable only while a flush
+ * is pending, since unix sockets signal that after every read
  */
-static void fdproxy_server_get_fd_ack(int sock, struct fdkey *key) {
-	struct fdproxy_request req;
+static void fdproxy_watch(struct connection_context *cl) {
+#ifdef linux
+	struct epoll_event ev;
 
-	/* send ack to FD_ADD_KEY */
-	req.magic = REQUEST_MAGIC;
-	req.key = *key;
-	req.type = FD_ADD_KEY_ACK;
-	send_request(sock, &req, sizeof(req), NULL, 0);
+	if(epoll_fd == -1)
+		return;
+	ev.events = EPOLLIN | EPOLLET | (cl->flush ? EPOLLOUT : 0);
+	ev.data.u32 = cl - clients;
+	if(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, cl->sock, &ev))
+		perr("epoll_ctl");
+#endif
 }
 
 /*
- * daemon: send key after reception of FD_REQ_KEY
+ * daemon: send queued invalidations to a client without blocking,
+ * since it only reads them when it calls us; if its socket is full,
+ * it will have to drop all its cache instead, when it can read again
  */
-static void fdproxy_server_send_fd(int sock, int fd, struct fdkey *key) {
-	struct fdproxy_request req;
+static void fdproxy_push_send(struct connection_context *cl) {
+	struct fdproxy_request *req = &cl->push;
+	ssize_t len, rc;
+
+	req->magic = REQUEST_MAGIC;
+	req->type = FD_INVAL_KEYS;
+	if(cl->flush) {
+		req->flags = FDREQ_FLUSH;
+		req->count = 0;
+	} else
+		req->flags = 0;
+	if(req->count == 0 && !cl->flush)
+		return;
 
-	/* send response to FD_REQ_KEY */
-	req.magic = REQUEST_MAGIC;
-	req.key = *key;
-	if(fd >= 0) {
-		req.type = FD_RSP_KEYFOUND;
-		send_request(sock, &req, sizeof(req), NULL, 0);
-
-		req.type = FD_RSP_KEY;
-		send_request(sock, &req, sizeof(req), &fd, 1);
-	} else {
-		req.type = FD_RSP_NOKEY;
-		send_request(sock, &req, sizeof(req), NULL, 0);
+	len = REQUEST_KEYS_SIZE(req->count);
+	rc = send(cl->sock, req, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+	req->count = 0;
+	if(rc == len) {
+		if(cl->flush) {
+			cl->flush = 0;
+			fdproxy_watch(cl);
+		}
+	} else if(rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		if(!cl->flush) {
+			dbg("client %d is full, will flush", (int)(cl - clients));
+			cl->flush = 1;
+			fdproxy_watch(cl);
+		}
+	} else if(rc < 0 && errno != EPIPE && errno != ECONNRESET)
+		perr("send");
+}
+
+/*
+ * daemon: queue an invalidation of key for a client
+ */
+static void fdproxy_push(int slot, struct fdkey *key) {
+	struct connection_context *cl = clients + slot;
+
+	/* gone, or will drop everything anyway */
+	if(cl->sock == -1 || cl->flush)
+		return;
+	cl->push.u.keys[cl->push.count++] = *key;
+	push_pending = 1;
+	if(cl->push.count == FDPROXY_MAX_BATCH)
+		fdproxy_push_send(cl);
+}
+
+static void fdproxy_push_all(void) {
+	int i;
+
+	if(!push_pending)
+		return;
+	push_pending = 0;
+	for(i = 0; i < nclients; i++)
+		if(clients[i].sock != -1 && clients[i].push.count > 0)
+			fdproxy_push_send(clients + i);
+}
+
+static int fdproxy_handle_in(struct connection_context *cl);
+
+/*
+ * daemon: a key can miss from the table because its owner never
+ * registered it, but also because its FD_ADD_KEYS is still queued:
+ * since no client waits for an ack, the owner may have passed the key
+ * to a peer whose request we read first; the owner sent it before,
+ * so it is readable now, and we process all pending FD_ADD_KEYS and
+ * FD_INVAL_KEYS before answering
+ *
+ * other requests stay queued: they could miss keys themselves
+ */
+static void fdproxy_server_drain(void) {
+	int i, type, progress;
+
+	do {
+		progress = 0;
+		for(i = 0; i < nclients; i++) {
+			if(clients[i].sock == -1)
+				continue;
+			type = peek_request_type(clients[i].sock);
+			if(type == FD_ADD_KEYS || type == FD_INVAL_KEYS) {
+				fdproxy_handle_in(clients + i);
+				progress = 1;
+			}
+		}
+	} while(progress);
+}
+
+/*
+ * daemon: record fds after reception of FD_ADD_KEYS
+ */
+static void fdproxy_server_add(int sock, struct fdproxy_request *req,
+			       int *fds, int nfds) {
+	int i;
+
+	if(nfds != req->count)
+		err("FD_ADD_KEYS: %d keys but %d fds", req->count, nfds);
+	for(i = 0; i < nfds; i++)
+		fdtable_hash(fds[i], &req->u.keys[i]);
+
+	if(req->flags & FDREQ_ACK) {
+		req->type = FD_ADD_KEYS_ACK;
+		req->count = 0;
+		send_request(sock, req, REQUEST_HDR_SIZE, NULL, 0);
 	}
 }
 
 /*
- * update client state when receiving messages
+ * daemon: send fds after reception of FD_REQ_KEYS
  */
-static void fdproxy_handle_in(struct connection_context *cl) {
-	struct fdproxy_request req;
-	int fd;
+static void fdproxy_server_send(struct connection_context *cl,
+				struct fdproxy_request *req) {
+	struct fdproxy_request rsp;
+	struct fdtable_entry *fe;
+	int i, nfds, drained;
+	int fds[FDPROXY_MAX_BATCH];
+
+	rsp.type = FD_RSP_KEYS;
+	rsp.flags = 0;
+	rsp.count = req->count;
+	drained = 0;
+	for(i = 0, nfds = 0; i < req->count; i++) {
+		fe = fdtable_lookup(&req->u.keys[i]);
+		if(fe == NULL && !drained) {
+			fdproxy_server_drain();
+			drained = 1;
+			fe = fdtable_lookup(&req->u.keys[i]);
+		}
+		rsp.u.found[i] = fe != NULL;
+		if(fe != NULL) {
+			fds[nfds++] = fe->fd;
+			fdtable_subscribe(fe, cl - clients);
+		}
+	}
+	send_request(cl->sock, &rsp, REQUEST_FOUND_SIZE(rsp.count), fds, nfds);
+}
 
-	switch(cl->state) {
-	case STATE_IDLE:
-		recv_request(cl->sock, &req, sizeof(req), NULL, 0);
-		assert(req.magic == REQUEST_MAGIC);
-		switch(req.type) {
-		case FD_NEW_KEY:
-			cl->state = STATE_RCV_NEW_KEY;
-			cl->rcvd_key = req.key;
-			break;
-		case FD_REQ_KEY:
-			cl->state = STATE_RCV_REQ_KEY;
-			cl->rcvd_key = req.key;
-			break;
-		case FD_INVAL_KEY:
-			fdtable_invalidate(&req.key);
-			break;
-		default:
-			err("bad request %d", req.type);
+/*
+ * process the next request of a client, if any,
+ * return 0 once there is nothing left to read
+ */
+static int fdproxy_handle_in(struct connection_context *cl) {
+	struct fdproxy_request req;
+	int i, fds[FDPROXY_MAX_BATCH], nfds;
+	ssize_t len;
+
+	len = recv_request(cl->sock, &req, fds, &nfds, MSG_DONTWAIT);
+	if(len < 0)
+		return 0;
+	if(len == 0) {
+		dbg("client %d closed its connection", (int)(cl - clients));
+#ifdef HAVE_PIDFD
+		if(cl->pid > 0) {
+			char path[PATH_MAX];
+
+			keytab_path(path, cl->pid);
+			unlink(path);
 		}
-		break;
+#endif
+		close(cl->sock);
+		cl->sock = -1;
+		nactive--;
+		return 0;
+	}
+	if(len != REQUEST_KEYS_SIZE(req.count))
+		err("bad request length %zd for %d keys", len, req.count);
+	if(nfds > 0 && req.type != FD_ADD_KEYS)
+		err("request %d has %d fds", req.type, nfds);
 
-	case STATE_RCV_NEW_KEY:
-		fd = fdproxy_server_get_fd(cl->sock, &cl->rcvd_key);
-		fdtable_hash(fd, &cl->rcvd_key);
-		cl->state = STATE_RCV_ADD_KEY;
+	switch(req.type) {
+	case FD_ADD_KEYS:
+		fdproxy_server_add(cl->sock, &req, fds, nfds);
+		break;
+	case FD_REQ_KEYS:
+		fdproxy_server_send(cl, &req);
+		break;
+	case FD_INVAL_KEYS:
+		for(i = 0; i < req.count; i++)
+			fdtable_invalidate(&req.u.keys[i], cl - clients);
 		break;
-
 	default:
-		err("bad client state: %d", cl->state);
+		err("bad request %d", req.type);
 	}
+	fdproxy_push_all();
+	return 1;
+}
+
+#ifdef HAVE_PIDFD
+static int sys_pidfd_open(pid_t pid) {
+	return syscall(SYS_pidfd_open, pid, 0);
+}
+
+static int sys_pidfd_getfd(int pidfd, int fd) {
+	return syscall(SYS_pidfd_getfd, pidfd, fd, 0);
 }
 
 /*
- * update client state when sending messages
+ * map the key table of pid, return NULL if it has none
  */
-static void fdproxy_handle_out(struct connection_context *cl) {
+static unsigned int *keytab_map(pid_t pid, int flags) {
+	char path[PATH_MAX];
+	void *tab;
 	int fd;
 
-	switch(cl->state) {
-	case STATE_RCV_REQ_KEY:
-		fd = fdtable_lookup(&cl->rcvd_key);
-		fdproxy_server_send_fd(cl->sock, fd, &cl->rcvd_key);
-		cl->state = STATE_IDLE;
-		memset(&cl->rcvd_key, 0, sizeof(cl->rcvd_key));
-		break;
-	case STATE_RCV_ADD_KEY:
-		fdproxy_server_get_fd_ack(cl->sock, &cl->rcvd_key);
-		cl->state = STATE_IDLE;
-		memset(&cl->rcvd_key, 0, sizeof(cl->rcvd_key));
-		break;
+	keytab_path(path, pid);
+	fd = open(path, O_RDWR | flags, 0600);
+	if(fd < 0)
+		return NULL;
+	if((flags & O_CREAT) && ftruncate(fd, KEYTAB_BYTES) != 0)
+		perr("ftruncate");
+	tab = mmap(NULL, KEYTAB_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   fd, 0);
+	close(fd);
+	return tab != MAP_FAILED ? tab : NULL;
+}
 
-	default:
-		err("bad client state: %d", cl->state);
+/*
+ * client: make our key table, dropping the one of our parent
+ */
+static void keytab_create(void) {
+	char path[PATH_MAX];
+
+	if(keytab != NULL)
+		munmap(keytab, KEYTAB_BYTES);
+	/* a new file: peers may still map the table of a dead
+	 * process that had our pid */
+	keytab_path(path, getpid());
+	unlink(path);
+	keytab = keytab_map(getpid(), O_CREAT | O_EXCL);
+	if(keytab == NULL)
+		err("cannot create fdproxy key table %s", path);
+}
+
+/*
+ * return the pidfd and key table of the given pid,
+ * opening and caching them if needed
+ */
+static struct pidfd_peer *pidfd_lookup(pid_t pid) {
+	struct pidfd_peer *peer;
+	unsigned int *tab;
+	int i, pidfd;
+
+	for(i = 0; i < PIDFD_CACHE_SIZE; i++)
+		if(pidfd_cache[i].pidfd > 0 && pidfd_cache[i].pid == pid)
+			return &pidfd_cache[i];
+
+	if(pid <= 0)
+		return NULL;
+	pidfd = sys_pidfd_open(pid);
+	if(pidfd < 0)
+		return NULL;
+	/* opened after the pidfd: if the process is still
+	 * alive, this is its table */
+	tab = keytab_map(pid, 0);
+	if(tab == NULL) {
+		close(pidfd);
+		return NULL;
 	}
+
+	/* round-robin replacement, a job rarely has more peers */
+	i = pidfd_cache_next;
+	pidfd_cache_next = (i + 1) % PIDFD_CACHE_SIZE;
+	peer = &pidfd_cache[i];
+	if(peer->pidfd > 0) {
+		close(peer->pidfd);
+		munmap(peer->keytab, KEYTAB_BYTES);
+	}
+	peer->pid = pid;
+	peer->pidfd = pidfd;
+	peer->keytab = tab;
+	return peer;
 }
 
 /*
- * client: send (key, fd) pair to daemon
+ * forget a cached pidfd, its process is gone
  */
-void fdproxy_client_send_fd(int fd, struct fdkey *key) {
+static void pidfd_forget(pid_t pid) {
+	int i;
+
+	for(i = 0; i < PIDFD_CACHE_SIZE; i++)
+		if(pidfd_cache[i].pidfd > 0 && pidfd_cache[i].pid == pid) {
+			close(pidfd_cache[i].pidfd);
+			munmap(pidfd_cache[i].keytab, KEYTAB_BYTES);
+			pidfd_cache[i].pidfd = 0;
+		}
+}
+
+/*
+ * return the key table where key is recorded, or NULL
+ */
+static unsigned int *pidfd_keytab(struct fdkey *key) {
+	struct pidfd_peer *peer;
+
+	if(key->pid == getpid())
+		return keytab;
+	peer = pidfd_lookup(key->pid);
+	return peer != NULL ? peer->keytab : NULL;
+}
+
+/*
+ * client: get fd for the given key from its owner,
+ * return -1 if the key is not valid (any more)
+ */
+static int pidfd_fetch(struct fdkey *key) {
+	struct pidfd_peer *peer;
+	int fd;
+
+	peer = pidfd_lookup(key->pid);
+	if(peer == NULL)
+		return -1;
+	fd = sys_pidfd_getfd(peer->pidfd, key->fd);
+	if(fd < 0) {
+		dbg("pidfd_getfd <%s>: %s", fdproxy_keystr(key),
+		    strerror(errno));
+		if(errno == ESRCH)
+			pidfd_forget(key->pid);
+		return -1;
+	}
+	/* the owner clears the entry before closing the fd:
+	 * if it still matches, we got the file of this key */
+	mb();
+	if(peer->keytab[key->fd] != key->gen) {
+		dbg("pidfd get <%s>: stale key", fdproxy_keystr(key));
+		close(fd);
+		return -1;
+	}
+	dbg("pidfd get <%s> = %d", fdproxy_keystr(key), fd);
+	return fd;
+}
+
+/*
+ * decide whether to use pidfd mode: the kernel must have the syscalls,
+ * and let us take fds from processes other than our descendants
+ *
+ * the first test runs on ourselves, the second on the daemon: asking
+ * for an invalid fd there fails with EBADF if we passed the access
+ * checks (uid, yama, LSM), and EPERM otherwise
+ */
+static int fdproxy_pidfd_probe(void) {
+	char *s, c;
+	int fd, pidfd, ok;
+	struct ucred cred;
+	socklen_t len;
+
+	s = getenv("FDPROXY_PIDFD");
+	if(s != NULL && atoi(s) == 0)
+		return 0;
+
+	/* yama can only be relaxed for us by the peer itself */
+	fd = open("/proc/sys/kernel/yama/ptrace_scope", O_RDONLY);
+	if(fd >= 0) {
+		ok = read(fd, &c, 1) == 1 && c == '0';
+		close(fd);
+		if(!ok)
+			return 0;
+	}
+
+	pidfd = sys_pidfd_open(getpid());
+	if(pidfd < 0)
+		return 0;
+	fd = sys_pidfd_getfd(pidfd, client_sock);
+	close(pidfd);
+	if(fd < 0)
+		return 0;
+	close(fd);
+
+	len = sizeof(cred);
+	if(getsockopt(client_sock, SOL_SOCKET, SO_PEERCRED, &cred, &len))
+		return 0;
+	pidfd = sys_pidfd_open(cred.pid);
+	if(pidfd < 0)
+		return 0;
+	fd = sys_pidfd_getfd(pidfd, -1);
+	ok = fd < 0 && errno == EBADF;
+	close(pidfd);
+	return ok;
+}
+#endif /* HAVE_PIDFD */
+
+static void fdcache_close(struct fdkey *key, void *data) {
+	if(close((int)(long)data) != 0)
+		perr("close");
+}
+
+/*
+ * client: drop our cached fd for key, if any
+ */
+void fdproxy_client_forget_fd(struct fdkey *key) {
+	void *data;
+
+	if(keyhash_remove(&fdcache, key, &data)) {
+		dbg("forget <%s>", fdproxy_keystr(key));
+		fdcache_close(key, data);
+	}
+}
+
+/*
+ * client: apply invalidations pushed by the daemon
+ */
+static void fdcache_inval(struct fdproxy_request *req) {
+	int i;
+
+	if(req->flags & FDREQ_FLUSH) {
+		dbg("flush fd cache");
+		keyhash_clear(&fdcache, fdcache_close);
+		return;
+	}
+	for(i = 0; i < req->count; i++)
+		fdproxy_client_forget_fd(&req->u.keys[i]);
+}
+
+/*
+ * client: receive the daemon reply to our last request, applying the
+ * invalidations it pushed meanwhile
+ */
+static ssize_t fdproxy_client_recv(struct fdproxy_request *req,
+				   int *fds, int *nfds) {
+	ssize_t len;
+
+	for(;;) {
+		len = recv_request(client_sock, req, fds, nfds, 0);
+		if(len == 0)
+			err("fdproxy daemon closed the connection");
+		if(req->type != FD_INVAL_KEYS)
+			return len;
+		fdcache_inval(req);
+	}
+}
+
+/*
+ * client: apply the invalidations pushed by the daemon so far
+ */
+static void fdproxy_client_poll(void) {
 	struct fdproxy_request req;
+	int fds[FDPROXY_MAX_BATCH], nfds;
 
-	dbg("send <%s>", fdproxy_keystr(key));
-	/* send request notifying new key */
-	if(key->pid != FDKEY_WELLKNOWN) {
-		key->pid = getpid();
-		key->fd = fd;
+	while(recv_request(client_sock, &req, fds, &nfds, MSG_DONTWAIT) > 0) {
+		if(req.type != FD_INVAL_KEYS)
+			err("unexpected message from server: %d", req.type);
+		fdcache_inval(&req);
 	}
-	req.magic = REQUEST_MAGIC;
-	req.type = FD_NEW_KEY;
-	req.key = *key;
-	send_request(client_sock, &req, sizeof(req), NULL, 0);
+}
 
-	/* send fd proper */
-	req.type = FD_ADD_KEY;
-	send_request(client_sock, &req, sizeof(req), &fd, 1);
+/*
+ * client: send (key, fd) pairs to daemon, in as few messages as
+ * possible and without waiting for an ack
+ *
+ * other keys than well-known ones are made here, with a generation
+ * number that tells them apart from earlier keys for the same fd num,
+ * which peers may still have cached
+ */
+void fdproxy_client_send_fds(int n, int *fds, struct fdkey *keys) {
+	struct fdproxy_request req;
+	int i, bfds[FDPROXY_MAX_BATCH];
+
+	req.type = FD_ADD_KEYS;
+	req.flags = 0;
+	req.count = 0;
+	for(i = 0; i < n; i++) {
+		if(keys[i].pid != FDKEY_WELLKNOWN) {
+			keys[i].pid = getpid();
+			keys[i].fd = fds[i];
+			keys[i].gen = ++fdkey_gen;
+#ifdef HAVE_PIDFD
+			/* peers will get the fd from us */
+			if(pidfd_key(&keys[i])) {
+				keytab[keys[i].fd] = keys[i].gen;
+				continue;
+			}
+#endif
+		}
+		dbg("send <%s>", fdproxy_keystr(&keys[i]));
+		bfds[req.count] = fds[i];
+		req.u.keys[req.count++] = keys[i];
+		if(req.count == FDPROXY_MAX_BATCH) {
+			send_request(client_sock, &req,
+				     REQUEST_KEYS_SIZE(req.count),
+				     bfds, req.count);
+			req.count = 0;
+		}
+	}
+	if(req.count > 0)
+		send_request(client_sock, &req, REQUEST_KEYS_SIZE(req.count),
+			     bfds, req.count);
+}
 
-	/* receive ack */
-	recv_request(client_sock, &req, sizeof(req), NULL, 0);
-	assert(req.magic == REQUEST_MAGIC);
-	assert(memcmp(&req.key, key, sizeof(*key)) == 0);
-	assert(req.type == FD_ADD_KEY_ACK);
+void fdproxy_client_send_fd(int fd, struct fdkey *key) {
+	fdproxy_client_send_fds(1, &fd, key);
 }
 
 /*
- * client: request fd for the given key from daemon
+ * client: wait until the daemon has processed our previous requests
  */
-int fdproxy_client_get_fd(struct fdkey *key) {
+void fdproxy_client_sync(void) {
 	struct fdproxy_request req;
-	int fd;
+	int fds[FDPROXY_MAX_BATCH], nfds;
+	ssize_t len;
 
-	/* send request for key */
-	req.magic = REQUEST_MAGIC;
-	req.type = FD_REQ_KEY;
-	req.key = *key;
-	send_request(client_sock, &req, sizeof(req), NULL, 0);
+	req.type = FD_ADD_KEYS;
+	req.flags = FDREQ_ACK;
+	req.count = 0;
+	send_request(client_sock, &req, REQUEST_HDR_SIZE, NULL, 0);
 
-	/* receive response */
-	recv_request(client_sock, &req, sizeof(req), NULL, 0);
-	assert(req.magic == REQUEST_MAGIC);
-	assert(memcmp(&req.key, key, sizeof(*key)) == 0);
-	switch(req.type) {
-	case FD_RSP_NOKEY:
-		return -1;
-	case FD_RSP_KEYFOUND:
-		break;
-	default:
+	len = fdproxy_client_recv(&req, fds, &nfds);
+	if(len != REQUEST_HDR_SIZE || req.type != FD_ADD_KEYS_ACK || nfds)
 		err("bad server reply: %d", req.type);
+}
+
+/*
+ * client: request fds for the given keys, set fds[i] to -1 for keys
+ * that are unknown, return the number of fds found
+ *
+ * fds from the daemon are cached, and later requests for the same
+ * keys get a dup, until the daemon pushes an invalidation
+ */
+int fdproxy_client_get_fds(int n, struct fdkey *keys, int *fds) {
+	struct fdproxy_request req, rsp;
+	int i, j, fd, nfound, nrfds;
+	int idx[FDPROXY_MAX_BATCH], rfds[FDPROXY_MAX_BATCH];
+	void *data;
+	ssize_t len;
+
+	if(keyhash_count(&fdcache) > 0)
+		fdproxy_client_poll();
+
+	req.type = FD_REQ_KEYS;
+	req.flags = 0;
+	nfound = 0;
+	for(i = 0; i < n; ) {
+		/* gather up to a batch of keys that we must ask for */
+		for(req.count = 0; i < n && req.count < FDPROXY_MAX_BATCH; i++) {
+			fds[i] = -1;
+#ifdef HAVE_PIDFD
+			/* the daemon does not know that key */
+			if(pidfd_key(&keys[i])) {
+				fds[i] = pidfd_fetch(&keys[i]);
+				if(fds[i] >= 0)
+					nfound++;
+				continue;
+			}
+#endif
+			if(keyhash_find(&fdcache, &keys[i], &data)) {
+				fds[i] = dup((int)(long)data);
+				if(fds[i] < 0)
+					perr("dup");
+				nfound++;
+				continue;
+			}
+			idx[req.count] = i;
+			req.u.keys[req.count++] = keys[i];
+		}
+		if(req.count == 0)
+			continue;
+
+		send_request(client_sock, &req, REQUEST_KEYS_SIZE(req.count),
+			     NULL, 0);
+		len = fdproxy_client_recv(&rsp, rfds, &nrfds);
+		if(len != REQUEST_FOUND_SIZE(req.count)
+		   || rsp.type != FD_RSP_KEYS || rsp.count != req.count)
+			err("bad server reply: %d", rsp.type);
+
+		for(j = 0, nrfds = 0; j < rsp.count; j++) {
+			if(!rsp.u.found[j])
+				continue;
+			fd = rfds[nrfds++];
+			/* keep it unless full, or asked twice in a batch */
+			if(keyhash_count(&fdcache) < FDPROXY_FDCACHE_MAX
+			   && !keyhash_find(&fdcache, &keys[idx[j]], &data)) {
+				keyhash_insert(&fdcache, &keys[idx[j]],
+					       (void*)(long)fd);
+				fd = dup(fd);
+				if(fd < 0)
+					perr("dup");
+			}
+			fds[idx[j]] = fd;
+			nfound++;
+			dbg("get <%s> = %d", fdproxy_keystr(&keys[idx[j]]), fd);
+		}
 	}
+	return nfound;
+}
 
-	/* receive fd */
-	recv_request(client_sock, &req, sizeof(req), &fd, 1);
-	assert(req.magic == REQUEST_MAGIC);
-	assert(memcmp(&req.key, key, sizeof(*key)) == 0);
-	assert(req.type == FD_RSP_KEY);
+int fdproxy_client_get_fd(struct fdkey *key) {
+	int fd;
 
-	dbg("get <%s> = %d", fdproxy_keystr(key), fd);
+	fdproxy_client_get_fds(1, key, &fd);
 	return fd;
 }
 
 /*
- * client: tell daemon to drop fd paired to given key
+ * client: tell daemon to drop fds paired to given keys
  */
-void fdproxy_client_invalidate_fd(struct fdkey *key) {
+void fdproxy_client_invalidate_fds(int n, struct fdkey *keys) {
 	struct fdproxy_request req;
-
-	dbg("invalidate <%s>", fdproxy_keystr(key));
-	/* send request notifying stale key */
-	req.magic = REQUEST_MAGIC;
-	req.type = FD_INVAL_KEY;
-	req.key = *key;
-	send_request(client_sock, &req, sizeof(req), NULL, 0);
+	int i;
+
+	req.type = FD_INVAL_KEYS;
+	req.flags = 0;
+	req.count = 0;
+	for(i = 0; i < n; i++) {
+		/* other clients learn it from the daemon */
+		fdproxy_client_forget_fd(&keys[i]);
+#ifdef HAVE_PIDFD
+		/* the daemon never saw that key, it is only in the table
+		 * of its owner, unless a newer key replaced it there */
+		if(pidfd_key(&keys[i])) {
+			unsigned int *tab = pidfd_keytab(&keys[i]);
+
+			if(tab != NULL)
+				__sync_bool_compare_and_swap(&tab[keys[i].fd],
+							     keys[i].gen, 0);
+			continue;
+		}
+#endif
+		dbg("invalidate <%s>", fdproxy_keystr(&keys[i]));
+		req.u.keys[req.count++] = keys[i];
+		if(req.count == FDPROXY_MAX_BATCH) {
+			send_request(client_sock, &req,
+				     REQUEST_KEYS_SIZE(req.count), NULL, 0);
+			req.count = 0;
+		}
+	}
+	if(req.count > 0)
+		send_request(client_sock, &req, REQUEST_KEYS_SIZE(req.count),
+			     NULL, 0);
 }
 
+void fdproxy_client_invalidate_fd(struct fdkey *key) {
+	fdproxy_client_invalidate_fds(1, key);
+}
 
 /*
  * init addr struct to bind UNIX socket in "abstract" name space
@@ -437,94 +1009,215 @@ static void fdproxy_init_addr(struct sockaddr_un *addr) {
 }
 
 /*
- * daemon: main loop
+ * daemon: put a new connection in a free slot, return the slot
  */
-static void fdproxy_daemon(void) {
-	struct sockaddr_un addr;
+static int fdproxy_add_client(int sock) {
+	int i;
 
-	struct pollfd ctx_pollfd[FDPROXY_MAX_CLIENTS+1]; /* +1 for server sock */
-	struct connection_context ctx[FDPROXY_MAX_CLIENTS];
-	int nctx = 0;
+	for(i = 0; i < nclients; i++)
+		if(clients[i].sock == -1)
+			break;
+	if(i == maxclients) {
+		maxclients = maxclients ? 2 * maxclients : FDPROXY_CLIENTS_INIT;
+		clients = realloc(clients, maxclients * sizeof(*clients));
+		if(clients == NULL)
+			err("cannot grow client table to %d", maxclients);
+	}
+	if(i == nclients)
+		nclients++;
+	clients[i].sock = sock;
+	clients[i].pid = 0;
+#ifdef SO_PEERCRED
+	{
+		struct ucred cred;
+		socklen_t len = sizeof(cred);
+
+		if(getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0)
+			clients[i].pid = cred.pid;
+	}
+#endif
+	clients[i].flush = 0;
+	clients[i].push.count = 0;
+	nactive++;
+	dbg("client %d connected", i);
+	return i;
+}
 
-	fdtable_init();
+/*
+ * daemon: accept all pending connections,
+ * and register them with epfd unless it is -1
+ */
+static void fdproxy_accept(int epfd) {
+	int sock, slot;
 
-	/* bind socket, listen */
-	server_sock = socket(PF_UNIX, SOCK_STREAM, 0);
-	fdproxy_init_addr(&addr);
-#ifndef linux
-	unlink(addr.sun_path);
+	for(;;) {
+		sock = accept(server_sock, NULL, NULL);
+		if(sock < 0) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perr("accept");
+		}
+		slot = fdproxy_add_client(sock);
+#ifdef linux
+		if(epfd != -1) {
+			struct epoll_event ev;
+
+			ev.events = EPOLLIN | EPOLLET;
+			ev.data.u32 = slot;
+			if(epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev))
+				perr("epoll_ctl");
+		}
 #endif
-	if(bind(server_sock, (struct sockaddr *) &addr, sizeof(addr)))
-		perr("bind");
-	if(listen(server_sock, 5))
-		perr("listen");
+	}
+}
+
+static void fdproxy_check_exit(void) {
+	if((nactive == 0) && (nclients != 0)) {
+		dbg("last client disconnected, exiting");
+		_exit(0);
+	}
+}
+
+#ifdef linux
+
+#define SERVER_SLOT UINT32_MAX
+
+/*
+ * daemon: main loop, edge-triggered, so each client is read until
+ * there is nothing left; note that fdproxy_server_drain may read
+ * ahead from any client, and the events of a closed slot may show
+ * up after it was reused: fdproxy_handle_in then finds nothing
+ */
+static void fdproxy_daemon_loop(void) {
+	struct epoll_event ev, events[FDPROXY_EPOLL_EVENTS];
+	int epfd, i, n;
+
+	epfd = epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if(epfd < 0)
+		perr("epoll_create1");
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.u32 = SERVER_SLOT;
+	if(epoll_ctl(epfd, EPOLL_CTL_ADD, server_sock, &ev))
+		perr("epoll_ctl");
 
 	for(;;) {
-		int i, rc, nactive;
+		n = epoll_wait(epfd, events, FDPROXY_EPOLL_EVENTS, -1);
+		if(n < 0) {
+			if(errno == EINTR)
+				continue;
+			perr("epoll_wait");
+		}
+
+		for(i = 0; i < n; i++) {
+			struct connection_context *cl;
 
-		for(i = 0, nactive = 0; i < nctx; i++) {
-			if(ctx[i].sock == -1)
+			if(events[i].data.u32 == SERVER_SLOT) {
+				fdproxy_accept(epfd);
 				continue;
-			ctx_pollfd[nactive].fd  = ctx[i].sock;
-			switch(ctx[i].state) {
-			case STATE_IDLE:	/* expect any request */
-			case STATE_RCV_NEW_KEY:	/* expect FD_ADD_KEY */
-				ctx_pollfd[nactive].events = POLLIN;
-				break;
-			case STATE_RCV_REQ_KEY:	/* need to send response */
-			case STATE_RCV_ADD_KEY:	/* need to send ack */
-				ctx_pollfd[nactive].events = POLLOUT;
-				break;
 			}
-			nactive++;
+			cl = clients + events[i].data.u32;
+			if(cl->sock == -1)
+				continue;
+			if((events[i].events & EPOLLOUT) && cl->flush)
+				fdproxy_push_send(cl);
+			if(events[i].events & ~EPOLLOUT)
+				while(fdproxy_handle_in(cl))
+					;
 		}
-		if((nactive == 0) && (nctx != 0)) {
-			dbg("last client disconnected, exiting");
-			_exit(0);
+		fdproxy_check_exit();
+	}
+}
+
+#else /* !linux */
+
+/*
+ * daemon: main loop
+ */
+static void fdproxy_daemon_loop(void) {
+	struct pollfd *ctx_pollfd = NULL;
+	int *ctx_client = NULL;
+	int npollfd = 0;
+
+	for(;;) {
+		int i, rc, n;
+
+		/* +1 for server sock */
+		if(npollfd < maxclients + 1) {
+			npollfd = maxclients + 1;
+			ctx_pollfd = realloc(ctx_pollfd,
+					     npollfd * sizeof(*ctx_pollfd));
+			ctx_client = realloc(ctx_client,
+					     npollfd * sizeof(*ctx_client));
+			if(ctx_pollfd == NULL || ctx_client == NULL)
+				err("cannot grow poll table to %d", npollfd);
 		}
-		ctx_pollfd[nactive].fd = server_sock;
-		ctx_pollfd[nactive].events = POLLIN;
 
-		rc = poll(ctx_pollfd, nactive+1, -1);
-		if(rc < 0)
+		for(i = 0, n = 0; i < nclients; i++) {
+			if(clients[i].sock == -1)
+				continue;
+			ctx_pollfd[n].fd  = clients[i].sock;
+			ctx_pollfd[n].events = POLLIN
+				| (clients[i].flush ? POLLOUT : 0);
+			ctx_client[n] = i;
+			n++;
+		}
+		ctx_pollfd[n].fd = server_sock;
+		ctx_pollfd[n].events = POLLIN;
+
+		rc = poll(ctx_pollfd, n+1, -1);
+		if(rc < 0) {
+			if(errno == EINTR)
+				continue;
 			perr("poll");
+		}
 
-		for(i = 0, nactive = 0; i < nctx; i++) {
-			int revents = ctx_pollfd[nactive].revents;
+		for(i = 0; i < n; i++) {
+			struct connection_context *cl = clients + ctx_client[i];
 
-			if(ctx[i].sock == -1)
+			/* closed while draining */
+			if(cl->sock == -1 || ctx_pollfd[i].revents == 0)
 				continue;
-			nactive++;
-			if(revents & POLLHUP) {
-				ctx[i].sock = -1;
-				dbg("client %d closed its connection", i);
-				continue;
-			}
-			if(revents & (POLLERR|POLLNVAL)) {
-				err("client %d revents = %s%s",
-				    i,
-				    revents & POLLERR ? "ERR " : "",
-				    revents & POLLNVAL ? "NVAL " : "");
-			}
-			if(revents & POLLIN)
-				fdproxy_handle_in(ctx + i);
-			if(revents & POLLOUT)
-				fdproxy_handle_out(ctx + i);
+			if((ctx_pollfd[i].revents & POLLOUT) && cl->flush)
+				fdproxy_push_send(cl);
+			/* on POLLHUP, read pending requests until EOF */
+			if(ctx_pollfd[i].revents & ~POLLOUT)
+				while(fdproxy_handle_in(cl))
+					;
 		}
 
 		/* accept new clients */
-		if(ctx_pollfd[nactive].revents & POLLIN) {
-			assert(nctx < FDPROXY_MAX_CLIENTS);
-
-			ctx[nctx].sock = accept(server_sock, NULL, NULL);
-			if(ctx[nctx].sock < 0)
-				perr("accept");
-			ctx[nctx].state = STATE_IDLE;
-			nctx++;
-		}
+		if(ctx_pollfd[n].revents & POLLIN)
+			fdproxy_accept(-1);
+		fdproxy_check_exit();
 	}
+}
+
+#endif /* linux */
 
-	/* NOT REACHED */
+/*
+ * daemon: setup, then serve clients until they are all gone
+ */
+static void fdproxy_daemon(void) {
+	struct sockaddr_un addr;
+
+	fdtable_init();
+
+	/* bind socket, listen */
+	server_sock = socket(PF_UNIX, SOCK_SEQPACKET, 0);
+	fdproxy_init_addr(&addr);
+#ifndef linux
+	unlink(addr.sun_path);
+#endif
+	if(bind(server_sock, (struct sockaddr *) &addr, sizeof(addr)))
+		perr("bind");
+	if(listen(server_sock, SOMAXCONN))
+		perr("listen");
+	if(fcntl(server_sock, F_SETFL, O_NONBLOCK))
+		perr("fcntl");
+
+	fdproxy_daemon_loop(); /* NO RETURN */
 }
 
 void fdproxy_init(int proxy_id, int do_fork) {
@@ -541,8 +1234,14 @@ void fdproxy_init(int proxy_id, int do_fork) {
 			fdproxy_daemon(); /* NO RETURN */
 	}
 
-	/* connect to daemon */
-	client_sock = socket(PF_UNIX, SOCK_STREAM, 0);
+	/* connect to daemon, dropping any connection made before fork,
+	 * and the fds cached through it, which it would not invalidate */
+	if(client_sock != -1) {
+		close(client_sock);
+		keyhash_clear(&fdcache, fdcache_close);
+	} else
+		keyhash_init(&fdcache, FDPROXY_FDCACHE_MAX);
+	client_sock = socket(PF_UNIX, SOCK_SEQPACKET, 0);
 	fdproxy_init_addr(&addr);
 	for(i = 0; i < CONNECT_TIMEOUT; i++) {
 		rc = connect(client_sock, (struct sockaddr *) &addr, sizeof(addr));
@@ -555,4 +1254,11 @@ void fdproxy_init(int proxy_id, int do_fork) {
 	if(rc)
 		err("could not connect to fdproxy daemon after %d seconds",
 		    CONNECT_TIMEOUT);
+
+#ifdef HAVE_PIDFD
+	fdproxy_pidfd = fdproxy_pidfd_probe();
+	dbg("pidfd mode %s", fdproxy_pidfd ? "on" : "off");
+	if(fdproxy_pidfd)
+		keytab_create();
+#endif
 }
@@ -11,16 +11,29 @@
 #ifndef FDPROXY_H
 #define FDPROXY_H
 
-/* this identifies a file among all processes */
+/*
+ * this identifies a file among all processes
+ *
+ * a key made by fdproxy_client_send_fd is valid until some process
+ * invalidates it; its creator must do so before it closes the fd, and
+ * must not send the same fd num again meanwhile (with pidfd_getfd,
+ * the newer key would replace the older one)
+ */
 struct fdkey {
 	pid_t pid;	/* pid of creator, or FDKEY_WELLKNOWN */
 	int fd;		/* fd num used by creator, or well-known id */
+	unsigned int gen; /* tells apart files sent with the same fd num */
 };
 
 extern void fdproxy_init(int proxy_id, int do_fork);
 extern void fdproxy_client_send_fd(int fd, struct fdkey *key);
 extern int fdproxy_client_get_fd(struct fdkey *key);
 extern void fdproxy_client_invalidate_fd(struct fdkey *key);
+extern void fdproxy_client_send_fds(int n, int *fds, struct fdkey *keys);
+extern int fdproxy_client_get_fds(int n, struct fdkey *keys, int *fds);
+extern void fdproxy_client_invalidate_fds(int n, struct fdkey *keys);
+extern void fdproxy_client_sync(void);
+extern void fdproxy_client_forget_fd(struct fdkey *key);
 extern char *fdproxy_keystr(struct fdkey *key);
 extern void fdproxy_set_key_id(struct fdkey *key, int id);
 
@@ -11,61 +11,72 @@
 #ifndef FDPROXY_INTERNAL_H
 #define FDPROXY_INTERNAL_H
 
+#include <stddef.h>
+
 #define FDKEY_WELLKNOWN ((pid_t)0xf00a5a5)
 
 /*
- * request FD_NEW_KEY
- *  notify proxy of new (fd,key) pair
- *  followed by FD_ADD_KEY which has ancillary fd
- *   response: FD_ADD_KEY_ACK
+ * every request is a single SOCK_SEQPACKET message: a header, then
+ * count keys (at most FDPROXY_MAX_BATCH)
+ *
+ * request FD_ADD_KEYS
+ *  record the (key, fd) pairs, the count fds are ancillary data
+ *  if flags has FDREQ_ACK:
+ *   response FD_ADD_KEYS_ACK, with no keys
+ *
+ * request FD_REQ_KEYS
+ *  ask for the fds matching the keys
+ *  response FD_RSP_KEYS, where found[i] tells if key i was found,
+ *  with the fds of found keys as ancillary data, in the same order
  *
- * request FD_REQ_KEY
- *  ask for fd matching given key
- *  if key found:
- *   response FD_RSP_KEYFOUND
- *   response FD_RSP_KEY which has ancillary fd
- *  else:
- *   response FD_RSP_NOKEY
+ * request FD_INVAL_KEYS
+ *  drop the fds matching the keys, no response
+ *
+ * clients cache the fds they fetch, and the daemon pushes FD_INVAL_KEYS
+ * to the clients that fetched a key when it is invalidated; if flags
+ * has FDREQ_FLUSH, invalidations were lost, and the client must drop
+ * all its cache
  */
 
-#define REQUEST_MAGIC 0xf004242
+#define REQUEST_MAGIC 0xf004243
 enum fdproxy_reqtype {
-	FD_NEW_KEY,
-	FD_ADD_KEY,
-	FD_ADD_KEY_ACK,
-	FD_REQ_KEY,
-	FD_RSP_KEYFOUND,
-	FD_RSP_KEY,
-	FD_RSP_NOKEY,
-	FD_INVAL_KEY,
+	FD_ADD_KEYS,
+	FD_ADD_KEYS_ACK,
+	FD_REQ_KEYS,
+	FD_RSP_KEYS,
+	FD_INVAL_KEYS,
 };
+#define FDREQ_ACK 1
+#define FDREQ_FLUSH 2
 struct fdproxy_request {
 	int magic;
-	int type;
-	struct fdkey key;
+	short type;
+	short flags;
+	int count;
+	union {
+		struct fdkey keys[FDPROXY_MAX_BATCH];
+		char found[FDPROXY_MAX_BATCH];
+	} u;
 };
+#define REQUEST_HDR_SIZE ((ssize_t)offsetof(struct fdproxy_request, u))
+#define REQUEST_KEYS_SIZE(n) (REQUEST_HDR_SIZE + (n) * sizeof(struct fdkey))
+#define REQUEST_FOUND_SIZE(n) (REQUEST_HDR_SIZE + (n))
 
-/*
- * STATE_IDLE
- *  client has nothing in progress, expect anything
- * STATE_RCV_NEW_KEY
- *  client has sent FD_NEW_KEY, expect FD_ADD_KEY
- * STATE_RCV_ADD_KEY
- *  client has sent FD_ADD_KEY, need to send FD_ADD_KEY_ACK
- * STATE_RCV_REQ_KEY
- *  client has sent FD_REQ_KEY, need to send FD_RSP_{KEYFOUND,KEY,NOKEY}
- */
-
-enum conn_state {
-	STATE_IDLE,
-	STATE_RCV_NEW_KEY,
-	STATE_RCV_ADD_KEY,
-	STATE_RCV_REQ_KEY,
-};
 struct connection_context {
 	int sock;
-	enum conn_state state;
-	struct fdkey rcvd_key;
+	pid_t pid;			/* of the client, to remove its key table */
+	int flush;			/* pushes were lost, send FDREQ_FLUSH */
+	struct fdproxy_request push;	/* invalidations to push */
+};
+
+/*
+ * daemon: an fd, and the clients that fetched it, by slot
+ */
+struct fdtable_entry {
+	int fd;
+	int nsubs;
+	int maxsubs;
+	int *subs;
 };
 
 #endif /* FDPROXY_INTERNAL_H */
@@ -0,0 +1,139 @@
+/*
+ * futex.h
+ *
+ * Copyright 2007 Jean-Marc Saffroy <saffroy@gmail.com>
+ * This file is part of the Driller library.
+ * Driller is free software, distributed under the terms of the
+ * GNU Lesser General Public License version 2.1.
+ *
+ */
+
+#ifndef FUTEX_H
+#define FUTEX_H
+
+#include <limits.h>
+#ifdef linux
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#include "spinlock.h"
+
+/*
+ * a word in shared memory that processes can sleep on until some
+ * event happens, usually one word per process ("doorbell")
+ *
+ * waiters spin for a while before going to sleep in the kernel;
+ * f_sleepers counts those, so that signalling an event only costs a
+ * syscall when somebody actually sleeps
+ *
+ * a waiter does:
+ *	seq = futex_prepare(f);
+ *	if(event happened)
+ *		futex_cancel(f);
+ *	else
+ *		futex_sleep(f, seq);
+ * and whoever makes the event happen then calls futex_signal(f)
+ */
+
+struct futex {
+	volatile unsigned int f_val;
+	volatile int f_sleepers;
+};
+
+static inline void futex_init(struct futex *f, unsigned int val) {
+	f->f_val = val;
+	f->f_sleepers = 0;
+}
+
+static inline void cpu_relax(void) {
+#if __x86_64__ || __i386__
+	asm volatile("rep; nop" : : : "memory");
+#else
+	asm volatile("" : : : "memory");
+#endif
+}
+
+#ifdef linux
+
+/*
+ * full memory barrier, including store->load ordering,
+ * which mb() does not provide
+ */
+static inline void futex_mb(void) {
+#if __x86_64__
+	asm volatile("lock; addl $0,0(%%rsp)" : : : "memory");
+#elif __i386__
+	asm volatile("lock; addl $0,0(%%esp)" : : : "memory");
+#else
+#error function futex_mb needs porting to your architecture!
+#endif
+}
+
+static inline void futex_add(volatile void *p, int i) {
+#if __x86_64__ || __i386__
+	asm volatile("lock; addl %1,%0"
+		     : "+m" (*(volatile int *)p)
+		     : "ir" (i)
+		     : "memory");
+#else
+#error function futex_add needs porting to your architecture!
+#endif
+}
+
+/*
+ * the atomic add orders our count before the caller checks for the
+ * event, just as futex_signal orders the event before the check of
+ * f_sleepers: one of us is bound to see the other
+ */
+static inline unsigned int futex_prepare(struct futex *f) {
+	futex_add(&f->f_sleepers, 1);
+	return f->f_val;
+}
+
+static inline void futex_cancel(struct futex *f) {
+	futex_add(&f->f_sleepers, -1);
+}
+
+/*
+ * sleep unless f has been signalled since futex_prepare returned seq
+ */
+static inline void futex_sleep(struct futex *f, unsigned int seq) {
+	syscall(SYS_futex, &f->f_val, FUTEX_WAIT, seq, NULL, NULL, 0);
+	futex_add(&f->f_sleepers, -1);
+}
+
+/*
+ * wake all sleepers, must be called after the event has happened
+ */
+static inline void futex_signal(struct futex *f) {
+	futex_mb();
+	if(f->f_sleepers) {
+		futex_add(&f->f_val, 1);
+		syscall(SYS_futex, &f->f_val, FUTEX_WAKE, INT_MAX,
+			NULL, NULL, 0);
+	}
+}
+
+#else /* !linux */
+
+/* no futex here: let nop() yield the processor */
+static inline unsigned int futex_prepare(struct futex *f) {
+	return 0;
+}
+
+static inline void futex_cancel(struct futex *f) {
+}
+
+static inline void futex_sleep(struct futex *f, unsigned int seq) {
+	nop();
+}
+
+static inline void futex_signal(struct futex *f) {
+	mb();
+}
+
+#endif /* linux */
+
+#endif /* FUTEX_H */
@@ -0,0 +1,269 @@
+/*
+ * keyhash.c
+ *
+ * Copyright 2007 Jean-Marc Saffroy <saffroy@gmail.com>
+ * This file is part of the Driller library.
+ * Driller is free software, distributed under the terms of the
+ * GNU Lesser General Public License version 2.1.
+ *
+ * hash tables of fd keys, used by the fdproxy daemon to find fds, and
+ * by map_cache to find the local mappings of remote segments
+ */
+
+#include <stdint.h>
+#include <assert.h>
+
+#include "log.h"
+#include "tunables.h"
+#include "keyhash.h"
+
+/* slot states in ke_key.pid, no process has these pids */
+#define SLOT_FREE 0
+#define SLOT_MOVED ((pid_t)-1)	/* only in kh_old */
+
+#define KEYHASH_MIN_BITS 4
+
+static inline unsigned int keyhash_slot(struct fdkey *key,
+					unsigned int bits) {
+	uint64_t h;
+
+	/* Fibonacci hashing: the high bits of the product depend on
+	 * all bits of pid, fd and gen */
+	h = ((uint64_t)(uint32_t)key->pid << 32) | (uint32_t)key->fd;
+	h ^= (uint64_t)key->gen << 16;
+	h *= 0x9e3779b97f4a7c15ULL;
+	return h >> (64 - bits);
+}
+
+static inline int keyhash_match(struct fdkey *k1, struct fdkey *k2) {
+	return k1->pid == k2->pid && k1->fd == k2->fd && k1->gen == k2->gen;
+}
+
+static void table_alloc(struct keyhash_table *t, unsigned int bits) {
+	t->kt_entries = calloc(1UL << bits, sizeof(*t->kt_entries));
+	if(t->kt_entries == NULL)
+		err("cannot allocate hash table of %u entries", 1U << bits);
+	t->kt_bits = bits;
+	t->kt_count = 0;
+}
+
+/*
+ * return the slot of key in t, or -1
+ *
+ * probing stops at a free slot, which always exists since a table is
+ * never more than 3/4 full, and moved slots of kh_old are not free
+ */
+static long table_find(struct keyhash_table *t, struct fdkey *key) {
+	unsigned int i, mask;
+	struct keyhash_entry *e;
+
+	if(t->kt_entries == NULL)
+		return -1;
+	mask = (1U << t->kt_bits) - 1;
+	for(i = keyhash_slot(key, t->kt_bits); ; i = (i + 1) & mask) {
+		e = t->kt_entries + i;
+		if(e->ke_key.pid == SLOT_FREE)
+			return -1;
+		if(keyhash_match(&e->ke_key, key))
+			return i;
+	}
+}
+
+/*
+ * add key, which is not in t yet
+ */
+static void table_put(struct keyhash_table *t, struct fdkey *key,
+		      void *data) {
+	unsigned int i, mask;
+	struct keyhash_entry *e;
+
+	mask = (1U << t->kt_bits) - 1;
+	for(i = keyhash_slot(key, t->kt_bits); ; i = (i + 1) & mask) {
+		e = t->kt_entries + i;
+		if(e->ke_key.pid == SLOT_FREE)
+			break;
+	}
+	e->ke_key = *key;
+	e->ke_data = data;
+	t->kt_count++;
+}
+
+/*
+ * free slot i, then move back the entries that follow it in the same
+ * probe sequence, so that probing needs no tombstones
+ */
+static void table_delete(struct keyhash_table *t, unsigned int i) {
+	unsigned int j, k, mask;
+	struct keyhash_entry *e;
+
+	mask = (1U << t->kt_bits) - 1;
+	j = i;
+	for(;;) {
+		t->kt_entries[i].ke_key.pid = SLOT_FREE;
+		for(;;) {
+			j = (j + 1) & mask;
+			e = t->kt_entries + j;
+			if(e->ke_key.pid == SLOT_FREE) {
+				t->kt_count--;
+				return;
+			}
+			/* e can fill the hole at i unless its home
+			 * slot k lies (cyclically) in ]i, j] */
+			k = keyhash_slot(&e->ke_key, t->kt_bits);
+			if(i <= j ? (i < k && k <= j) : (i < k || k <= j))
+				continue;
+			break;
+		}
+		t->kt_entries[i] = *e;
+		i = j;
+	}
+}
+
+/*
+ * move up to n slots of kh_old to kh_cur, free kh_old once empty
+ *
+ * moved entries stay in kh_old as SLOT_MOVED, which keeps the probe
+ * sequences of other entries unbroken
+ */
+static void keyhash_move(struct keyhash *kh, unsigned int n) {
+	struct keyhash_table *old = &kh->kh_old;
+	struct keyhash_entry *e;
+	unsigned int size;
+
+	if(old->kt_entries == NULL)
+		return;
+	size = 1U << old->kt_bits;
+	for(; n > 0 && kh->kh_moved < size; n--) {
+		e = old->kt_entries + kh->kh_moved++;
+		if(e->ke_key.pid == SLOT_FREE || e->ke_key.pid == SLOT_MOVED)
+			continue;
+		table_put(&kh->kh_cur, &e->ke_key, e->ke_data);
+		e->ke_key.pid = SLOT_MOVED;
+		old->kt_count--;
+	}
+	if(kh->kh_moved == size) {
+		dbg("done moving %u slots", size);
+		free(old->kt_entries);
+		old->kt_entries = NULL;
+	}
+}
+
+/*
+ * start moving to a table twice as large
+ *
+ * the new table gets 3/4 full after as many insertions as the old one
+ * holds entries, which is much later than the last move
+ */
+static void keyhash_grow(struct keyhash *kh) {
+	keyhash_move(kh, ~0U);
+	kh->kh_old = kh->kh_cur;
+	kh->kh_moved = 0;
+	table_alloc(&kh->kh_cur, kh->kh_old.kt_bits + 1);
+	dbg("grow to %u slots", 1U << kh->kh_cur.kt_bits);
+}
+
+void keyhash_init(struct keyhash *kh, unsigned int size) {
+	unsigned int bits;
+
+	for(bits = KEYHASH_MIN_BITS; (1U << bits) < size; bits++)
+		;
+	table_alloc(&kh->kh_cur, bits);
+	kh->kh_old.kt_entries = NULL;
+	kh->kh_old.kt_count = 0;
+	kh->kh_moved = 0;
+}
+
+/*
+ * set *data to the data of key and return 1 if found, else return 0
+ */
+int keyhash_find(struct keyhash *kh, struct fdkey *key, void **data) {
+	long i;
+
+	if(key->pid == SLOT_FREE || key->pid == SLOT_MOVED)
+		return 0;
+	i = table_find(&kh->kh_cur, key);
+	if(i >= 0) {
+		*data = kh->kh_cur.kt_entries[i].ke_data;
+		return 1;
+	}
+	i = table_find(&kh->kh_old, key);
+	if(i >= 0) {
+		*data = kh->kh_old.kt_entries[i].ke_data;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * add (key, data), or replace the data of key
+ */
+void keyhash_insert(struct keyhash *kh, struct fdkey *key, void *data) {
+	struct keyhash_table *cur = &kh->kh_cur;
+	long i;
+
+	assert(key->pid != SLOT_FREE && key->pid != SLOT_MOVED);
+	i = table_find(cur, key);
+	if(i >= 0) {
+		cur->kt_entries[i].ke_data = data;
+		return;
+	}
+	i = table_find(&kh->kh_old, key);
+	if(i >= 0) {
+		kh->kh_old.kt_entries[i].ke_data = data;
+		return;
+	}
+
+	keyhash_move(kh, KEYHASH_MOVE_STEP);
+	if(4 * (cur->kt_count + 1) > 3 * (1U << cur->kt_bits))
+		keyhash_grow(kh);
+	table_put(cur, key, data);
+}
+
+/*
+ * remove key, set *data to its data and return 1 if found,
+ * else return 0
+ */
+int keyhash_remove(struct keyhash *kh, struct fdkey *key, void **data) {
+	long i;
+
+	if(key->pid == SLOT_FREE || key->pid == SLOT_MOVED)
+		return 0;
+	keyhash_move(kh, KEYHASH_MOVE_STEP);
+	i = table_find(&kh->kh_cur, key);
+	if(i >= 0) {
+		*data = kh->kh_cur.kt_entries[i].ke_data;
+		table_delete(&kh->kh_cur, i);
+		return 1;
+	}
+	/* no need to keep probe sequences of kh_old compact */
+	i = table_find(&kh->kh_old, key);
+	if(i >= 0) {
+		*data = kh->kh_old.kt_entries[i].ke_data;
+		kh->kh_old.kt_entries[i].ke_key.pid = SLOT_MOVED;
+		kh->kh_old.kt_count--;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * call fn on all entries, and empty the table
+ */
+void keyhash_clear(struct keyhash *kh,
+		   void (*fn)(struct fdkey *key, void *data)) {
+	struct keyhash_table *t;
+	struct keyhash_entry *e;
+	unsigned int i;
+
+	keyhash_move(kh, ~0U);
+	t = &kh->kh_cur;
+	for(i = 0; i < 1U << t->kt_bits; i++) {
+		e = t->kt_entries + i;
+		if(e->ke_key.pid == SLOT_FREE)
+			continue;
+		if(fn != NULL)
+			fn(&e->ke_key, e->ke_data);
+		e->ke_key.pid = SLOT_FREE;
+	}
+	t->kt_count = 0;
+}
@@ -0,0 +1,57 @@
+/*
+ * keyhash.h
+ *
+ * Copyright 2007 Jean-Marc Saffroy <saffroy@gmail.com>
+ * This file is part of the Driller library.
+ * Driller is free software, distributed under the terms of the
+ * GNU Lesser General Public License version 2.1.
+ *
+ */
+
+#ifndef KEYHASH_H
+#define KEYHASH_H
+
+#include "fdproxy.h"
+
+/*
+ * hash tables indexed by fd keys, with open addressing and linear
+ * probing; entries are stored in the table itself, so that only
+ * growing the table allocates memory
+ *
+ * a table grows to twice its size when 3/4 full, and its entries are
+ * moved a few at a time by later insertions and removals, so that no
+ * single call pays for a whole rehash; meanwhile, lookups search both
+ * the new and the old table
+ */
+
+struct keyhash_entry {
+	struct fdkey ke_key;	/* pid is 0 for a free slot */
+	void *ke_data;
+};
+
+struct keyhash_table {
+	struct keyhash_entry *kt_entries;	/* NULL if none */
+	unsigned int kt_bits;			/* 1 << kt_bits entries */
+	unsigned int kt_count;			/* used entries */
+};
+
+struct keyhash {
+	struct keyhash_table kh_cur;
+	struct keyhash_table kh_old;	/* being moved to kh_cur */
+	unsigned int kh_moved;		/* slots of kh_old already moved */
+};
+
+extern void keyhash_init(struct keyhash *kh, unsigned int size);
+extern int keyhash_find(struct keyhash *kh, struct fdkey *key, void **data);
+extern void keyhash_insert(struct keyhash *kh, struct fdkey *key,
+			   void *data);
+extern int keyhash_remove(struct keyhash *kh, struct fdkey *key,
+			  void **data);
+extern void keyhash_clear(struct keyhash *kh,
+			  void (*fn)(struct fdkey *key, void *data));
+
+static inline unsigned int keyhash_count(struct keyhash *kh) {
+	return kh->kh_cur.kt_count + kh->kh_old.kt_count;
+}
+
+#endif /* KEYHASH_H */
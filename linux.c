@@ -6,7 +6,8 @@
  * Driller is free software, distributed under the terms of the
  * GNU Lesser General Public License version 2.1.
  *
- * fetch the list of memory mappings in the current process from /proc
+ * fetch the list of memory mappings in the current process from /proc,
+ * and which of their pages hold data
  */
 
 #include <stdio.h>
@@ -18,63 +19,243 @@
 #include <sys/mman.h>
 
 #include "driller_internal.h"
+#include "tunables.h"
 #include "log.h"
 
 /*
- * parse and record the content of /proc/self/maps
+ * parse a number in the given base (up to 16, lowercase digits),
+ * return a pointer past its last digit
  */
-void map_parse(void) {
-	const char *file = "/proc/self/maps";
-	int fd;
-	char buf[4096] = {};
-	uintmax_t start, end, offset;
-	char prot_str[5];
-	long maj, min, ino;
-	char *line, *p;
-	int lineno, i;
+static char *parse_num(char *p, uintmax_t *val, int base) {
+	uintmax_t v = 0;
+	int d;
+
+	for(;; p++) {
+		if(*p >= '0' && *p <= '9')
+			d = *p - '0';
+		else if(*p >= 'a' && *p <= 'f')
+			d = *p - 'a' + 10;
+		else
+			break;
+		if(d >= base)
+			break;
+		v = v * base + d;
+	}
+	*val = v;
+	return p;
+}
+
+/*
+ * a private mapping seen in /proc/self/maps, recorded only once the
+ * whole file is parsed
+ */
+struct map_tuple {
+	uintptr_t start, end;
+	off_t offset;
 	int prot;
+	unsigned int path; /* offset in map_paths */
+};
+
+/* static: no allocation may happen while /proc/self/maps is read */
+static struct map_tuple map_tuples[MAPS_MAX_TUPLES];
+static char map_paths[MAPS_PATHS_SIZE];
+static int map_ntuples;
+static size_t map_paths_len;
+
+/*
+ * parse one line of /proc/self/maps, like:
+ * 00400000-0040b000 r-xp 00000000 08:01 1234    /bin/cat
+ * and save it in map_tuples if it is a private mapping
+ * return 0 if the line is malformed
+ */
+static int map_parse_line(char *line, int lineno) {
+	uintmax_t start, end, offset, maj, min, ino;
+	char *p = line, *prot_str;
+	struct map_tuple *t;
+	size_t len;
+
+	p = parse_num(p, &start, 16);
+	if(*p++ != '-')
+		return 0;
+	p = parse_num(p, &end, 16);
+	if(*p++ != ' ')
+		return 0;
+	/* four permission letters, and the separator */
+	prot_str = p;
+	if(strnlen(p, 5) < 5)
+		return 0;
+	p += 4;
+	if(*p++ != ' ')
+		return 0;
+	p = parse_num(p, &offset, 16);
+	if(*p++ != ' ')
+		return 0;
+	p = parse_num(p, &maj, 16);
+	if(*p++ != ':')
+		return 0;
+	p = parse_num(p, &min, 16);
+	if(*p++ != ' ')
+		return 0;
+	p = parse_num(p, &ino, 10);
+	while(*p == ' ')
+		p++;
+
+	dbg("% 2d: %jx-%jx %.4s %jx %jx:%jx %ju '%s'",
+	    lineno, start, end, prot_str, offset, maj, min, ino, p);
+	if(prot_str[3] != 'p') /* not a private mapping */
+		return 1;
+
+	len = strlen(p) + 1;
+	if(map_ntuples == MAPS_MAX_TUPLES
+	   || map_paths_len + len > MAPS_PATHS_SIZE)
+		err("too many mappings in /proc/self/maps");
+	t = &map_tuples[map_ntuples++];
+	t->start = start;
+	t->end = end;
+	t->offset = offset;
+	t->prot = ((prot_str[0] == 'r') ? PROT_READ : 0)
+		| ((prot_str[1] == 'w') ? PROT_WRITE : 0)
+		| ((prot_str[2] == 'x') ? PROT_EXEC : 0);
+	t->path = map_paths_len;
+	memcpy(map_paths + map_paths_len, p, len);
+	map_paths_len += len;
+	return 1;
+}
+
+/*
+ * parse /proc/self/maps into map_tuples
+ *
+ * the file is read a chunk at a time and parsed in place into static
+ * tuples, which map_parse records only at end of file: map_record()
+ * allocates from the driller mspace, which may grow and have its new
+ * segment merged with an adjacent VMA, so recording between reads
+ * would make later lines overlap earlier records
+ */
+static void map_read(void) {
+	const char *file = "/proc/self/maps";
+	char buf[MAPS_BUF_SIZE];
+	char *line, *eol;
+	size_t len = 0;
+	ssize_t rc;
+	int fd, lineno = 0;
 
-	/* no allocation while we read maps, otherwise map_rebuild might
-	   try to map a segment that is gone (or has shrinked) */
 	fd = open(file, O_RDONLY);
 	if(fd < 0)
 		perr("open");
-	if(read(fd, buf, sizeof(buf)) < 0)
-		perr("read");
-	/* make sure we've read the whole thing */
-	if(read(fd, buf, sizeof(buf)) != 0)
-		err("could not read %s entirely", file);
+
+	map_ntuples = 0;
+	map_paths_len = 0;
+	do {
+		rc = read(fd, buf + len, sizeof(buf) - 1 - len);
+		if(rc < 0)
+			perr("read");
+		len += rc;
+		buf[len] = '\0';
+
+		/* parse complete lines, or what is left at end of file */
+		line = buf;
+		while(*line != '\0') {
+			eol = strchr(line, '\n');
+			if(eol == NULL) {
+				if(rc != 0)
+					break;
+				eol = line + strlen(line);
+			} else
+				*eol++ = '\0';
+			if(!map_parse_line(line, lineno))
+				err("could not parse line %d: '%s'",
+				    lineno, line);
+			lineno++;
+			line = eol;
+		}
+
+		/* keep the incomplete line for the next read */
+		len -= line - buf;
+		memmove(buf, line, len);
+		if(len == sizeof(buf) - 1)
+			err("line %d of %s is too long", lineno, file);
+	} while(rc != 0);
+
 	if(close(fd) != 0)
 		perr("close");
+}
 
-	line = buf;
-	for(lineno = 0; ; lineno++) {
-		if(sscanf(line, "%jx-%jx %s %jx %lx:%lx %ld", 
-			  &start, &end, prot_str, &offset,
-			  &maj, &min, &ino) != 7) {
-			p = strchrnul(line, '\n');
-			*p = '\0';
-			err("could not parse line %d: '%s'\n",
-			    lineno, line);
-		}
+/*
+ * parse and record the content of /proc/self/maps
+ */
+void map_parse(void) {
+	int i;
+
+	map_read();
+	for(i = 0; i < map_ntuples; i++)
+		map_record((void*)map_tuples[i].start,
+			   (void*)map_tuples[i].end,
+			   map_tuples[i].prot, map_tuples[i].offset,
+			   map_paths + map_tuples[i].path, -1);
+}
+
+/*
+ * return the protection of the private maps that cover [start-end],
+ * or -1 if part of it is not mapped privately, or if the protection
+ * changes along the way
+ */
+int map_prot(void *start, void *end) {
+	uintptr_t addr = (uintptr_t)start;
+	struct map_tuple *t;
+	int i, prot = -1;
+
+	map_read();
+	for(i = 0; i < map_ntuples && addr < (uintptr_t)end; i++) {
+		t = &map_tuples[i];
+		if(t->end <= addr)
+			continue;
+		if(t->start > addr || (prot >= 0 && t->prot != prot))
+			return -1;
+		prot = t->prot;
+		addr = t->end;
+	}
+	return addr < (uintptr_t)end ? -1 : prot;
+}
 
-		p = line;
-		for(i = 0; i < 5; i++)
-			p = strchr(p+1, ' ');
-		while(*p == ' ')
-			p++;
-		line = strchrnul(p, '\n');
-		*line++ = '\0'; /* remove trailing \n */
-		dbg("% 2d: %jx-%jx %s %jx %lx:%lx %ld '%s'\n",
-		    lineno, start, end, prot_str, offset, maj, min, ino, p);
-		prot = ((prot_str[0] == 'r') ? PROT_READ : 0)
-			| ((prot_str[1] == 'w') ? PROT_WRITE : 0)
-			| ((prot_str[2] == 'x') ? PROT_EXEC : 0);
-		if(prot_str[3] == 'p') /* private mapping */
-			map_record((void*)(uintptr_t)start,
-				   (void*)(uintptr_t)end,
-				   prot, offset, p, -1);
-		if(*line == '\0')
-			return;
+/*
+ * tell which of the npages pages at start may hold data, i.e. are
+ * present or swapped out, according to /proc/self/pagemap:
+ * used[i] is set for page i, return -1 if this can't be known
+ */
+static int pagemap_fd = -1;
+
+int map_pages_used(void *start, size_t npages, unsigned char *used) {
+	uint64_t ent[MAP_PAGES_CHUNK];
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	off_t offset;
+	size_t i, j, n;
+
+	if(pagemap_fd < 0) {
+		pagemap_fd = open("/proc/self/pagemap", O_RDONLY);
+		if(pagemap_fd < 0)
+			return -1;
+	}
+
+	offset = (uintptr_t)start / page_size * sizeof(ent[0]);
+	for(i = 0; i < npages; i += n) {
+		n = min(npages - i, MAP_PAGES_CHUNK);
+		if(pread(pagemap_fd, ent, n * sizeof(ent[0]),
+			 offset + i * sizeof(ent[0])) != n * sizeof(ent[0]))
+			return -1;
+		for(j = 0; j < n; j++)
+			/* bit 63: present, bit 62: swapped */
+			used[i + j] = (ent[j] >> 62) != 0;
+	}
+	return 0;
+}
+
+/*
+ * done with map_pages_used, close what it opened
+ */
+void map_pages_done(void) {
+	if(pagemap_fd >= 0) {
+		if(close(pagemap_fd) != 0)
+			perr("close");
+		pagemap_fd = -1;
 	}
 }
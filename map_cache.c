@@ -13,77 +13,30 @@
 
 #include <unistd.h>
 #include <string.h>
-#include <search.h>
 #include <assert.h>
 
 #include "log.h"
+#include "tunables.h"
 #include "fdproxy.h"
 #include "driller.h"
 #include "map_cache.h"
-#include "search.h"
+#include "keyhash.h"
 
-#define MAP_CACHE_HSIZE_INIT 32
-
-static struct hsearch_data map_cache;
-static int map_cache_hsize = MAP_CACHE_HSIZE_INIT;
-
-/*
- * record a (key, map_cache) pair
- */
-static void map_cache_hash(struct map_cache *mc, struct fdkey *key) {
-	char *buf;
-	ENTRY e, *ep;
-	int rc;
-
-	buf = fdproxy_keystr(key);
-
-	dbg("add <%s> = %p", buf, (mc ? mc->mc_addr : NULL));
-
-	e.key = buf;
-	rc = hsearch_r(e, FIND, &ep, &map_cache);
-	if(ep != NULL) {
-		ep->data = mc;
-		return;
-	}
-
-	e.key = strdup(buf);
-	assert(e.key != NULL);
-	e.data = mc;
-	rc = hsearch_r(e, ENTER, &ep, &map_cache);
-	if(rc == 0) {
-		/* retry with larger htable */
-		map_cache_hsize += map_cache_hsize/2;
-		if(hcreate_r(map_cache_hsize, &map_cache) == 0)
-			err("cannot grow htable (size=%d)",
-			    map_cache_hsize);
-		rc = hsearch_r(e, ENTER, &ep, &map_cache);
-		if(rc == 0)
-			err("cannot insert into htable (size=%d)",
-			    map_cache_hsize);
-	}
-}
+static struct keyhash map_cache;
 
 /*
  * remove record of (key, map_cache) pair
  */
 struct map_cache *map_cache_unhash(struct fdkey *key) {
-	char *buf;
-	ENTRY e, *ep;
-	int rc;
+	void *data;
 	struct map_cache *mc;
 
-	buf = fdproxy_keystr(key);
-
-	e.key = buf;
-	rc = hsearch_r(e, FIND, &ep, &map_cache);
-	if(ep != NULL) {
-		mc = ep->data;
-		ep->data = NULL;
-	} else {
-		dbg("cannot find '%s' in htable", buf);
+	if(keyhash_remove(&map_cache, key, &data))
+		mc = data;
+	else
 		mc = NULL;
-	}
-	dbg("unhash <%s> = %p", buf, (mc ? mc->mc_addr : NULL));
+	dbg("unhash <%s> = %p", fdproxy_keystr(key),
+	    (mc ? mc->mc_addr : NULL));
 	return mc;
 }
 
@@ -91,22 +44,15 @@ struct map_cache *map_cache_unhash(struct fdkey *key) {
  * find and return map_cache matching key
  */
 struct map_cache *map_cache_lookup(struct fdkey *key) {
-	char *buf;
-	ENTRY e, *ep;
-	int rc;
+	void *data;
 	struct map_cache *mc;
 
-	buf = fdproxy_keystr(key);
-
-	e.key = buf;
-	rc = hsearch_r(e, FIND, &ep, &map_cache);
-	if(ep != NULL) {
-		mc = ep->data;
-	} else {
-		dbg2("cannot find '%s' in htable", buf);
+	if(keyhash_find(&map_cache, key, &data))
+		mc = data;
+	else
 		mc = NULL;
-	}
-	dbg2("lookup <%s> = %p", buf, (mc ? mc->mc_addr : NULL));
+	dbg2("lookup <%s> = %p", fdproxy_keystr(key),
+	     (mc ? mc->mc_addr : NULL));
 	return mc;
 }
 
@@ -123,7 +69,8 @@ struct map_cache *map_cache_install(struct map_rec *map,
 	assert(mc != NULL);
 	memcpy(&mc->mc_map, map, sizeof(*map));
 	mc->mc_addr = driller_install_map(map);
-	map_cache_hash(mc, key);
+	mc->mc_views = 0;
+	keyhash_insert(&map_cache, key, mc);
 
 	dbg("install <%s> @ %p", fdproxy_keystr(key), mc->mc_addr);
 	return mc;
@@ -134,9 +81,15 @@ struct map_cache *map_cache_install(struct map_rec *map,
  */
 void map_cache_update(struct map_rec *map, struct fdkey *key,
 		      struct map_cache *mc) {
+	int fd;
+
+	assert(mc->mc_views == 0);
 	driller_remove_map(&mc->mc_map, mc->mc_addr);
+	/* map->fd is the sender's, keep our own */
+	fd = mc->mc_map.fd;
 	memcpy(&mc->mc_map, map, sizeof(*map));
-	mc->mc_addr = driller_install_map(map);
+	mc->mc_map.fd = fd;
+	mc->mc_addr = driller_install_map(&mc->mc_map);
 
 	dbg("update <%s> @ %p", fdproxy_keystr(key), mc->mc_addr);
 }
@@ -150,17 +103,17 @@ void map_cache_remove(struct fdkey *key) {
 	mc = map_cache_unhash(key);
 	if(mc != NULL) {
 		dbg("remove <%s> = %p", fdproxy_keystr(key), mc->mc_addr);
+		assert(mc->mc_views == 0);
 		driller_remove_map(&mc->mc_map, mc->mc_addr);
 		if(close(mc->mc_map.fd) != 0)
 			perr("close");
+		/* the key is dead, so is any copy fdproxy kept */
+		fdproxy_client_forget_fd(key);
 		memset(mc, 0xf0, sizeof(mc));
 		free(mc);
 	}
 }
 
 void map_cache_init(void) {
-	int rc;
-
-	rc = hcreate_r(map_cache_hsize, &map_cache);
-	assert(rc != 0);
+	keyhash_init(&map_cache, MAP_CACHE_HSIZE_INIT);
 }
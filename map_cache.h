@@ -17,6 +17,7 @@
 struct map_cache {
 	struct map_rec mc_map;
 	void *mc_addr;
+	int mc_views;	/* zero-copy views pointing into mc_addr */
 };
 
 extern struct map_cache *map_cache_lookup(struct fdkey *key);
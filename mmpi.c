@@ -13,8 +13,13 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/time.h>
 
 #include "tunables.h"
 #include "mmpi.h"
@@ -22,197 +27,304 @@
 #include "fdproxy.h"
 #include "driller.h"
 #include "spinlock.h"
+#include "futex.h"
 #include "map_cache.h"
 #include "mmpi_internal.h"
 
 static struct shmem *shmem;
+static struct msg_ring *rings;
+/* sequence numbers and inline slot indexes, for each peer */
+static struct msg_peer *peers;
 static int jobid;
 static int nprocs;
 static int rank;
-static char flip = 1;
+/* zero-copy sends posted by this process */
+static struct driller_send *sends;
+static int nsends;
+/* requests not yet fully posted (sends) or received, for each peer */
+static struct req_queue *send_reqs;
+static struct req_queue *recv_reqs;
+static int nsend_reqs;
+static int nrecv_reqs;
+/* smallest message we remap rather than copy */
+static size_t driller_threshold = MSG_DRILLER_SIZE_THRESHOLD;
+/* how long to spin before sleeping in the kernel */
+static unsigned int wait_spin = MMPI_WAIT_SPIN_LOOPS;
+
+static void mmpi_progress(void);
 
 /*****************/
 
 /*
- * a set of primitives for doubly linked lists in a shared
- * memory segment, which can be mapped by several processes
- * at different addresses
+ * waiting for peers
+ *
+ * whenever a process changes something in shared memory that a peer
+ * may be waiting for (new message, free ring slot, completed send,
+ * barrier), it rings the doorbell of this peer, which costs nothing
+ * unless the peer sleeps
  */
-static void list_init(struct list_head *head) {
-#ifndef NDEBUG
-	head->magic = LIST_MAGIC;
-#endif
-	head->off_next = head->off_prev = 0;
-}
 
-static inline struct list_head *list_next(struct list_head *item) {
-	return (struct list_head*)((char*)item + item->off_next);
+static inline void mmpi_signal(int peer_rank) {
+	futex_signal(&shmem[peer_rank].doorbell);
 }
 
-static inline struct list_head *list_prev(struct list_head *item) {
-	return (struct list_head*)((char*)item + item->off_prev);
-}
+/*
+ * wait until cond becomes true, driving the progress engine meanwhile;
+ * spin for a while, then sleep until the doorbell rings
+ */
+#define mmpi_wait_event(cond) do {					\
+		struct futex *__f = &shmem[rank].doorbell;		\
+		unsigned int __n, __seq;				\
+									\
+		for(__n = 0; ; __n++) {					\
+			mmpi_progress();				\
+			if(cond)					\
+				break;					\
+			if(__n < wait_spin) {				\
+				cpu_relax();				\
+				continue;				\
+			}						\
+			__seq = futex_prepare(__f);			\
+			mmpi_progress();				\
+			if(cond) {					\
+				futex_cancel(__f);			\
+				break;					\
+			}						\
+			futex_sleep(__f, __seq);			\
+		}							\
+	} while(0)
 
-static inline
-intptr_t list_offset(struct list_head *left, struct list_head *right) {
-	return (char*)right - (char*)left;
-}
+/*****************/
 
-static inline
-void list_set_next(struct list_head *left, struct list_head *right) {
-	left->off_next = list_offset(left, right);
-}
+/*
+ * single-producer/single-consumer message rings, one for each
+ * (sender, receiver) pair, so neither side needs a lock and
+ * receiving from a given source never has to scan other messages
+ *
+ * the producer owns r_tail, the consumer owns r_head, and both
+ * only ever increase (indexes wrap modulo MSG_RING_SIZE)
+ *
+ * small messages bypass the ring and go to the inline slots of the
+ * pair, the sequence numbers tell the receiver where to look next
+ */
 
-static inline
-void list_set_prev(struct list_head *left, struct list_head *right) {
-	left->off_prev = list_offset(left, right);
+static inline unsigned int msg_seq_next(unsigned int seq) {
+	/* 0 marks free inline slots */
+	return (seq + 1 != 0) ? seq + 1 : 1;
 }
 
-static inline void list_add(struct list_head *head, struct list_head *new) {
-	struct list_head *next;
-
-	assert(head->magic == LIST_MAGIC);
-	assert(new->magic == LIST_MAGIC);
-
-	next = list_next(head);
-	list_set_next(new, next);
-	list_set_prev(new, head);
-	list_set_next(head, new);
-	list_set_prev(next, new);
+static inline struct msg_ring *msg_ring(int src_rank, int dest_rank) {
+	return rings + dest_rank * nprocs + src_rank;
 }
 
-static inline
-void list_add_tail(struct list_head *head, struct list_head *new) {
-	struct list_head *last;
-
-	assert(head->magic == LIST_MAGIC);
-
-	last = list_prev(head);
-	list_add(last, new);
+static void msg_ring_init(struct msg_ring *r) {
+	r->r_head = r->r_tail = 0;
 }
 
-static inline void list_del(struct list_head *item) {
-	struct list_head *next, *prev;
-
-	assert(item->magic == LIST_MAGIC);
-
-	next = list_next(item);
-	prev = list_prev(item);
-	list_set_next(prev, next);
-	list_set_prev(next, prev);
+/*
+ * sender: return the next free slot in the ring to dest_rank,
+ * or NULL if the ring is full
+ */
+static inline struct message *msg_try_alloc(int dest_rank) {
+	struct msg_ring *r = msg_ring(rank, dest_rank);
+	unsigned int tail = r->r_tail;
+
+	if(tail - r->r_head >= MSG_RING_SIZE)
+		return NULL;
+	/* don't write to the slot before we know it's free */
+	mb();
+	return &r->r_msg[tail % MSG_RING_SIZE];
 }
 
-static inline int list_empty(struct list_head *head) {
-	assert(head->magic == LIST_MAGIC);
+/*
+ * sender: same as above, but wait until the receiver has
+ * released a slot if the ring is full
+ */
+static struct message *msg_alloc(int dest_rank) {
+	struct message *m;
 
-	return (list_next(head) == head);
+	mmpi_wait_event((m = msg_try_alloc(dest_rank)) != NULL);
+	return m;
 }
 
-#define offsetof(TYPE, MEMBER) ((size_t) &((TYPE *)0)->MEMBER)
-
-#define list_entry(ptr, type, member) ({			\
-	const typeof( ((type *)0)->member ) *__mptr = (ptr);	\
-	(type *)( (char *)__mptr - offsetof(type,member) );})
-
-#define list_for_each(pos, head) \
-	for(pos = list_next(head); pos != head; pos = list_next(pos))
-
-/*****************/
-
 /*
- * some message queuing primitives
+ * sender: make the slot returned by msg_alloc visible to dest_rank
  */
-
-static void msg_queue_init(struct message_queue *q) {
-	spin_lock_init(&q->q_lock);
-	list_init(&q->q_list);
-	q->q_length = 0;
+static inline void msg_post(int dest_rank) {
+	struct msg_ring *r = msg_ring(rank, dest_rank);
+	struct msg_peer *p = peers + dest_rank;
+
+	p->p_send_seq = msg_seq_next(p->p_send_seq);
+	r->r_msg[r->r_tail % MSG_RING_SIZE].m_seq = p->p_send_seq;
+	/* message content must be visible before the new tail */
+	mb();
+	r->r_tail++;
+	mmpi_signal(dest_rank);
 }
 
-static inline int __msg_queue_empty(struct message_queue *q) {
-	return (q->q_length == 0);
-}
+/*
+ * receiver: return the oldest message from src_rank,
+ * or NULL if there is none, or if the next one is inline
+ */
+static inline struct message *msg_try_peek(int src_rank) {
+	struct msg_ring *r = msg_ring(src_rank, rank);
+	unsigned int head = r->r_head;
+	struct message *m;
 
-static inline void __msg_enqueue(struct message_queue *q, struct message *m) {
-	list_add_tail(&q->q_list, &m->m_list);
-	q->q_length++;
+	if(r->r_tail == head)
+		return NULL;
+	/* don't read the slot before we know it's posted */
+	mb();
+	m = &r->r_msg[head % MSG_RING_SIZE];
+	if(m->m_seq != msg_seq_next(peers[src_rank].p_recv_seq))
+		return NULL;
+	return m;
 }
 
-static inline void __msg_enqueue_head(struct message_queue *q, struct message *m) {
-	list_add(&q->q_list, &m->m_list);
-	q->q_length++;
+/*
+ * receiver: give the slot returned by msg_try_peek back to src_rank
+ */
+static inline void msg_release(int src_rank) {
+	struct msg_ring *r = msg_ring(src_rank, rank);
+
+	/* we're done reading the slot before the sender can reuse it */
+	mb();
+	r->r_head++;
+	peers[src_rank].p_recv_seq =
+		msg_seq_next(peers[src_rank].p_recv_seq);
+	mmpi_signal(src_rank);
 }
 
-static inline void __msg_dequeue(struct message_queue *q, struct message *m) {
-	list_del(&m->m_list);
-	q->q_length--;
+/*
+ * sender: send a message of at most MSG_INLINE_SIZE_BYTES in the next
+ * inline slot, return 0 if the slot is still in use
+ */
+static int msg_send_inline(int dest_rank, void *buf, size_t size) {
+	struct msg_peer *p = peers + dest_rank;
+	struct msg_inline *mi;
+
+	mi = &msg_ring(rank, dest_rank)->r_inline[p->p_send_inline
+						  % MSG_INLINE_RING_SIZE];
+	if(mi->mi_seq != 0)
+		return 0;
+	/* don't write to the slot before we know it's free */
+	mb();
+	mi->mi_size = size;
+	memcpy(mi->mi_payload, buf, size);
+	p->p_send_seq = msg_seq_next(p->p_send_seq);
+	/* message content must be visible before its sequence number */
+	mb();
+	mi->mi_seq = p->p_send_seq;
+	p->p_send_inline++;
+	mmpi_signal(dest_rank);
+	return 1;
 }
 
-static inline void msg_queue_lock(struct message_queue *q) {
-	spin_lock(&q->q_lock);
+/*
+ * receiver: return the next message from src_rank if it is inline,
+ * or NULL
+ */
+static inline struct msg_inline *msg_try_peek_inline(int src_rank) {
+	struct msg_peer *p = peers + src_rank;
+	struct msg_inline *mi;
+
+	mi = &msg_ring(src_rank, rank)->r_inline[p->p_recv_inline
+						 % MSG_INLINE_RING_SIZE];
+	if(mi->mi_seq != msg_seq_next(p->p_recv_seq))
+		return NULL;
+	/* don't read the slot before we know it's posted */
+	mb();
+	return mi;
 }
 
-static inline void msg_queue_unlock(struct message_queue *q) {
-	spin_unlock(&q->q_lock);
+/*
+ * receiver: give the slot returned by msg_try_peek_inline back,
+ * the sender never waits for it, so no need to signal
+ */
+static inline void msg_release_inline(int src_rank, struct msg_inline *mi) {
+	struct msg_peer *p = peers + src_rank;
+
+	/* we're done reading the slot before the sender can reuse it */
+	mb();
+	mi->mi_seq = 0;
+	p->p_recv_seq = msg_seq_next(p->p_recv_seq);
+	p->p_recv_inline++;
 }
 
-static inline void msg_enqueue(struct message_queue *q, struct message *m) {
-	msg_queue_lock(q);
-	__msg_enqueue(q, m);
-	msg_queue_unlock(q);
-}
+/*****************/
 
-static struct message *msg_dequeue_head(struct message_queue *q) {
-	struct message *m = NULL;
+/*
+ * completion of zero-copy (driller) messages
+ *
+ * each ring slot has a completion word, set by the sender when it posts
+ * a driller message in the slot, and cleared by the receiver once it
+ * has read the data; this lets the sender keep many messages in flight
+ * and only wait when it needs its buffer back
+ */
 
-	do {
-		msg_queue_lock(q);
-		if(!__msg_queue_empty(q)) {
-			m = list_entry(list_next(&q->q_list),
-				       struct message, m_list);
-			__msg_dequeue(q, m);
-		}
-		msg_queue_unlock(q);
-	} while(m == NULL);
-	return m;
-}
+static inline volatile unsigned int *msg_compl(int src_rank, int dest_rank,
+					       struct message *m) {
+	struct msg_ring *r = msg_ring(src_rank, dest_rank);
 
-static struct message *msg_dequeue_from(struct message_queue *q, int src) {
-	struct message *m = NULL;
+	return &r->r_compl[m - r->r_msg];
+}
 
-	do {
-		struct list_head *p;
+/*
+ * receiver: tell the sender we're done with the data of the message
+ * whose completion word is c; the slot itself may have been released
+ * already, the sender won't reuse c until we clear it
+ */
+static inline void msg_complete(int src_rank, volatile unsigned int *c) {
+	/* we're done reading the data before the sender can reuse it */
+	mb();
+	*c = 0;
+	mmpi_signal(src_rank);
+}
 
-		msg_queue_lock(q);
-		list_for_each(p, &q->q_list) {
-			m = list_entry(p, struct message, m_list);
-			if(m->m_src == src) {
-				__msg_dequeue(q, m);
-				break;
-			} else
-				m = NULL;
-		}
-		msg_queue_unlock(q);
-	} while(m == NULL);
-	return m;
+/*
+ * sender: return the record for a send in the given slot
+ */
+static inline struct driller_send *send_slot(int dest_rank,
+					     struct message *m) {
+	return sends + dest_rank*MSG_RING_SIZE
+		+ (m - msg_ring(rank, dest_rank)->r_msg);
 }
 
-static struct message *msg_alloc(void) {
-	struct shmem *my = shmem + rank;
-	struct message *m;
+/*
+ * sender: forget about a completed send, and complete its request
+ */
+static void send_done(struct driller_send *ds) {
+	if(ds->ds_req != NULL) {
+		ds->ds_req->rq_state = REQ_DONE;
+		ds->ds_req->rq_ds = NULL;
+		ds->ds_req = NULL;
+	}
+	ds->ds_compl = NULL;
+	nsends--;
+}
 
-	m = msg_dequeue_head(&my->free_q);
-	assert(m->m_type == MSG_FREE);
-	return m;
+/*
+ * sender: check whether the send recorded in ds is still in flight
+ */
+static int send_test(struct driller_send *ds) {
+	if(ds->ds_compl == NULL)
+		return 1;
+	if(*ds->ds_compl != 0)
+		return 0;
+	send_done(ds);
+	return 1;
 }
 
-static void msg_free(struct message *m) {
-	struct shmem *src = shmem + m->m_src;
+/*
+ * sender: wait for all sends of data in [start-end]
+ */
+static void sends_wait_range(void *start, void *end) {
+	struct driller_send *ds;
 
-	m->m_type = MSG_FREE;
-	msg_queue_lock(&src->free_q);
-	__msg_enqueue_head(&src->free_q, m);
-	msg_queue_unlock(&src->free_q);
+	for(ds = sends; nsends > 0 && ds < sends + nprocs*MSG_RING_SIZE; ds++)
+		if(ds->ds_compl != NULL
+		   && ds->ds_start < end && ds->ds_end > start)
+			mmpi_wait_event(send_test(ds));
 }
 
 /*****************/
@@ -222,19 +334,18 @@ static void msg_free(struct message *m) {
  */
 static void mmpi_send_driller_inval(int dest_rank,
 				    struct map_rec *map, struct fdkey *key) {
-	struct shmem *dest = shmem + dest_rank;
 	struct message *m;
 
 	dbg("send driller_inval to rank %d for <%s>",
 	    dest_rank, fdproxy_keystr(key));
 
-	m = msg_alloc();
+	m = msg_alloc(dest_rank);
 
 	m->m_type = MSG_DRILLER_INVAL;
 	memcpy(&m->m_drill.map, map, sizeof(*map));
 	memcpy(&m->m_drill.key, key, sizeof(*key));
 
-	msg_enqueue(&dest->recv_q, m);
+	msg_post(dest_rank);
 }
 
 /*
@@ -245,9 +356,27 @@ static void mmpi_map_invalidate_cb(struct map_rec *map) {
 	struct fdkey *key;
 	int i;
 
+	if(driller_map_pool(map) != NULL || driller_map_recycled(map)) {
+		/* the file outlives this map, and peers may keep it
+		 * mapped: just let sends from this map complete before
+		 * its pages are given back */
+		udata = (driller_map_pool(map) != NULL ?
+			 driller_map_pool(map)->user_data : map->user_data);
+		if(udata != NULL) {
+			mmpi_wait_event(nsend_reqs == 0);
+			sends_wait_range(map->start, map->end);
+		}
+		return;
+	}
+
 	udata = map->user_data;
 	if(udata == NULL)
 		return;
+	/* queued sends may refer to this map, so must not be overtaken
+	 * by the DRILLER_INVAL; and the data stays in the file until we
+	 * return, so peers still reading from this map can finish */
+	mmpi_wait_event(nsend_reqs == 0);
+	sends_wait_range(map->start, map->end);
 	key = &udata->key;
 	dbg("invalidate <%s>", fdproxy_keystr(key));
 	fdproxy_client_invalidate_fd(key);
@@ -260,46 +389,31 @@ static void mmpi_map_invalidate_cb(struct map_rec *map) {
 }
 
 /*
- * send data buffer by copying to the shared mem
- */
-static void mmpi_send_frags(int dest_rank, void *buf, size_t size) {
-	struct shmem *dest = shmem + dest_rank;
-	struct message *m;
-	size_t remainder = size;
-	char *p = buf;
-
-	do {
-		m = msg_alloc();
-
-		m->m_size = min(remainder, MSG_PAYLOAD_SIZE_BYTES);
-		memcpy(m->m_payload, p, m->m_size);
-		p += m->m_size;
-		remainder -= m->m_size;
-		m->m_type = remainder ? MSG_FRAG : MSG_DATA;
-
-		msg_enqueue(&dest->recv_q, m);
-	} while(remainder > 0);
-}
-
-/*
- * send data buffer by remapping it in the receiving process
+ * prepare the description of a buffer to be remapped in dest_rank,
+ * return 0 if the buffer is not in a driller map
  */
-static void mmpi_send_driller(int dest_rank, void *buf, size_t size) {
-	struct shmem *my = shmem + rank;
-	struct shmem *dest = shmem + dest_rank;
-	struct message *m;
-	struct map_rec *map;
+static int mmpi_prepare_driller(int dest_rank, void *buf, size_t size,
+				struct driller_payload *drill) {
+	struct map_rec *found, *map, *pool;
 	struct fdkey *key;
 	struct driller_udata *udata;
+	off_t offset;
 
-	map = driller_lookup_map(buf, size);
-	if(map == NULL) {
-		mmpi_send_frags(dest_rank, buf, size);
-		return;
-	}
+	found = map = driller_lookup_map(buf, size);
+	if(map == NULL)
+		return 0;
 	assert(map->start <= buf);
 	assert(map->end >= buf + size);
 
+	offset = buf - map->start;
+	pool = driller_map_pool(map);
+	if(pool != NULL) {
+		/* describe the data relative to the whole pool, so that
+		 * peers map it only once */
+		offset += map->offset;
+		map = pool;
+	}
+
 	/* send the fd to fdproxy if not already done */
 	if(map->user_data == NULL) {
 		udata = driller_malloc(sizeof(*udata) + nprocs);
@@ -316,43 +430,97 @@ static void mmpi_send_driller(int dest_rank, void *buf, size_t size) {
 	/* mark dest_rank as user of this map */
 	udata->references[dest_rank] = 1;
 
-	m = msg_alloc();
+	memcpy(&drill->map, map, sizeof(*map));
+	memcpy(&drill->key, key, sizeof(*key));
+	drill->offset = offset;
+	drill->length = size;
+	driller_put_map(found);
+	return 1;
+}
 
-	m->m_type = MSG_DRILLER;
-	memcpy(&m->m_drill.map, map, sizeof(*map));
-	memcpy(&m->m_drill.key, key, sizeof(*key));
-	m->m_drill.offset = buf - map->start;
-	m->m_drill.length = size;
-	m->m_size = sizeof(struct driller_payload);
+/*
+ * send data buffer by copying to the shared mem,
+ * return 0 if the ring is full before the last fragment
+ */
+static int mmpi_send_frags(struct mmpi_request *req) {
+	struct message *m;
+	size_t len;
 
-	/* want to be notified of recv completion */
-	my->driller_send_running = 1;
+	/* small enough to fit in a cache line? */
+	if(req->rq_size <= MSG_INLINE_SIZE_BYTES
+	   && msg_send_inline(req->rq_rank, req->rq_buf, req->rq_size)) {
+		req->rq_state = REQ_DONE;
+		return 1;
+	}
+
+	do {
+		m = msg_try_alloc(req->rq_rank);
+		if(m == NULL)
+			return 0;
 
-	msg_enqueue(&dest->recv_q, m);
+		len = min(req->rq_size - req->rq_done, MSG_PAYLOAD_SIZE_BYTES);
+		m->m_size = len;
+		memcpy(m->m_payload, req->rq_buf + req->rq_done, len);
+		req->rq_done += len;
+		m->m_type = (req->rq_done < req->rq_size) ? MSG_FRAG : MSG_DATA;
 
-	/* wait for recv completion */
-	while(my->driller_send_running)
-		nop();
+		msg_post(req->rq_rank);
+	} while(req->rq_done < req->rq_size);
+
+	req->rq_state = REQ_DONE;
+	return 1;
 }
 
-void mmpi_send(int dest_rank, void *buf, size_t size) {
+/*
+ * send data buffer by remapping it in the receiving process,
+ * return 0 if the ring is full
+ */
+static int mmpi_send_driller(struct mmpi_request *req) {
+	struct message *m;
+	struct driller_send *ds;
 
-	if(size >= MSG_DRILLER_SIZE_THRESHOLD)
-		mmpi_send_driller(dest_rank, buf, size);
-	else
-		mmpi_send_frags(dest_rank, buf, size);
+	m = msg_try_alloc(req->rq_rank);
+	if(m == NULL)
+		return 0;
+
+	/* the slot is free, so is its completion word, unless it was used
+	 * for a zero-copy send we didn't check yet */
+	ds = send_slot(req->rq_rank, m);
+	if(!send_test(ds))
+		return 0;
+
+	m->m_type = MSG_DRILLER;
+	memcpy(&m->m_drill, &req->rq_drill, sizeof(req->rq_drill));
+	m->m_size = sizeof(struct driller_payload);
+
+	/* want to be notified of recv completion */
+	ds->ds_compl = msg_compl(rank, req->rq_rank, m);
+	*ds->ds_compl = 1;
+	ds->ds_start = req->rq_buf;
+	ds->ds_end = req->rq_buf + req->rq_size;
+	ds->ds_req = req;
+	nsends++;
+	req->rq_ds = ds;
+	req->rq_state = REQ_POSTED;
+
+	msg_post(req->rq_rank);
+	return 1;
 }
 
 /*
- * receive data buffer by remapping it locally
+ * find a local mapping of the data of driller message m, and fix the
+ * data offset in m to be relative to this mapping
+ *
+ * the mapping is usually the one in the map cache, but a cached mapping
+ * can't move while zero-copy views point into it: if it should, map the
+ * data separately instead, set *private and let the caller remove it
  */
-static void mmpi_recv_driller(int src_rank, void *buf, size_t *size,
-			      struct message *m) {
-	struct shmem *src = shmem + src_rank;
+static struct map_cache *mmpi_map_driller(struct message *m, int *private) {
 	struct map_rec *map;
 	struct fdkey *key;
-	struct map_cache *mc;
+	struct map_cache *mc, *pmc;
 
+	*private = 0;
 	map = &m->m_drill.map;
 	key = &m->m_drill.key;
 	mc = map_cache_lookup(key);
@@ -392,119 +560,481 @@ static void mmpi_recv_driller(int src_rank, void *buf, size_t *size,
 		   || (data_end <= local_map_start)
 		   || (data_end > local_map_end)) {
 			/* it is: need to update the mapping */
-			map_cache_update(map, key, mc);
+			if(mc->mc_views == 0) {
+				map_cache_update(map, key, mc);
+				return mc;
+			}
+			pmc = malloc(sizeof(*pmc));
+			assert(pmc != NULL);
+			memcpy(&pmc->mc_map, map, sizeof(*map));
+			pmc->mc_map.fd = mc->mc_map.fd;
+			pmc->mc_addr = driller_install_map(&pmc->mc_map);
+			pmc->mc_views = 0;
+			*private = 1;
+			return pmc;
 		} else {
 			/* it is not: need to fix the data offset */
 			m->m_drill.offset = data_start - local_map_start;
 		}
 	}
+	return mc;
+}
+
+static void mmpi_unmap_private(struct map_cache *mc) {
+	driller_remove_map(&mc->mc_map, mc->mc_addr);
+	free(mc);
+}
+
+/*
+ * receive data buffer by remapping it locally
+ */
+static void mmpi_recv_driller(int src_rank, void *buf, size_t *size,
+			      struct message *m) {
+	struct map_cache *mc;
+	int private;
+
+	mc = mmpi_map_driller(m, &private);
 	memcpy(buf, mc->mc_addr + m->m_drill.offset, m->m_drill.length);
 	*size += m->m_drill.length;
+	if(private)
+		mmpi_unmap_private(mc);
 
 	/* notify sender of recv completion */
-	src->driller_send_running = 0;
+	msg_complete(src_rank, msg_compl(src_rank, rank, m));
 }
 
 /*
- * receive data buffer, and handle DRILLER_INVAL messages
+ * receive data buffer as a view of the sender's memory, and
+ * leave the completion to mmpi_release_zc
  */
-void mmpi_recv(int src_rank, void *buf, size_t *size) {
-	struct shmem *my = shmem + rank;
-	struct message *m = NULL;
-	int last_frag = 0;
-	char *p = buf;
-	struct fdkey *key;
+static void mmpi_recv_driller_zc(int src_rank, struct mmpi_zc *zc,
+				 struct message *m) {
+	zc->zc_mc = mmpi_map_driller(m, &zc->zc_private);
+	if(!zc->zc_private)
+		zc->zc_mc->mc_views++;
+	zc->zc_addr = zc->zc_mc->mc_addr + m->m_drill.offset;
+	zc->zc_size = m->m_drill.length;
+	zc->zc_compl = msg_compl(src_rank, rank, m);
+}
 
-	*size = 0;
-	do {
-		m = msg_dequeue_from(&my->recv_q, src_rank);
-
-		switch(m->m_type) {
-		case MSG_DATA:
-		case MSG_FRAG:
-			assert(m->m_size <= MSG_PAYLOAD_SIZE_BYTES);
-			memcpy(p, m->m_payload, m->m_size);
-			p += m->m_size;
-			*size += m->m_size;
-			last_frag = (m->m_type == MSG_DATA);
+/*****************/
+
+/*
+ * progress engine
+ *
+ * requests wait in a FIFO per peer until all their messages are in
+ * the ring (sends) or have been read from the ring (receives); the
+ * engine runs whenever a process calls into mmpi, so data keeps
+ * moving while the application waits for any request
+ */
+
+static void req_enqueue(struct req_queue *q, struct mmpi_request *req) {
+	req->rq_next = NULL;
+	if(q->q_tail != NULL)
+		q->q_tail->rq_next = req;
+	else
+		q->q_head = req;
+	q->q_tail = req;
+}
+
+static void req_dequeue(struct req_queue *q) {
+	q->q_head = q->q_head->rq_next;
+	if(q->q_head == NULL)
+		q->q_tail = NULL;
+}
+
+/*
+ * push the queued sends to dest_rank in the ring, in order
+ */
+static void progress_sends(int dest_rank) {
+	struct req_queue *q = send_reqs + dest_rank;
+	struct mmpi_request *req;
+	int posted;
+
+	while((req = q->q_head) != NULL) {
+		if(req->rq_driller)
+			posted = mmpi_send_driller(req);
+		else
+			posted = mmpi_send_frags(req);
+		if(!posted)
 			break;
-		case MSG_DRILLER:
-			mmpi_recv_driller(src_rank, buf, size, m);
+		req_dequeue(q);
+		nsend_reqs--;
+	}
+}
+
+/*
+ * receiver: append data copied from a message to req
+ */
+static void req_copy(struct mmpi_request *req, void *data, size_t size) {
+	if(req->rq_zc != NULL) {
+		/* no remote mapping to point to: copy */
+		req->rq_buf = realloc(req->rq_buf, req->rq_done + size);
+		assert(req->rq_buf != NULL || size == 0);
+		req->rq_zc->zc_addr = req->rq_buf;
+		req->rq_zc->zc_size = req->rq_done + size;
+		req->rq_zc->zc_copy = 1;
+	}
+	memcpy(req->rq_buf + req->rq_done, data, size);
+	req->rq_done += size;
+}
+
+/*
+ * read message m from src_rank into req,
+ * return 1 if this completes req
+ */
+static int progress_recv_msg(int src_rank, struct mmpi_request *req,
+			     struct message *m) {
+	struct fdkey *key;
+
+	switch(m->m_type) {
+	case MSG_DATA:
+	case MSG_FRAG:
+		assert(m->m_size <= MSG_PAYLOAD_SIZE_BYTES);
+		req_copy(req, m->m_payload, m->m_size);
+		return m->m_type == MSG_DATA;
+	case MSG_DRILLER:
+		if(req->rq_zc != NULL)
+			mmpi_recv_driller_zc(src_rank, req->rq_zc, m);
+		else
+			mmpi_recv_driller(src_rank, req->rq_buf,
+					  &req->rq_done, m);
+		return 1;
+	case MSG_DRILLER_INVAL:
+		key = &m->m_drill.key;
+		dbg("driller_inval on <%s>", fdproxy_keystr(key));
+		map_cache_remove(key);
+		return 0;
+	default:
+		err("bad message type: %d in msg %p", m->m_type, m);
+	}
+	return 0;
+}
+
+/*
+ * read messages from src_rank into the queued receives, in order
+ */
+static void progress_recvs(int src_rank) {
+	struct req_queue *q = recv_reqs + src_rank;
+	struct mmpi_request *req;
+	struct message *m;
+	struct msg_inline *mi;
+	int last_frag;
+
+	while((req = q->q_head) != NULL) {
+		if((mi = msg_try_peek_inline(src_rank)) != NULL) {
+			req_copy(req, mi->mi_payload, mi->mi_size);
+			msg_release_inline(src_rank, mi);
 			last_frag = 1;
+		} else if((m = msg_try_peek(src_rank)) != NULL) {
+			last_frag = progress_recv_msg(src_rank, req, m);
+			msg_release(src_rank);
+		} else
 			break;
-		case MSG_DRILLER_INVAL:
-			key = &m->m_drill.key;
-			dbg("driller_inval on <%s>", fdproxy_keystr(key));
-			map_cache_remove(key);
-			break;
-		default:
-			err("bad message type: %d in msg %p", m->m_type, m);
+
+		if(last_frag) {
+			req_dequeue(q);
+			nrecv_reqs--;
+			if(req->rq_rsize != NULL)
+				*req->rq_rsize = req->rq_done;
+			req->rq_state = REQ_DONE;
 		}
+	}
+}
+
+static void mmpi_progress(void) {
+	static int in_recv;
+	int i;
 
-		msg_free(m);
-	} while(!last_frag);
+	if(nsend_reqs > 0)
+		for(i = 0; i < nprocs; i++)
+			if(send_reqs[i].q_head != NULL)
+				progress_sends(i);
+
+	/* receiving may mmap or malloc, and thus come back here through
+	 * the invalidate callback: only the sends can progress then */
+	if(nrecv_reqs > 0 && !in_recv) {
+		in_recv = 1;
+		for(i = 0; i < nprocs; i++)
+			if(recv_reqs[i].q_head != NULL)
+				progress_recvs(i);
+		in_recv = 0;
+	}
 }
 
 /*
- * a simple barrier in shared memory
+ * return non-zero once req is complete
  */
-void mmpi_barrier(void) {
+static int req_test(struct mmpi_request *req) {
+	if(req->rq_state == REQ_POSTED)
+		send_test(req->rq_ds);
+	return req->rq_state == REQ_DONE;
+}
 
-#define box(rank) (shmem[rank].barrier_box)
-#define set_box(rank) (box(rank) = flip)
-#define box_is_set(rank) (box(rank) == flip)
+static void req_wait(struct mmpi_request *req) {
+	mmpi_wait_event(req_test(req));
+}
 
-	if(rank != 0) {
-		int n = 0;
+static void req_start_send(struct mmpi_request *req,
+			   int dest_rank, void *buf, size_t size) {
+	memset(req, 0, sizeof(*req));
+	req->rq_send = 1;
+	req->rq_rank = dest_rank;
+	req->rq_state = REQ_QUEUED;
+	req->rq_buf = buf;
+	req->rq_size = size;
+	if(size >= driller_threshold)
+		req->rq_driller = mmpi_prepare_driller(dest_rank, buf, size,
+						       &req->rq_drill);
+
+	req_enqueue(send_reqs + dest_rank, req);
+	nsend_reqs++;
+	mmpi_progress();
+}
+
+static void req_start_recv(struct mmpi_request *req, int src_rank,
+			   void *buf, size_t *size, struct mmpi_zc *zc) {
+	memset(req, 0, sizeof(*req));
+	req->rq_rank = src_rank;
+	req->rq_state = REQ_QUEUED;
+	req->rq_buf = buf;
+	req->rq_rsize = size;
+	req->rq_zc = zc;
+
+	req_enqueue(recv_reqs + src_rank, req);
+	nrecv_reqs++;
+	mmpi_progress();
+}
+
+/*****************/
+
+void mmpi_send(int dest_rank, void *buf, size_t size) {
+	struct mmpi_request req;
+
+	req_start_send(&req, dest_rank, buf, size);
+	req_wait(&req);
+}
+
+/*
+ * send without waiting for the receiver to read the data
+ *
+ * buf must stay allocated and unmodified until mmpi_flush_sends()
+ * returns: unmapping it waits for the receiver, but free() of a heap
+ * buffer doesn't, and malloc may hand out the memory again while the
+ * receiver still reads it
+ */
+void mmpi_post_send(int dest_rank, void *buf, size_t size) {
+	struct mmpi_request req;
+
+	req_start_send(&req, dest_rank, buf, size);
+	mmpi_wait_event(req.rq_state != REQ_QUEUED);
+	/* nobody will wait for this one */
+	if(req.rq_state == REQ_POSTED)
+		req.rq_ds->ds_req = NULL;
+}
+
+/*
+ * wait until receivers have read the data of all posted sends
+ */
+void mmpi_flush_sends(void) {
+	sends_wait_range(NULL, (void*)UINTPTR_MAX);
+}
+
+/*
+ * receive data buffer, and handle DRILLER_INVAL messages
+ */
+void mmpi_recv(int src_rank, void *buf, size_t *size) {
+	struct mmpi_request req;
+
+	req_start_recv(&req, src_rank, buf, size, NULL);
+	req_wait(&req);
+}
 
-		set_box(rank);
-		while(!box_is_set(0))
-			if(n++ > 10)
-				nop();
+/*
+ * zero-copy receive: return a read-only view of the next message from
+ * src_rank, and its size in *size
+ *
+ * large messages are not copied, the view points to the sender's
+ * memory, and the sender's buffer stays busy until the view is
+ * released with mmpi_release_zc(*zc): don't hold on to it, and don't
+ * wait for sends to src_rank meanwhile
+ */
+const void *mmpi_recv_zc(int src_rank, size_t *size, struct mmpi_zc **zc) {
+	struct mmpi_request req;
+
+	*zc = malloc(sizeof(**zc));
+	assert(*zc != NULL);
+	memset(*zc, 0, sizeof(**zc));
+	(*zc)->zc_rank = src_rank;
+
+	req_start_recv(&req, src_rank, NULL, NULL, *zc);
+	req_wait(&req);
+
+	*size = (*zc)->zc_size;
+	return (*zc)->zc_addr;
+}
+
+/*
+ * release a view returned by mmpi_recv_zc
+ */
+void mmpi_release_zc(struct mmpi_zc *zc) {
+	if(zc->zc_copy) {
+		free(zc->zc_addr);
 	} else {
-		int i;
-		for (i = 1; i < nprocs; i++) {
-			int n = 0;
+		if(zc->zc_private)
+			mmpi_unmap_private(zc->zc_mc);
+		else
+			zc->zc_mc->mc_views--;
+		msg_complete(zc->zc_rank, zc->zc_compl);
+	}
+	free(zc);
+}
 
-			while(!box_is_set(i))
-				if(n++ > 10)
-					nop();
-		}
-		set_box(0);
+/*
+ * non-blocking send: buf must not be modified until the request is
+ * complete; messages to a given rank are received in the order
+ * they were sent, whether they were sent with or without blocking
+ */
+struct mmpi_request *mmpi_isend(int dest_rank, void *buf, size_t size) {
+	struct mmpi_request *req;
+
+	req = malloc(sizeof(*req));
+	assert(req != NULL);
+	req_start_send(req, dest_rank, buf, size);
+	return req;
+}
+
+/*
+ * non-blocking receive: *size is set when the request is complete
+ */
+struct mmpi_request *mmpi_irecv(int src_rank, void *buf, size_t *size) {
+	struct mmpi_request *req;
+
+	req = malloc(sizeof(*req));
+	assert(req != NULL);
+	req_start_recv(req, src_rank, buf, size, NULL);
+	return req;
+}
+
+/*
+ * wait for completion of req, and free it
+ */
+void mmpi_wait(struct mmpi_request *req) {
+	req_wait(req);
+	free(req);
+}
+
+void mmpi_waitall(int count, struct mmpi_request **reqs) {
+	int i;
+
+	for(i = 0; i < count; i++)
+		mmpi_wait(reqs[i]);
+}
+
+/*
+ * return non-zero and free req if it is complete
+ */
+int mmpi_test(struct mmpi_request *req) {
+	mmpi_progress();
+	if(!req_test(req))
+		return 0;
+	free(req);
+	return 1;
+}
+
+/*
+ * barriers
+ *
+ * all flags are monotonic barrier numbers, so a fast process may set
+ * the flag of a slow one for the next barrier before the slow one has
+ * seen it set for the current one; this is fine as long as waiters
+ * test for "at least the current barrier"
+ */
+
+static unsigned int barrier_epoch;
+static void (*barrier_fn)(void);
+
+static inline int barrier_reached(struct barrier_flag *f) {
+	return (int)(f->bf_epoch - barrier_epoch) >= 0;
+}
+
+static inline void barrier_set(int peer_rank, struct barrier_flag *f) {
+	f->bf_epoch = barrier_epoch;
+	mmpi_signal(peer_rank);
+}
+
+/*
+ * dissemination barrier: in round k, signal rank + 2^k and wait for
+ * rank - 2^k; after log2(nprocs) rounds everybody has heard from
+ * everybody, and no process ever waits for more than one peer at once
+ */
+static void mmpi_barrier_dissemination(void) {
+	struct barrier_flag *f;
+	int k, dist;
+
+	for(k = 0, dist = 1; dist < nprocs; k++, dist <<= 1) {
+		f = &shmem[(rank + dist) % nprocs].barrier_round[k];
+		barrier_set((rank + dist) % nprocs, f);
+		f = &shmem[rank].barrier_round[k];
+		mmpi_wait_event(barrier_reached(f));
 	}
-	flip = !flip;
+}
+
+/*
+ * combining tree barrier: wait for our children to arrive, tell our
+ * parent, then wait for it to release us, and release our children
+ */
+static void mmpi_barrier_tree(void) {
+	int parent, child, i;
+
+	for(i = 1; i <= MMPI_BARRIER_TREE_ARITY; i++) {
+		child = rank * MMPI_BARRIER_TREE_ARITY + i;
+		if(child >= nprocs)
+			break;
+		mmpi_wait_event(barrier_reached(&shmem[child].barrier_arrive));
+	}
+
+	if(rank != 0) {
+		parent = (rank - 1) / MMPI_BARRIER_TREE_ARITY;
+		barrier_set(parent, &shmem[rank].barrier_arrive);
+		mmpi_wait_event(
+			barrier_reached(&shmem[parent].barrier_release));
+	}
+
+	shmem[rank].barrier_release.bf_epoch = barrier_epoch;
+	for(i = 1; i <= MMPI_BARRIER_TREE_ARITY; i++) {
+		child = rank * MMPI_BARRIER_TREE_ARITY + i;
+		if(child >= nprocs)
+			break;
+		mmpi_signal(child);
+	}
+}
+
+void mmpi_barrier(void) {
+	barrier_epoch++;
+	barrier_fn();
 }
 
 static void mmpi_init_shmem(void) {
 	unsigned int page_size;
-	unsigned int shmem_size;
+	size_t shmem_size;
 	int shmem_fd;
 	int i;
 	struct fdkey key;
 
-	shmem_size = nprocs*sizeof(*shmem);
+	/* per-rank state, followed by one ring per (sender, receiver) pair;
+	 * the file is sparse, so rings that are never used cost nothing */
+	shmem_size = nprocs*sizeof(*shmem)
+		+ nprocs*nprocs*sizeof(struct msg_ring);
 	page_size = sysconf(_SC_PAGESIZE);
 	shmem_size = (shmem_size + page_size - 1) & ~(page_size - 1);
 	fdproxy_set_key_id(&key, SHMEM_KEY_MAGIC);
 
 	if(rank == 0) {
-		char *filename;
-		int len;
-
-		/* create file */
-		len = snprintf(NULL, 0, "%s/mmpi_shmem-%d", TMPDIR, jobid);
-		filename = malloc(1+len);
-		sprintf(filename, "%s/mmpi_shmem-%d", TMPDIR, jobid);
-
-		shmem_fd = open(filename, O_CREAT|O_TRUNC|O_RDWR, 0600);
-		if(shmem_fd < 0)
-			perr("open");
-		if(unlink(filename) < 0)
-			perr("unlink");
-		free(filename);
+		shmem_fd = driller_create_fd("mmpi_shmem-%d", jobid);
 		if(ftruncate(shmem_fd, shmem_size))
 			perr("truncate");
-		dbg("allocated %d kB of shared mem", shmem_size/1024);
+		dbg("allocated %zd kB of shared mem", shmem_size/1024);
 
 		shmem = mmap(NULL, shmem_size, PROT_READ|PROT_WRITE, 
 			     MAP_SHARED|MAP_NORESERVE, shmem_fd, 0);
@@ -512,20 +1042,11 @@ static void mmpi_init_shmem(void) {
 			perr("mmap");
 
 		/* initialize shmem */
-		for(i = 0; i < nprocs; i++) {
-			struct shmem *shm = shmem + i;
-			struct message *m;
-
-			msg_queue_init(&shm->free_q);
-			msg_queue_init(&shm->recv_q);
-			for(m = shm->msg_pool;
-			    m < shm->msg_pool + MSG_POOL_SIZE; m++) {
-				list_init(&m->m_list);
-				m->m_type = MSG_FREE;
-				m->m_src = i;
-				__msg_enqueue(&shm->free_q, m);
-			}
-		}
+		for(i = 0; i < nprocs; i++)
+			futex_init(&shmem[i].doorbell, 0);
+		rings = (struct msg_ring *)(shmem + nprocs);
+		for(i = 0; i < nprocs*nprocs; i++)
+			msg_ring_init(rings + i);
 
 		/* now share it with siblings */
 		fdproxy_client_send_fd(shmem_fd, &key);
@@ -545,14 +1066,215 @@ static void mmpi_init_shmem(void) {
 			     MAP_SHARED|MAP_NORESERVE, shmem_fd, 0);
 		if(shmem == (void*)-1)
 			perr("mmap");
+		rings = (struct msg_ring *)(shmem + nprocs);
 	}
 }
 
+/*
+ * choose how long to spin before sleeping: when ranks outnumber
+ * processors, the peer we wait for may well need our processor,
+ * so sleep right away; MMPI_WAIT_SPIN overrides this
+ */
+static void mmpi_init_wait(void) {
+	long ncpus;
+	char *s;
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if(ncpus > 0 && nprocs > ncpus)
+		wait_spin = 0;
+
+	s = getenv("MMPI_WAIT_SPIN");
+	if(s != NULL)
+		wait_spin = strtoul(s, NULL, 0);
+	dbg("spin %u loops before sleeping", wait_spin);
+}
+
+/*
+ * choose the barrier algorithm, all ranks must agree
+ */
+static void mmpi_init_barrier(void) {
+	char *s;
+
+	s = getenv("MMPI_BARRIER");
+	if(s == NULL)
+		s = MMPI_BARRIER_DEFAULT;
+	if(!strcmp(s, "dissemination"))
+		barrier_fn = mmpi_barrier_dissemination;
+	else if(!strcmp(s, "tree"))
+		barrier_fn = mmpi_barrier_tree;
+	else
+		err("unknown barrier algorithm: %s", s);
+	dbg("%s barrier", s);
+}
+
+/*
+ * time MSG_CALIB_ITER round trips of size bytes between ranks 0 and 1,
+ * with the given threshold, in usec
+ */
+static double mmpi_calib_pingpong(char *buf, size_t size, size_t threshold) {
+	struct timeval tv1, tv2;
+	size_t rsize;
+	int i;
+
+	driller_threshold = threshold;
+	/* one more round trip first: a buffer is registered with fdproxy
+	 * and mapped by the receiver on its first zero-copy send */
+	for(i = -1; i < MSG_CALIB_ITER; i++) {
+		if(i == 0)
+			gettimeofday(&tv1, NULL);
+		if(rank == 0) {
+			mmpi_send(1, buf, size);
+			mmpi_recv(1, buf, &rsize);
+		} else {
+			mmpi_recv(0, buf, &rsize);
+			mmpi_send(0, buf, size);
+		}
+	}
+	gettimeofday(&tv2, NULL);
+	return (tv2.tv_sec - tv1.tv_sec) * 1E6 + tv2.tv_usec - tv1.tv_usec;
+}
+
+/*
+ * find the smallest size for which remapping beats copying,
+ * only meaningful in rank 0
+ */
+static size_t mmpi_calibrate(void) {
+	size_t size, threshold = SIZE_MAX;
+	double t_copy, t_drill;
+	char *buf;
+
+	buf = malloc(MSG_CALIB_MAX_SIZE);
+	assert(buf != NULL);
+	memset(buf, 0, MSG_CALIB_MAX_SIZE);
+
+	/* both ranks go through all sizes, only rank 0 decides */
+	for(size = MSG_CALIB_MIN_SIZE; size <= MSG_CALIB_MAX_SIZE; size <<= 1) {
+		t_copy = mmpi_calib_pingpong(buf, size, SIZE_MAX);
+		t_drill = mmpi_calib_pingpong(buf, size, 0);
+		dbg("calibration: %zd bytes copy %.1fus drill %.1fus",
+		    size, t_copy, t_drill);
+		if(t_drill < t_copy && threshold == SIZE_MAX)
+			threshold = size;
+	}
+
+	free(buf);
+	return threshold;
+}
+
+/*
+ * read the crossover saved by a previous job of the same user,
+ * return 0 if there is none
+ */
+static size_t mmpi_profile_read(void) {
+	char path[PATH_MAX];
+	size_t threshold;
+	struct stat st;
+	FILE *f;
+
+	snprintf(path, sizeof(path), MSG_PROFILE_FILE, (unsigned int)getuid());
+	f = fopen(path, "r");
+	if(f == NULL)
+		return 0;
+	/* TMPDIR is shared, ignore a file planted by someone else */
+	if(fstat(fileno(f), &st) != 0 || st.st_uid != getuid()
+	   || fscanf(f, "%zu", &threshold) != 1)
+		threshold = 0;
+	fclose(f);
+	return threshold;
+}
+
+/*
+ * save the crossover for later jobs: written to a temporary file,
+ * then renamed, so that concurrent jobs never read a partial one
+ */
+static void mmpi_profile_write(size_t threshold) {
+	char path[PATH_MAX], tmp[PATH_MAX + 8];
+	FILE *f;
+	int fd;
+
+	snprintf(path, sizeof(path), MSG_PROFILE_FILE, (unsigned int)getuid());
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if(fd < 0)
+		return;
+	f = fdopen(fd, "w");
+	if(f == NULL) {
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+	fprintf(f, "%zu\n", threshold);
+	if(fclose(f) != 0 || rename(tmp, path) != 0)
+		unlink(tmp);
+}
+
+/*
+ * choose the eager/zero-copy crossover, in rank 0 for the whole job:
+ * from the environment, from the profile of a previous job of the same
+ * user on the node, or by measuring it
+ */
+static void mmpi_init_threshold(void) {
+	size_t threshold;
+	char *s;
+
+	if(rank == 0) {
+		/* 0 means "calibrate" */
+		threshold = 0;
+		s = getenv("MMPI_DRILLER_THRESHOLD");
+		if(s != NULL) {
+			/* remapping empty messages is pointless anyway */
+			threshold = strtoul(s, NULL, 0);
+			threshold = max(threshold, 1);
+		} else
+			threshold = mmpi_profile_read();
+		if(threshold == 0 && nprocs < 2)
+			threshold = MSG_DRILLER_SIZE_THRESHOLD;
+		shmem[0].driller_threshold = threshold;
+	}
+	mmpi_barrier();
+
+	if(shmem[0].driller_threshold == 0) {
+		threshold = (rank < 2) ? mmpi_calibrate() : 0;
+		if(rank == 0) {
+			shmem[0].driller_threshold = threshold;
+			mmpi_profile_write(threshold);
+		}
+		mmpi_barrier();
+	}
+
+	driller_threshold = shmem[0].driller_threshold;
+	dbg("remap messages of at least %zd bytes", driller_threshold);
+}
+
+int mmpi_get_rank(void) {
+	return rank;
+}
+
+int mmpi_get_nprocs(void) {
+	return nprocs;
+}
+
+/*
+ * smallest message size sent by remapping the sender's buffer
+ */
+size_t mmpi_driller_threshold(void) {
+	return driller_threshold;
+}
+
 void mmpi_init(int j, int n, int r) {
 	jobid = j;
 	nprocs = n;
 	rank = r;
 
+	mmpi_init_wait();
+	mmpi_init_barrier();
+	sends = calloc(nprocs*MSG_RING_SIZE, sizeof(*sends));
+	assert(sends != NULL);
+	send_reqs = calloc(nprocs, sizeof(*send_reqs));
+	recv_reqs = calloc(nprocs, sizeof(*recv_reqs));
+	assert(send_reqs != NULL && recv_reqs != NULL);
+	peers = calloc(nprocs, sizeof(*peers));
+	assert(peers != NULL);
 	if(rank == 0)
 		/* only rank 0 forks fdproxy daemon */
 		fdproxy_init(jobid, 1);
@@ -564,4 +1286,5 @@ void mmpi_init(int j, int n, int r) {
 	driller_register_map_invalidate_cb(mmpi_map_invalidate_cb);
 	map_cache_init();
 	mmpi_barrier();
+	mmpi_init_threshold();
 }
@@ -13,9 +13,48 @@
 
 #include <sys/types.h>
 
+struct mmpi_request;
+struct mmpi_zc;
+
+enum mmpi_datatype {
+	MMPI_INT,
+	MMPI_LONG,
+	MMPI_FLOAT,
+	MMPI_DOUBLE,
+};
+
+enum mmpi_op {
+	MMPI_SUM,
+	MMPI_PROD,
+	MMPI_MIN,
+	MMPI_MAX,
+};
+
 extern void mmpi_init(int jobid, int nprocs, int rank);
+extern int mmpi_get_rank(void);
+extern int mmpi_get_nprocs(void);
 extern void mmpi_barrier(void);
 extern void mmpi_send(int rank, void *buf, size_t size);
+extern void mmpi_post_send(int rank, void *buf, size_t size);
+extern void mmpi_flush_sends(void);
 extern void mmpi_recv(int rank, void *buf, size_t *size);
+extern struct mmpi_request *mmpi_isend(int rank, void *buf, size_t size);
+extern struct mmpi_request *mmpi_irecv(int rank, void *buf, size_t *size);
+extern void mmpi_wait(struct mmpi_request *req);
+extern void mmpi_waitall(int count, struct mmpi_request **reqs);
+extern int mmpi_test(struct mmpi_request *req);
+extern const void *mmpi_recv_zc(int rank, size_t *size, struct mmpi_zc **zc);
+extern void mmpi_release_zc(struct mmpi_zc *zc);
+extern size_t mmpi_driller_threshold(void);
+
+/* collectives, in mmpi_coll.c */
+extern void mmpi_bcast(void *buf, size_t size, int root);
+extern void mmpi_reduce(void *sendbuf, void *recvbuf, int count,
+			enum mmpi_datatype type, enum mmpi_op op, int root);
+extern void mmpi_allreduce(void *sendbuf, void *recvbuf, int count,
+			   enum mmpi_datatype type, enum mmpi_op op);
+extern void mmpi_gather(void *sendbuf, size_t size, void *recvbuf, int root);
+extern void mmpi_scatter(void *sendbuf, size_t size, void *recvbuf, int root);
+extern void mmpi_alltoall(void *sendbuf, size_t size, void *recvbuf);
 
 #endif /* MMPI_H */
@@ -0,0 +1,491 @@
+/*
+ * mmpi_coll.c
+ *
+ * Copyright 2007 Jean-Marc Saffroy <saffroy@gmail.com>
+ * This file is part of the Driller library.
+ * Driller is free software, distributed under the terms of the
+ * GNU Lesser General Public License version 2.1.
+ *
+ * collective operations for mmpi, built on point-to-point messages:
+ * large messages are remapped by driller, so a reduction can combine
+ * a peer's data as read through mmpi_recv_zc, without copying it
+ * first, and a broadcast lets every rank read the root's buffer
+ */
+
+#include <sys/types.h>
+#include <assert.h>
+
+#include "tunables.h"
+#include "mmpi.h"
+#include "log.h"
+
+/* enough steps of recursive halving for any job */
+#define COLL_MAX_STEPS (8 * sizeof(int))
+
+/*****************/
+
+/*
+ * reduction operators
+ */
+
+static size_t mmpi_type_size(enum mmpi_datatype type) {
+	switch(type) {
+	case MMPI_INT:
+		return sizeof(int);
+	case MMPI_LONG:
+		return sizeof(long);
+	case MMPI_FLOAT:
+		return sizeof(float);
+	case MMPI_DOUBLE:
+		return sizeof(double);
+	default:
+		err("bad datatype: %d", type);
+	}
+	return 0;
+}
+
+#define COLL_OP_LOOP(ctype, out, a, b, count, op) do {			\
+		ctype *__o = (ctype *)(out);				\
+		const ctype *__a = (const ctype *)(a);			\
+		const ctype *__b = (const ctype *)(b);			\
+		int __i;						\
+									\
+		switch(op) {						\
+		case MMPI_SUM:						\
+			for(__i = 0; __i < (count); __i++)		\
+				__o[__i] = __a[__i] + __b[__i];		\
+			break;						\
+		case MMPI_PROD:						\
+			for(__i = 0; __i < (count); __i++)		\
+				__o[__i] = __a[__i] * __b[__i];		\
+			break;						\
+		case MMPI_MIN:						\
+			for(__i = 0; __i < (count); __i++)		\
+				__o[__i] = min(__a[__i], __b[__i]);	\
+			break;						\
+		case MMPI_MAX:						\
+			for(__i = 0; __i < (count); __i++)		\
+				__o[__i] = max(__a[__i], __b[__i]);	\
+			break;						\
+		default:						\
+			err("bad operator: %d", op);			\
+		}							\
+	} while(0)
+
+/*
+ * out = a op b, element-wise; out may be a or b
+ *
+ * all operators are commutative, and a op b == b op a even with
+ * floating point, so ranks combining the same data in a different
+ * order still agree on the result
+ */
+static void mmpi_op(void *out, const void *a, const void *b, int count,
+		    enum mmpi_datatype type, enum mmpi_op op) {
+	switch(type) {
+	case MMPI_INT:
+		COLL_OP_LOOP(int, out, a, b, count, op);
+		break;
+	case MMPI_LONG:
+		COLL_OP_LOOP(long, out, a, b, count, op);
+		break;
+	case MMPI_FLOAT:
+		COLL_OP_LOOP(float, out, a, b, count, op);
+		break;
+	case MMPI_DOUBLE:
+		COLL_OP_LOOP(double, out, a, b, count, op);
+		break;
+	default:
+		err("bad datatype: %d", type);
+	}
+}
+
+/*
+ * receive count elements from src_rank and combine them into acc,
+ * reading them in place if they were remapped
+ */
+static void coll_recv_op(int src_rank, void *acc, int count,
+			 enum mmpi_datatype type, enum mmpi_op op) {
+	struct mmpi_zc *zc;
+	const void *view;
+	size_t size;
+
+	view = mmpi_recv_zc(src_rank, &size, &zc);
+	assert(size == count * mmpi_type_size(type));
+	mmpi_op(acc, acc, view, count, type, op);
+	mmpi_release_zc(zc);
+}
+
+/*****************/
+
+/*
+ * allreduce building blocks
+ *
+ * the recursive algorithms need a power of 2 number of ranks: with
+ * nprocs = 2^k + r, the first r even ranks hand their data to the
+ * next odd rank and sit out, then get the result back from it
+ */
+
+static int coll_pof2(int n) {
+	int p;
+
+	for(p = 1; p * 2 <= n; p <<= 1)
+		;
+	return p;
+}
+
+/* rank in the power of 2 group, or -1 if sitting out */
+static int coll_vrank(int rank, int rem) {
+	if(rank < 2 * rem)
+		return (rank % 2) ? rank / 2 : -1;
+	return rank - rem;
+}
+
+static int coll_rank_of(int vrank, int rem) {
+	return (vrank < rem) ? vrank * 2 + 1 : vrank + rem;
+}
+
+/*
+ * fold the data of the ranks sitting out into their neighbours,
+ * return the rank in the power of 2 group, or -1
+ */
+static int coll_fold(void *acc, int count,
+		     enum mmpi_datatype type, enum mmpi_op op, int rank,
+		     int rem) {
+	size_t size = count * mmpi_type_size(type);
+
+	if(rank < 2 * rem) {
+		if(rank % 2 == 0)
+			mmpi_send(rank + 1, acc, size);
+		else
+			coll_recv_op(rank - 1, acc, count, type, op);
+	}
+	return coll_vrank(rank, rem);
+}
+
+/*
+ * give the result back to the ranks that sat out
+ */
+static void coll_unfold(void *acc, int count,
+			enum mmpi_datatype type, int rank, int rem) {
+	size_t size = count * mmpi_type_size(type), rsize;
+
+	if(rank < 2 * rem) {
+		if(rank % 2 == 0) {
+			mmpi_recv(rank + 1, acc, &rsize);
+			assert(rsize == size);
+		} else {
+			mmpi_send(rank - 1, acc, size);
+		}
+	}
+}
+
+/*
+ * recursive doubling: exchange everything with a partner at distance
+ * 1, 2, 4... and combine; log2(nprocs) steps, good for small data
+ *
+ * acc is being sent while we combine, so combine into tmp
+ */
+static void coll_allreduce_doubling(void *acc, int count,
+				    enum mmpi_datatype type,
+				    enum mmpi_op op, int vrank, int pof2,
+				    int rem) {
+	size_t size = count * mmpi_type_size(type), rsize;
+	struct mmpi_request *req;
+	struct mmpi_zc *zc;
+	const void *view;
+	void *tmp;
+	int mask, peer;
+
+	tmp = malloc(size);
+	assert(tmp != NULL || size == 0);
+
+	for(mask = 1; mask < pof2; mask <<= 1) {
+		peer = coll_rank_of(vrank ^ mask, rem);
+		req = mmpi_isend(peer, acc, size);
+		view = mmpi_recv_zc(peer, &rsize, &zc);
+		assert(rsize == size);
+		mmpi_op(tmp, acc, view, count, type, op);
+		mmpi_release_zc(zc);
+		mmpi_wait(req);
+		memcpy(acc, tmp, size);
+	}
+
+	free(tmp);
+}
+
+/*
+ * recursive halving: exchange half of the current range with a partner
+ * at distance pof2/2, pof2/4... and combine the half we keep, so that
+ * each rank ends up with 1/pof2 of the result; lo[] and hi[] record
+ * the range kept at each step, for coll_allgather_doubling
+ *
+ * the half we send and the half we combine into are distinct, so no
+ * temporary buffer is needed
+ */
+static void coll_reduce_scatter_halving(char *acc, int count,
+					enum mmpi_datatype type,
+					enum mmpi_op op, int vrank, int pof2,
+					int rem, int *lo, int *hi) {
+	size_t esize = mmpi_type_size(type);
+	struct mmpi_request *req;
+	int mask, peer, step, mid, l, h;
+
+	l = 0;
+	h = count;
+	for(mask = pof2 >> 1, step = 0; mask > 0; mask >>= 1, step++) {
+		peer = coll_rank_of(vrank ^ mask, rem);
+		mid = l + (h - l) / 2;
+		if(vrank & mask) {
+			/* keep the upper half */
+			req = mmpi_isend(peer, acc + l * esize,
+					 (mid - l) * esize);
+			l = mid;
+		} else {
+			req = mmpi_isend(peer, acc + mid * esize,
+					 (h - mid) * esize);
+			h = mid;
+		}
+		coll_recv_op(peer, acc + l * esize, h - l, type, op);
+		mmpi_wait(req);
+		lo[step] = l;
+		hi[step] = h;
+	}
+}
+
+/*
+ * reverse of the above: exchange the ranges we have with the same
+ * partners, in reverse order, until everybody has everything
+ */
+static void coll_allgather_doubling(char *acc, enum mmpi_datatype type,
+				    int vrank, int pof2, int rem,
+				    int count, int *lo, int *hi) {
+	size_t esize = mmpi_type_size(type), rsize;
+	struct mmpi_request *reqs[2];
+	int mask, peer, step, l, h, pl;
+
+	for(step = 0; (1 << step) < pof2; step++)
+		;
+	for(mask = 1, step--; mask < pof2; mask <<= 1, step--) {
+		peer = coll_rank_of(vrank ^ mask, rem);
+		l = lo[step];
+		h = hi[step];
+		/* the partner has the other half of the range
+		 * we had before this step */
+		pl = (step > 0) ? lo[step - 1] : 0;
+		if(pl == l)
+			pl = h;
+		reqs[0] = mmpi_irecv(peer, acc + pl * esize, &rsize);
+		reqs[1] = mmpi_isend(peer, acc + l * esize, (h - l) * esize);
+		mmpi_waitall(2, reqs);
+		assert(rsize == ((step > 0 ? hi[step - 1] - lo[step - 1] : count)
+				 - (h - l)) * esize);
+	}
+}
+
+/*****************/
+
+/*
+ * public collectives
+ *
+ * all ranks must call them in the same order with matching arguments;
+ * they use regular messages, so they are ordered with respect to
+ * point-to-point messages between the same ranks
+ */
+
+void mmpi_allreduce(void *sendbuf, void *recvbuf, int count,
+		    enum mmpi_datatype type, enum mmpi_op op) {
+	size_t size = count * mmpi_type_size(type);
+	int lo[COLL_MAX_STEPS], hi[COLL_MAX_STEPS];
+	int nprocs = mmpi_get_nprocs(), rank = mmpi_get_rank();
+	int pof2, rem, vrank;
+
+	if(sendbuf != recvbuf)
+		memcpy(recvbuf, sendbuf, size);
+
+	pof2 = coll_pof2(nprocs);
+	rem = nprocs - pof2;
+	vrank = coll_fold(recvbuf, count, type, op, rank, rem);
+
+	if(vrank >= 0) {
+		if(size < MMPI_COLL_LARGE_SIZE || count < pof2) {
+			coll_allreduce_doubling(recvbuf, count, type, op,
+						vrank, pof2, rem);
+		} else {
+			coll_reduce_scatter_halving(recvbuf, count, type, op,
+						    vrank, pof2, rem, lo, hi);
+			coll_allgather_doubling(recvbuf, type, vrank, pof2,
+						rem, count, lo, hi);
+		}
+	}
+
+	coll_unfold(recvbuf, count, type, rank, rem);
+}
+
+/*
+ * binomial tree reduction towards root, each rank combines the data
+ * of its children in place; recvbuf is only used in root, and leaves
+ * (odd vranks, and the last one) just send sendbuf
+ */
+void mmpi_reduce(void *sendbuf, void *recvbuf, int count,
+		 enum mmpi_datatype type, enum mmpi_op op, int root) {
+	size_t size = count * mmpi_type_size(type);
+	int nprocs = mmpi_get_nprocs(), rank = mmpi_get_rank();
+	int vrank, mask;
+	void *acc;
+
+	vrank = (rank - root + nprocs) % nprocs;
+	if(rank == root) {
+		acc = recvbuf;
+	} else if(vrank % 2 == 0 && vrank + 1 < nprocs) {
+		acc = malloc(size);
+		assert(acc != NULL || size == 0);
+	} else {
+		acc = sendbuf;
+	}
+	if(sendbuf != acc)
+		memcpy(acc, sendbuf, size);
+
+	for(mask = 1; mask < nprocs; mask <<= 1) {
+		if(vrank & mask) {
+			mmpi_send((vrank - mask + root) % nprocs,
+				  acc, size);
+			break;
+		}
+		if(vrank + mask < nprocs)
+			coll_recv_op((vrank + mask + root) % nprocs,
+				     acc, count, type, op);
+	}
+
+	if(acc != recvbuf && acc != sendbuf)
+		free(acc);
+}
+
+/*
+ * small data goes down a binomial tree; large data is remapped anyway,
+ * so every rank reads it directly from root's buffer, in parallel
+ */
+void mmpi_bcast(void *buf, size_t size, int root) {
+	struct mmpi_request **reqs;
+	int nprocs = mmpi_get_nprocs(), rank = mmpi_get_rank();
+	size_t rsize;
+	int vrank, mask, i, n;
+
+	if(size >= mmpi_driller_threshold()) {
+		if(rank != root) {
+			mmpi_recv(root, buf, &rsize);
+			assert(rsize == size);
+			return;
+		}
+		reqs = malloc(nprocs * sizeof(*reqs));
+		assert(reqs != NULL);
+		for(i = 0, n = 0; i < nprocs; i++)
+			if(i != root)
+				reqs[n++] = mmpi_isend(i, buf, size);
+		mmpi_waitall(n, reqs);
+		free(reqs);
+		return;
+	}
+
+	vrank = (rank - root + nprocs) % nprocs;
+	for(mask = 1; mask < nprocs; mask <<= 1)
+		if(vrank & mask) {
+			mmpi_recv((vrank - mask + root) % nprocs,
+				  buf, &rsize);
+			assert(rsize == size);
+			break;
+		}
+	for(mask >>= 1; mask > 0; mask >>= 1)
+		if(vrank + mask < nprocs)
+			mmpi_send((vrank + mask + root) % nprocs,
+				  buf, size);
+}
+
+/*
+ * root receives size bytes from each rank i at recvbuf + i*size
+ */
+void mmpi_gather(void *sendbuf, size_t size, void *recvbuf, int root) {
+	struct mmpi_request **reqs;
+	int nprocs = mmpi_get_nprocs(), rank = mmpi_get_rank();
+	size_t *rsize;
+	int i, n;
+
+	if(rank != root) {
+		mmpi_send(root, sendbuf, size);
+		return;
+	}
+
+	reqs = malloc(nprocs * sizeof(*reqs));
+	rsize = malloc(nprocs * sizeof(*rsize));
+	assert(reqs != NULL && rsize != NULL);
+	for(i = 0, n = 0; i < nprocs; i++)
+		if(i != root)
+			reqs[n++] = mmpi_irecv(i, (char *)recvbuf + i * size,
+					       &rsize[i]);
+	memcpy((char *)recvbuf + root * size, sendbuf, size);
+	mmpi_waitall(n, reqs);
+	for(i = 0; i < nprocs; i++)
+		assert(i == root || rsize[i] == size);
+	free(rsize);
+	free(reqs);
+}
+
+/*
+ * root sends size bytes at sendbuf + i*size to each rank i
+ */
+void mmpi_scatter(void *sendbuf, size_t size, void *recvbuf, int root) {
+	struct mmpi_request **reqs;
+	int nprocs = mmpi_get_nprocs(), rank = mmpi_get_rank();
+	size_t rsize;
+	int i, n;
+
+	if(rank != root) {
+		mmpi_recv(root, recvbuf, &rsize);
+		assert(rsize == size);
+		return;
+	}
+
+	reqs = malloc(nprocs * sizeof(*reqs));
+	assert(reqs != NULL);
+	for(i = 0, n = 0; i < nprocs; i++)
+		if(i != root)
+			reqs[n++] = mmpi_isend(i, (char *)sendbuf + i * size,
+					       size);
+	memcpy(recvbuf, (char *)sendbuf + root * size, size);
+	mmpi_waitall(n, reqs);
+	free(reqs);
+}
+
+/*
+ * each rank i sends size bytes at sendbuf + j*size to each rank j,
+ * which receives them at recvbuf + i*size; peers are visited in a
+ * different order by each rank, so they aren't all hit at once
+ */
+void mmpi_alltoall(void *sendbuf, size_t size, void *recvbuf) {
+	struct mmpi_request **reqs;
+	int nprocs = mmpi_get_nprocs(), rank = mmpi_get_rank();
+	size_t *rsize;
+	int i, k, n;
+
+	reqs = malloc(2 * nprocs * sizeof(*reqs));
+	rsize = malloc(nprocs * sizeof(*rsize));
+	assert(reqs != NULL && rsize != NULL);
+
+	n = 0;
+	for(k = 1; k < nprocs; k++) {
+		i = (rank + nprocs - k) % nprocs;
+		reqs[n++] = mmpi_irecv(i, (char *)recvbuf + i * size,
+				       &rsize[i]);
+	}
+	for(k = 1; k < nprocs; k++) {
+		i = (rank + k) % nprocs;
+		reqs[n++] = mmpi_isend(i, (char *)sendbuf + i * size, size);
+	}
+	memcpy((char *)recvbuf + rank * size,
+	       (char *)sendbuf + rank * size, size);
+	mmpi_waitall(n, reqs);
+
+	for(i = 0; i < nprocs; i++)
+		assert(i == rank || rsize[i] == size);
+	free(rsize);
+	free(reqs);
+}
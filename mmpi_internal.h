@@ -11,18 +11,6 @@
 #ifndef MMPI_INTERNAL_H
 #define MMPI_INTERNAL_H
 
-/*
- * lists for shared mem
- */
-
-#define LIST_MAGIC 0xf001157
-struct list_head {
-#ifndef NDEBUG
-	int magic;
-#endif
-	intptr_t off_next, off_prev;
-};
-
 /*
  * shared mem and messages
  */
@@ -32,7 +20,6 @@ struct list_head {
 #define __cacheline_aligned __attribute__((__aligned__(CACHELINE_ALIGN)))
 
 enum msg_type {
-	MSG_FREE          = -1,
 	MSG_DATA          = 0,
 	MSG_FRAG          = 1,
 	MSG_DRILLER       = 2,
@@ -47,28 +34,117 @@ struct driller_payload {
 };
 
 struct message {
-	struct list_head m_list;
 	enum msg_type m_type;
 	int m_size;
-	int m_src;
+	unsigned int m_seq;	/* position in the stream from the sender */
 	union {
 		char m_payload[MSG_PAYLOAD_SIZE_BYTES];
 		struct driller_payload m_drill;
 	};
 };
 
-struct message_queue {
-	struct spinlock q_lock __cacheline_aligned;
-	struct list_head q_list;
-	int q_length;
+/*
+ * a small message fits in a single cache line along with its sequence
+ * number, which is 0 while the slot is free: the receiver polls the
+ * line it will read anyway, and the sender finds a free slot with no
+ * shared index at all
+ */
+#define MSG_INLINE_SIZE_BYTES (CACHELINE_ALIGN - 2*sizeof(unsigned int))
+struct msg_inline {
+	volatile unsigned int mi_seq;
+	unsigned int mi_size;
+	char mi_payload[MSG_INLINE_SIZE_BYTES];
+} __cacheline_aligned;
+
+/* producer and consumer indexes live in separate cache lines */
+struct msg_ring {
+	volatile unsigned int r_head __cacheline_aligned;
+	volatile unsigned int r_tail __cacheline_aligned;
+	/* non-zero while a driller message in the slot is being read */
+	volatile unsigned int r_compl[MSG_RING_SIZE] __cacheline_aligned;
+	struct message r_msg[MSG_RING_SIZE] __cacheline_aligned;
+	struct msg_inline r_inline[MSG_INLINE_RING_SIZE];
 };
 
+/*
+ * what a process knows about the streams to and from a peer:
+ * messages in both the ring and the inline slots are numbered,
+ * and received in this order
+ */
+struct msg_peer {
+	unsigned int p_send_seq;	/* last message sent to peer */
+	unsigned int p_send_inline;	/* next inline slot to fill */
+	unsigned int p_recv_seq;	/* last message received from peer */
+	unsigned int p_recv_inline;	/* next inline slot to read */
+};
+
+/*
+ * barrier flags hold the number of the last barrier they were set for,
+ * each in its own cache line so that only its writer and reader touch it
+ */
+struct barrier_flag {
+	volatile unsigned int bf_epoch;
+} __cacheline_aligned;
+
 struct shmem {
-	volatile int barrier_box __cacheline_aligned;
-	volatile int driller_send_running;
-	struct message_queue free_q;
-	struct message_queue recv_q;
-	struct message msg_pool[MSG_POOL_SIZE];
+	/* signalled by peers when they change something we may wait for */
+	struct futex doorbell __cacheline_aligned;
+	/* dissemination barrier: set by our partner in each round */
+	struct barrier_flag barrier_round[MMPI_BARRIER_MAX_ROUNDS];
+	/* tree barrier: set by us when our subtree has arrived,
+	 * then when we may leave */
+	struct barrier_flag barrier_arrive;
+	struct barrier_flag barrier_release;
+	/* in rank 0: the eager/zero-copy crossover for the job */
+	volatile size_t driller_threshold __cacheline_aligned;
+};
+
+/*
+ * requests, private to each process
+ */
+
+enum req_state {
+	REQ_QUEUED,	/* waiting for ring slots or messages */
+	REQ_POSTED,	/* driller send posted, data not read yet */
+	REQ_DONE,
+};
+
+struct mmpi_request {
+	int rq_send;		/* 1 for a send, 0 for a receive */
+	int rq_rank;		/* peer */
+	enum req_state rq_state;
+	char *rq_buf;
+	size_t rq_size;		/* send: bytes to send */
+	size_t rq_done;		/* bytes sent or received so far */
+	size_t *rq_rsize;	/* receive: where to store the size */
+	int rq_driller;		/* send: rq_drill is valid */
+	struct driller_payload rq_drill;
+	struct driller_send *rq_ds; /* send: while REQ_POSTED */
+	struct mmpi_zc *rq_zc;	/* receive: zero-copy view to fill */
+	struct mmpi_request *rq_next;
+};
+
+/*
+ * zero-copy receive: a read-only view of the data of a message,
+ * valid until released
+ */
+struct mmpi_zc {
+	int zc_rank;		/* sender */
+	char *zc_addr;
+	size_t zc_size;
+	/* driller message: the mapping zc_addr points into,
+	 * and the completion word to clear when we're done with it */
+	struct map_cache *zc_mc;
+	int zc_private;		/* zc_mc is ours, not in the map cache */
+	volatile unsigned int *zc_compl;
+	/* other messages: a copy of the data, in zc_addr */
+	int zc_copy;
+};
+
+/* FIFO of requests for a given peer */
+struct req_queue {
+	struct mmpi_request *q_head;
+	struct mmpi_request *q_tail;
 };
 
 /*
@@ -80,4 +156,12 @@ struct driller_udata {
 	char references[];
 };
 
+/* a zero-copy send, one per (dest rank, ring slot) pair */
+struct driller_send {
+	volatile unsigned int *ds_compl; /* NULL if no send in flight */
+	void *ds_start;
+	void *ds_end;
+	struct mmpi_request *ds_req; /* NULL if nobody waits for it */
+};
+
 #endif /* MMPI_INTERNAL_H */
@@ -51,3 +51,51 @@ void map_parse(void) {
 	}
 	close(fd);
 }
+
+/*
+ * return the protection of the private maps that cover [start-end],
+ * or -1 if part of it is not mapped privately, or if the protection
+ * changes along the way
+ */
+int map_prot(void *start, void *end) {
+	char path[PATH_MAX];
+	void *addr = start;
+	int fd, prot = -1;
+
+	snprintf(path, sizeof(path),
+		 "/proc/%d/map", (int)getpid());
+
+	fd = open(path, O_RDONLY);
+	if(fd < 0)
+		perr("open");
+	while(addr < end) {
+		prmap_t map;
+		int p;
+
+		if(read(fd, &map, sizeof(map)) < sizeof(map))
+			break;
+		if((void*)map.pr_vaddr + map.pr_size <= addr)
+			continue;
+		p =	  (map.pr_mflags & MA_READ  ? PROT_READ : 0)
+			| (map.pr_mflags & MA_WRITE ? PROT_WRITE : 0)
+			| (map.pr_mflags & MA_EXEC  ? PROT_EXEC : 0);
+		if((map.pr_mflags & MA_SHARED) || (void*)map.pr_vaddr > addr
+		   || (prot >= 0 && p != prot))
+			break;
+		prot = p;
+		addr = (void*)map.pr_vaddr + map.pr_size;
+	}
+	close(fd);
+	return addr < end ? -1 : prot;
+}
+
+/*
+ * tell which of the npages pages at start may hold data: not known
+ * here, mincore does not report swapped out pages
+ */
+int map_pages_used(void *start, size_t npages, unsigned char *used) {
+	return -1;
+}
+
+void map_pages_done(void) {
+}
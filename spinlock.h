@@ -29,7 +29,14 @@ struct spinlock {
 	volatile unsigned int lck;
 };
 
-static void spin_lock_init(struct spinlock *lock) {
+/* static initializer, same as spin_lock_init */
+#ifndef NDEBUG
+#define SPINLOCK_INIT { .magic = LOCK_MAGIC, .lck = 1 }
+#else
+#define SPINLOCK_INIT { .lck = 1 }
+#endif
+
+static inline void spin_lock_init(struct spinlock *lock) {
 #ifndef NDEBUG
 	lock->magic = LOCK_MAGIC;
 #endif
@@ -69,6 +76,22 @@ static inline void nop(void) {
 #endif
 }
 
+/*
+ * memory barrier for lock-free structures in shared memory
+ * we never need store->load ordering, so on TSO processors this only
+ * has to keep the compiler from reordering accesses
+ */
+static inline void mb(void) {
+#if __x86_64__ || __i386__
+	asm volatile("" : : : "memory");
+#elif __sparc__
+	asm volatile("membar #LoadLoad | #LoadStore | #StoreStore"
+		     : : : "memory");
+#else
+#error function mb needs porting to your architecture!
+#endif
+}
+
 static inline void spin_lock(struct spinlock *lock) {
 	assert(lock->magic == LOCK_MAGIC);
 	while(!spin_trylock(lock))
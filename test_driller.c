@@ -11,12 +11,32 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
+#include <limits.h>
+#include <errno.h>
 
 #include "driller.h"
 
 #define HEAP_ALLOC_SIZE (1L<<24) /* 16MB */
 #define HEAP_ALLOC_CHUNK 3210
 #define HEAP_ALLOC_CHUNK_COUNT (HEAP_ALLOC_SIZE/HEAP_ALLOC_CHUNK)
+#define LOOKUP_MAP_COUNT 256
+#define LOOKUP_MAP_SIZE (1L<<16) /* 64KB */
+#define LOOKUP_ITER 10000000
+#define THREAD_COUNT 8
+#define THREAD_ITER 1000
+#define RACE_MAPS 16
+#define RACE_ITER 10000
+#define DETACH_WAIT 1000 /* ms */
+#define SPLIT_MAP_PAGES 8
+#define SELECTIVE_THRESHOLD (1L<<20) /* 1MB */
 
 void f(int n) {
 	char buf[1024];
@@ -30,16 +50,459 @@ void f(int n) {
 static void map_invalidate(struct map_rec *map) {
 	printf("map invalidate: %p-%p\n", map->start, map->end);
 }
+
+/*
+ * return a copy of the record of the map of a range, or one with a
+ * NULL start if there is none
+ */
+static struct map_rec lookup(void *start, size_t length) {
+	struct map_rec *map, copy = { .start = NULL };
+
+	map = driller_lookup_map(start, length);
+	if(map != NULL) {
+		copy = *map;
+		driller_put_map(map);
+	}
+	return copy;
+}
+
+/*
+ * time driller_lookup_map, as done for every message sent with mmpi,
+ * over many maps: always the same buffer, then a different map each
+ * time
+ */
+static void lookup_bench(void) {
+	char *maps[LOOKUP_MAP_COUNT];
+	struct timeval tv1, tv2;
+	long delta;
+	int i, j;
+
+	for(i = 0; i < LOOKUP_MAP_COUNT; i++) {
+		maps[i] = mmap(NULL, LOOKUP_MAP_SIZE, PROT_READ|PROT_WRITE,
+			       MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		assert(maps[i] != MAP_FAILED);
+	}
+
+	for(j = 0; j < 2; j++) {
+		gettimeofday(&tv1, NULL);
+		for(i = 0; i < LOOKUP_ITER; i++) {
+			char *buf = maps[j ? (i * 7) % LOOKUP_MAP_COUNT : 0];
+			struct map_rec *map;
+
+			map = driller_lookup_map(buf + 64, 1024);
+			if(map == NULL)
+				abort();
+			driller_put_map(map);
+		}
+		gettimeofday(&tv2, NULL);
+		delta = (tv2.tv_sec - tv1.tv_sec) * 1000000
+			+ tv2.tv_usec - tv1.tv_usec;
+		printf("map lookup (%s): %.1fns\n",
+		       j ? "scattered" : "same buffer",
+		       (float)delta * 1000 / (float)LOOKUP_ITER);
+	}
+
+	for(i = 0; i < LOOKUP_MAP_COUNT; i++)
+		munmap(maps[i], LOOKUP_MAP_SIZE);
+}
+#endif
+
+/*
+ * have several threads map and allocate concurrently,
+ * checking that their stacks are drilled too; each leaves a chunk
+ * for the main thread to free, from another allocation stripe
+ */
+static void *thread_bufs[THREAD_COUNT];
+
+static void *thread_main(void *arg) {
+	int i;
+
+#ifndef NODRILL
+	if(lookup(&i, sizeof(i)).start == NULL)
+		abort();
+#endif
+	for(i = 0; i < THREAD_ITER; i++) {
+		char *m, *p;
+
+		m = mmap(NULL, LOOKUP_MAP_SIZE, PROT_READ|PROT_WRITE,
+			 MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		assert(m != MAP_FAILED);
+		p = malloc(HEAP_ALLOC_CHUNK * (i % 16 + 1));
+		assert(p != NULL);
+		m[0] = p[0] = (char)i;
+#ifndef NODRILL
+		if(lookup(m, LOOKUP_MAP_SIZE).start == NULL)
+			abort();
+#endif
+		free(p);
+		munmap(m, LOOKUP_MAP_SIZE);
+	}
+	thread_bufs[(long)arg] = malloc(HEAP_ALLOC_CHUNK);
+	assert(thread_bufs[(long)arg] != NULL);
+	return arg;
+}
+
+static void thread_test(void) {
+	pthread_t threads[THREAD_COUNT];
+	void *rc;
+	int i;
+
+	for(i = 0; i < THREAD_COUNT; i++)
+		if(pthread_create(&threads[i], NULL, thread_main,
+				  (void *)(long)i) != 0)
+			abort();
+	for(i = 0; i < THREAD_COUNT; i++) {
+		if(pthread_join(threads[i], &rc) != 0)
+			abort();
+		assert(rc == (void *)(long)i);
+		free(thread_bufs[i]);
+	}
+	printf("%d threads ok\n", THREAD_COUNT);
+}
+
+#ifndef NODRILL
+/*
+ * have threads look up maps that the main thread keeps replacing:
+ * the records they get must not change until they put them back
+ */
+static char * volatile race_maps[RACE_MAPS];
+static volatile int race_done;
+
+static void *race_main(void *arg) {
+	struct map_rec *map, copy;
+	unsigned int seed = (long)arg;
+	long n = 0;
+
+	while(!race_done) {
+		map = driller_lookup_map(race_maps[rand_r(&seed) % RACE_MAPS],
+					 1);
+		if(map == NULL)
+			continue;
+		copy = *map;
+		sched_yield();
+		if(memcmp(&copy, map, sizeof(copy)) != 0)
+			abort();
+		driller_put_map(map);
+		n++;
+	}
+	return (void *)n;
+}
+
+static char *race_map(void) {
+	char *m;
+
+	m = mmap(NULL, LOOKUP_MAP_SIZE, PROT_READ|PROT_WRITE,
+		 MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	assert(m != MAP_FAILED);
+	return m;
+}
+
+static void race_test(void) {
+	pthread_t threads[THREAD_COUNT];
+	long found = 0;
+	void *rc;
+	char *m;
+	int i;
+
+	/* quiet, there are many */
+	driller_register_map_invalidate_cb(NULL);
+	for(i = 0; i < RACE_MAPS; i++)
+		race_maps[i] = race_map();
+	for(i = 0; i < THREAD_COUNT; i++)
+		if(pthread_create(&threads[i], NULL, race_main,
+				  (void *)(long)i) != 0)
+			abort();
+
+	/* the new map first, or it could take the place of the old one,
+	 * and get its record back just as it was */
+	for(i = 0; i < RACE_ITER; i++) {
+		m = race_maps[i % RACE_MAPS];
+		race_maps[i % RACE_MAPS] = race_map();
+		if(munmap(m, LOOKUP_MAP_SIZE) != 0)
+			abort();
+		sched_yield();
+	}
+
+	race_done = 1;
+	for(i = 0; i < THREAD_COUNT; i++) {
+		if(pthread_join(threads[i], &rc) != 0)
+			abort();
+		found += (long)rc;
+	}
+	for(i = 0; i < RACE_MAPS; i++)
+		munmap(race_maps[i], LOOKUP_MAP_SIZE);
+	driller_register_map_invalidate_cb(map_invalidate);
+	printf("%ld lookups raced with %d unmaps\n", found, RACE_ITER);
+}
+#endif
+
+static void *detached_main(void *arg) {
+	*(void * volatile *)arg = &arg;
+	return NULL;
+}
+
+static void *noop_main(void *arg) {
+	return arg;
+}
+
+/*
+ * detach a thread, at its creation or after it: its stack is drilled,
+ * and once the thread is gone, the next thread creation unmaps it
+ */
+static void detach_test(int at_creation) {
+	void * volatile stack = NULL;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int i;
+
+	if(pthread_attr_init(&attr) != 0
+	   || pthread_attr_setdetachstate(&attr, at_creation
+					  ? PTHREAD_CREATE_DETACHED
+					  : PTHREAD_CREATE_JOINABLE) != 0
+	   || pthread_create(&thread, &attr, detached_main,
+			     (void *)&stack) != 0)
+		abort();
+	pthread_attr_destroy(&attr);
+	if(!at_creation && pthread_detach(thread) != 0)
+		abort();
+	while(stack == NULL)
+		usleep(1000);
+#ifndef NODRILL
+	/* no thread was created since, that could have reaped it */
+	if(lookup(stack, 1).start == NULL)
+		abort();
+#endif
+
+	for(i = 0; i < DETACH_WAIT; i++) {
+		if(pthread_create(&thread, NULL, noop_main, NULL) != 0
+		   || pthread_join(thread, NULL) != 0)
+			abort();
+#ifndef NODRILL
+		if(lookup(stack, 1).start == NULL)
+			break;
+#else
+		break;
+#endif
+		usleep(1000);
+	}
+	if(i == DETACH_WAIT)
+		abort();
+	printf("stack of thread detached %s released\n",
+	       at_creation ? "at creation" : "later");
+}
+
+/*
+ * punch holes in the middle of a map, with munmap and with a fixed
+ * mmap, then check the pieces left
+ */
+static void split_test(void) {
+	long page = sysconf(_SC_PAGESIZE);
+	char *m, *p;
+	int i;
+
+	m = mmap(NULL, SPLIT_MAP_PAGES * page, PROT_READ|PROT_WRITE,
+		 MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	assert(m != MAP_FAILED);
+	for(i = 0; i < SPLIT_MAP_PAGES; i++)
+		m[i * page] = i + 1;
+
+	if(munmap(m + page, page) != 0)
+		abort();
+	p = mmap(m + 3 * page, page, PROT_READ|PROT_WRITE,
+		 MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0);
+	assert(p == m + 3 * page);
+	if(munmap(m + 5 * page, page) != 0)
+		abort();
+
+	for(i = 0; i < SPLIT_MAP_PAGES; i++)
+		if(i != 1 && i != 5)
+			assert(m[i * page] == (i == 3 ? 0 : i + 1));
+#ifndef NODRILL
+	assert(lookup(m + page, page).start == NULL);
+	assert(lookup(m, page).end == m + page);
+	assert(lookup(m + 2 * page, page).start == m + 2 * page);
+	assert(lookup(m + 2 * page, page).end == m + 3 * page);
+	assert(lookup(m + 3 * page, page).end == m + 4 * page);
+	assert(lookup(m + 4 * page, page).end == m + 5 * page);
+	assert(lookup(m + 6 * page, page).start == m + 6 * page);
+#endif
+
+	if(munmap(m, SPLIT_MAP_PAGES * page) != 0)
+		abort();
+#ifndef NODRILL
+	assert(lookup(m, SPLIT_MAP_PAGES * page).start == NULL);
+#endif
+	printf("map split ok\n");
+}
+
+#ifndef NODRILL
+/*
+ * time driller_init with count more maps than usual, i.e. as many
+ * more lines in /proc/self/maps: alternate protections keep pages
+ * from being merged, and only readable ones get rebuilt
+ */
+static void init_bench(int count) {
+	long page = sysconf(_SC_PAGESIZE);
+	struct timeval tv1, tv2;
+	struct rlimit rl;
+	size_t copied, skipped;
+	char *m;
+	int i;
+
+	/* each rebuilt map needs a file */
+	if(getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	m = mmap(NULL, count * page, PROT_NONE,
+		 MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	assert(m != MAP_FAILED);
+	for(i = 0; i < count; i += 2)
+		if(mprotect(m + i * page, page, PROT_READ|PROT_WRITE) != 0)
+			abort();
+
+	gettimeofday(&tv1, NULL);
+	driller_init();
+	gettimeofday(&tv2, NULL);
+	printf("init with %d more maps: %.2fms\n", count,
+	       (float)((tv2.tv_sec - tv1.tv_sec) * 1000000
+		       + tv2.tv_usec - tv1.tv_usec) / 1000);
+
+#ifdef linux
+	/* the pages of these maps were never touched */
+	driller_rebuild_stats(&copied, &skipped);
+	assert(skipped >= (count + 1) / 2 * page);
+#endif
+}
+
+/*
+ * share only regions given by hand, and big anonymous maps
+ */
+static void selective_test(void) {
+	long page = sysconf(_SC_PAGESIZE);
+	char *region, *ro, *big, *small, *p;
+	int i;
+
+	region = mmap(NULL, 4 * page, PROT_READ|PROT_WRITE,
+		      MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	assert(region != MAP_FAILED);
+	for(i = 0; i < 4; i += 2)
+		region[i * page] = i + 1;
+
+	/* two read-only pages, then one that can't be read */
+	ro = mmap(NULL, 3 * page, PROT_READ|PROT_WRITE,
+		  MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	assert(ro != MAP_FAILED);
+	ro[0] = 1;
+	ro[page] = 2;
+	if(mprotect(ro, 2 * page, PROT_READ) != 0
+	   || mprotect(ro + 2 * page, page, PROT_NONE) != 0)
+		abort();
+
+	driller_init_selective(SELECTIVE_THRESHOLD);
+	assert(lookup(&i, sizeof(i)).start == NULL);
+	assert(lookup(region, 4 * page).start == NULL);
+
+	if(driller_register_region(region + 1, 4 * page - 1) != 0)
+		abort();
+	assert(lookup(region, 4 * page).start == region);
+	assert(lookup(region, 4 * page).end == region + 4 * page);
+	for(i = 0; i < 4; i++)
+		assert(region[i * page] == (i % 2 ? 0 : i + 1));
+	if(driller_register_region(region + page, page) != 0)
+		abort();
+	assert(driller_register_region(region + page, 4 * page) != 0);
+
+	/* the protection must be the same all along, and readable;
+	 * it is kept */
+	assert(driller_register_region(ro + 2 * page, page) != 0
+	       && errno == EACCES);
+	assert(driller_register_region(ro, 3 * page) != 0
+	       && errno == EACCES);
+	if(driller_register_region(ro, 2 * page) != 0)
+		abort();
+	assert(lookup(ro, 2 * page).end == ro + 2 * page);
+	assert(lookup(ro, 2 * page).prot == PROT_READ);
+	assert(ro[0] == 1 && ro[page] == 2);
+
+	big = mmap(NULL, SELECTIVE_THRESHOLD, PROT_READ|PROT_WRITE,
+		   MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	small = mmap(NULL, SELECTIVE_THRESHOLD / 2, PROT_READ|PROT_WRITE,
+		     MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	assert(big != MAP_FAILED && small != MAP_FAILED);
+	assert(lookup(big, SELECTIVE_THRESHOLD).start != NULL);
+	assert(lookup(small, SELECTIVE_THRESHOLD / 2).start == NULL);
+	p = malloc(HEAP_ALLOC_CHUNK);
+	assert(lookup(p, HEAP_ALLOC_CHUNK).start == NULL);
+	free(p);
+
+	munmap(small, SELECTIVE_THRESHOLD / 2);
+	munmap(big, SELECTIVE_THRESHOLD);
+	munmap(region, 4 * page);
+	assert(lookup(region, 4 * page).start == NULL);
+	munmap(ro, 3 * page);
+	assert(lookup(ro, 2 * page).start == NULL);
+	printf("selective mode ok\n");
+}
+#endif
+
+#if defined(linux) && !defined(NODRILL)
+/*
+ * tell if one of our fds is open on /proc/<pid>/name
+ */
+static int proc_file_open(const char *name) {
+	char link[PATH_MAX], path[64], target[PATH_MAX];
+	struct dirent *d;
+	ssize_t n;
+	DIR *dir;
+	int found = 0;
+
+	snprintf(path, sizeof(path), "/proc/%d/%s", (int)getpid(), name);
+	dir = opendir("/proc/self/fd");
+	assert(dir != NULL);
+	while((d = readdir(dir)) != NULL) {
+		snprintf(link, sizeof(link), "/proc/self/fd/%s", d->d_name);
+		n = readlink(link, target, sizeof(target) - 1);
+		if(n < 0)
+			continue;
+		target[n] = '\0';
+		if(strcmp(target, path) == 0)
+			found = 1;
+	}
+	closedir(dir);
+	return found;
+}
 #endif
 
 int main(int argc, char**argv) {
 	int i;
 	void **a;
 	void *b;
+#ifndef NODRILL
+	size_t copied, skipped;
+#endif
 
 #ifndef NODRILL
+	if(argc > 1 && strcmp(argv[1], "-s") == 0) {
+		selective_test();
+		return 0;
+	}
+	if(argc > 1) {
+		init_bench(atoi(argv[1]));
+		return 0;
+	}
+
 	driller_init();
 	driller_register_map_invalidate_cb(map_invalidate);
+
+	driller_rebuild_stats(&copied, &skipped);
+	printf("rebuild copied %zd kB, skipped %zd kB\n",
+	       copied >> 10, skipped >> 10);
+	assert(copied > 0);
+#ifdef linux
+	assert(!proc_file_open("pagemap"));
+#endif
 #endif
 
 	/* test heap */
@@ -56,6 +519,18 @@ int main(int argc, char**argv) {
 	b = realloc(b, HEAP_ALLOC_SIZE / 2);
 	free(b);
 
+#ifndef NODRILL
+	lookup_bench();
+#endif
+
+	split_test();
+	thread_test();
+#ifndef NODRILL
+	race_test();
+#endif
+	detach_test(0);
+	detach_test(1);
+
 	/* vfork/exec should work */
 	system("env echo system: foobar");
 
@@ -2,4 +2,11 @@
 set -x
 
 ./test_driller
+DRILLER_MAP_POOL=0 ./test_driller
+DRILLER_STACK_RESERVE=0 ./test_driller
+DRILLER_HEAP_WINDOW=0 ./test_driller
+./test_driller -s
+for n in 10 100 1000 4000; do
+	./test_driller $n
+done
 
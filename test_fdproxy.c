@@ -11,21 +11,192 @@
 #include <stdio.h>
 #include <assert.h>
 #include <unistd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <dirent.h>
 
 #include "mmpi.h"
 #include "log.h"
 #include "fdproxy.h"
 
+#define BATCH_SIZE 100 /* more than fit in one request */
+/* invalidations pushed one by one to a client that does not read them,
+ * more than the daemon socket buffer holds (net.core.wmem_default) */
+#define OVERFLOW_KEYS 512
+#define OVERFLOW_WAIT 1000 /* ms */
+
 static void usage(char *progname) {
-	err("usage: %s <job id> <job size> <rank> <iter>", progname);
+	err("usage: %s <job id> <job size> <rank> <iter>\n"
+	    "       %s -r <clients> <iter>\n"
+	    "       %s -o", progname, progname, progname);
+}
+
+/*
+ * fork many clients that all fetch a well-known key from the daemon
+ * as fast as they can, and report the aggregate request rate
+ */
+static void rate_test(int nclients, int iter) {
+	int i, j, fd, status, ready[2], start[2];
+	struct fdkey key;
+	struct timeval tv1, tv2;
+	long delta;
+	char c;
+
+	fdproxy_init(getpid(), 1);
+	fdproxy_set_key_id(&key, 0x321);
+	fdproxy_client_send_fd(1, &key);
+
+	if(pipe(ready) || pipe(start))
+		perr("pipe");
+	for(i = 0; i < nclients; i++) {
+		switch(fork()) {
+		case -1:
+			perr("fork");
+		case 0:
+			close(start[1]);
+			fdproxy_init(getppid(), 0);
+			/* tell parent we are connected, wait for the others */
+			if(write(ready[1], &c, 1) != 1)
+				perr("write");
+			if(read(start[0], &c, 1) != 0)
+				err("start pipe not closed");
+			for(j = 0; j < iter; j++) {
+				fd = fdproxy_client_get_fd(&key);
+				if(fd < 0)
+					err("client %d cannot get fd", i);
+				close(fd);
+				/* time the daemon, not our cache */
+				fdproxy_client_forget_fd(&key);
+			}
+			exit(0);
+		}
+	}
+	for(i = 0; i < nclients; i++)
+		if(read(ready[0], &c, 1) != 1)
+			perr("read");
+
+	gettimeofday(&tv1, NULL);
+	close(start[1]);
+	for(i = 0; i < nclients; i++) {
+		if(wait(&status) < 0)
+			perr("wait");
+		if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			err("a client failed");
+	}
+	gettimeofday(&tv2, NULL);
+	delta = (tv2.tv_sec - tv1.tv_sec) * 1000000
+		+ tv2.tv_usec - tv1.tv_usec;
+	printf("%d clients: %.0f fd requests/s\n", nclients,
+	       (float)nclients * iter * 1E6 / (float)delta);
+}
+
+/*
+ * number of fds open in this process
+ */
+static int count_fds(void) {
+	struct dirent *d;
+	DIR *dir;
+	int n = 0;
+
+	dir = opendir("/proc/self/fd");
+	if(dir == NULL)
+		perr("opendir");
+	while((d = readdir(dir)) != NULL)
+		if(d->d_name[0] != '.')
+			n++;
+	closedir(dir);
+	return n;
+}
+
+/*
+ * have the daemon push more invalidations to a client than its socket
+ * holds: the daemon must then drop them and tell the client to flush
+ * its whole fd cache, including keys[0] that is never invalidated
+ */
+static void overflow_test(void) {
+	struct fdkey keys[OVERFLOW_KEYS + 1];
+	int fds[OVERFLOW_KEYS + 1];
+	int i, nfds, status, ready[2], done[2];
+	char c;
+
+	fdproxy_init(getpid(), 1);
+	for(i = 0; i <= OVERFLOW_KEYS; i++) {
+		fdproxy_set_key_id(&keys[i], 0x1000 + i);
+		fds[i] = 1;
+	}
+	fdproxy_client_send_fds(OVERFLOW_KEYS + 1, fds, keys);
+	fdproxy_client_sync();
+
+	if(pipe(ready) || pipe(done))
+		perr("pipe");
+	switch(fork()) {
+	case -1:
+		perr("fork");
+	case 0:
+		fdproxy_init(getppid(), 0);
+		nfds = count_fds();
+		/* subscribe to all keys, caching keys[0] first */
+		if(fdproxy_client_get_fds(OVERFLOW_KEYS + 1, keys, fds)
+		   != OVERFLOW_KEYS + 1)
+			err("cannot get fds");
+		for(i = 0; i <= OVERFLOW_KEYS; i++)
+			close(fds[i]);
+		if(count_fds() == nfds)
+			err("fds not cached");
+
+		/* let the invalidations pile up */
+		if(write(ready[1], &c, 1) != 1)
+			perr("write");
+		if(read(done[0], &c, 1) != 1)
+			perr("read");
+
+		/* reading them lets the daemon send the flush */
+		for(i = 0; i < OVERFLOW_WAIT; i++) {
+			fdproxy_client_sync();
+			if(count_fds() == nfds)
+				break;
+			usleep(1000);
+		}
+		if(i == OVERFLOW_WAIT)
+			err("fd cache not flushed, %d fds left",
+			    count_fds() - nfds);
+		printf("fd cache flushed after %d invalidations\n",
+		       OVERFLOW_KEYS);
+		exit(0);
+	}
+
+	if(read(ready[0], &c, 1) != 1)
+		perr("read");
+	for(i = 1; i <= OVERFLOW_KEYS; i++)
+		fdproxy_client_invalidate_fd(&keys[i]);
+	fdproxy_client_sync();
+	if(write(done[1], &c, 1) != 1)
+		perr("write");
+
+	if(wait(&status) < 0)
+		perr("wait");
+	if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		err("overflow test failed");
 }
 
 int main(int argc, char**argv) {
 	int jobid, nprocs, rank, iter, i, j;
 	struct fdkey key1, key2;
 	size_t sz;
+	struct timeval tv1, tv2;
+	long delta, total;
 
 	/* parse args */
+	if(argc == 4 && strcmp(argv[1], "-r") == 0) {
+		rate_test(atoi(argv[2]), atoi(argv[3]));
+		printf("SUCCESS!\n");
+		return 0;
+	}
+	if(argc == 2 && strcmp(argv[1], "-o") == 0) {
+		overflow_test();
+		printf("SUCCESS!\n");
+		return 0;
+	}
 	if(argc != 5)
 		usage(argv[0]);
 	jobid = atoi(argv[1]);
@@ -91,7 +262,8 @@ int main(int argc, char**argv) {
 
 	mmpi_barrier();
 
-	/* repeatedly fetch rank 0 fd 1 */
+	/* repeatedly fetch rank 0 fd 1, and time it */
+	gettimeofday(&tv1, NULL);
 	for(i = 0; i < iter/nprocs ; i++) {
 		int fd;
 
@@ -99,17 +271,78 @@ int main(int argc, char**argv) {
 		assert(fd != -1);
 		assert(close(fd) == 0);
 	}
+	gettimeofday(&tv2, NULL);
+	delta = (tv2.tv_sec - tv1.tv_sec) * 1000000
+		+ tv2.tv_usec - tv1.tv_usec;
+	if(iter/nprocs > 0 && rank == 1)
+		printf("rank %d: average repeated get_fd latency: %.2fusec\n",
+		       rank, (float)delta/(float)(iter/nprocs));
 
 	mmpi_barrier();
 
+	/* once the daemon has processed the invalidations,
+	 * no sibling can get the fds from its cache */
 	if(rank == 0) {
 		fdproxy_client_invalidate_fd(&key1);
 		fdproxy_client_invalidate_fd(&key2);
+		fdproxy_client_sync();
+	}
+
+	mmpi_barrier();
+
+	if(rank != 0) {
+		int fd;
+
+		printf("rank %d fetches invalidated stderr\n", rank);
+		fd = fdproxy_client_get_fd(&key2);
+		assert(fd == -1);
+		/* rank 0 still has its stdout open */
+		printf("rank %d fetches invalidated stdout\n", rank);
+		fd = fdproxy_client_get_fd(&key1);
+		assert(fd == -1);
+	}
+
+	mmpi_barrier();
+
+	/* a key stays invalid when its fd num is used by a newer key */
+	{
+		struct fdkey keys[2];
+		int fd;
+
+		if(rank == 0) {
+			memset(keys, 0, sizeof(keys));
+			fd = dup(1);
+			assert(fd >= 0);
+			fdproxy_client_send_fd(fd, &keys[0]);
+			fdproxy_client_invalidate_fd(&keys[0]);
+			assert(close(fd) == 0);
+			assert(dup(1) == fd);
+			fdproxy_client_send_fd(fd, &keys[1]);
+			fdproxy_client_sync();
+			for(j = 1; j < nprocs; j++)
+				mmpi_send(j, keys, sizeof(keys));
+			mmpi_barrier();
+			fdproxy_client_invalidate_fd(&keys[1]);
+			assert(close(fd) == 0);
+		} else {
+			mmpi_recv(0, keys, &sz);
+			assert(sz == sizeof(keys));
+			assert(fdproxy_client_get_fd(&keys[0]) == -1);
+			fd = fdproxy_client_get_fd(&keys[1]);
+			assert(fd != -1);
+			assert(close(fd) == 0);
+			mmpi_barrier();
+		}
+		if(rank == 1)
+			printf("rank %d cannot fetch a reused fd num "
+			       "with its old key\n", rank);
 	}
 
 	mmpi_barrier();
 
-	/* repeatedly send / inval rank 0 fd 1 */
+	/* repeatedly send / inval rank 0 fd 1,
+	 * and time the first touch of each new key */
+	total = 0;
 	for(i = 0; i < iter/nprocs ; i++) {
 		int fd;
 		size_t sz;
@@ -119,7 +352,9 @@ int main(int argc, char**argv) {
 			fd = dup(1);
 			assert(fd >= 0);
 			memset(&key, 0, sizeof(key));
+			gettimeofday(&tv1, NULL);
 			fdproxy_client_send_fd(fd, &key);
+			gettimeofday(&tv2, NULL);
 			for(j = 1; j < nprocs; j++)
 				mmpi_send(j, &key, sizeof(key));
 			mmpi_barrier();
@@ -128,11 +363,60 @@ int main(int argc, char**argv) {
 		} else {
 			mmpi_recv(0, &key, &sz);
 			assert(sz == sizeof(key));
+			gettimeofday(&tv1, NULL);
 			fd = fdproxy_client_get_fd(&key);
+			gettimeofday(&tv2, NULL);
 			assert(fd != -1);
 			assert(close(fd) == 0);
 			mmpi_barrier();
 		}
+		delta = (tv2.tv_sec - tv1.tv_sec) * 1000000
+			+ tv2.tv_usec - tv1.tv_usec;
+		total += delta;
+	}
+	if(iter/nprocs > 0 && rank <= 1)
+		printf("rank %d: average %s latency: %.2fusec\n", rank,
+		       rank == 0 ? "send_fd" : "first-touch get_fd",
+		       (float)total/(float)(iter/nprocs));
+
+	mmpi_barrier();
+
+	/* send / fetch / inval many fds at once, along with a bogus key */
+	{
+		int fds[BATCH_SIZE + 1], rc;
+		struct fdkey keys[BATCH_SIZE + 1];
+
+		if(rank == 0) {
+			for(i = 0; i < BATCH_SIZE; i++)
+				if((fds[i] = dup(1)) < 0)
+					perr("dup");
+			memset(keys, 0, sizeof(keys));
+			fdproxy_client_send_fds(BATCH_SIZE, fds, keys);
+			for(j = 1; j < nprocs; j++)
+				mmpi_send(j, keys, sizeof(keys));
+			mmpi_barrier();
+			fdproxy_client_invalidate_fds(BATCH_SIZE, keys);
+			fdproxy_client_sync();
+			for(i = 0; i < BATCH_SIZE; i++)
+				if(close(fds[i]) != 0)
+					perr("close");
+		} else {
+			mmpi_recv(0, keys, &sz);
+			assert(sz == sizeof(keys));
+			keys[BATCH_SIZE].pid = 0;
+			keys[BATCH_SIZE].fd = -1;
+			rc = fdproxy_client_get_fds(BATCH_SIZE + 1, keys, fds);
+			if(rc != BATCH_SIZE || fds[BATCH_SIZE] != -1)
+				err("fetched %d fds, expected %d", rc,
+				    BATCH_SIZE);
+			for(i = 0; i < BATCH_SIZE; i++)
+				if(close(fds[i]) != 0)
+					perr("close");
+			mmpi_barrier();
+		}
+		if(rank == 1)
+			printf("rank %d fetched %d fds at once\n", rank,
+			       BATCH_SIZE);
 	}
 
 	mmpi_barrier();
@@ -5,8 +5,26 @@ jobid=$$
 nprocs=${1:-2}
 niter=${2:-10000}
 
-for i in $(seq 0 $((nprocs-1)) ); do
-	#strace -fo strace-$i ./test_fdproxy $jobid $nprocs $i $niter &
-	./test_fdproxy $jobid $nprocs $i $niter &
+rc=0
+
+# run with pidfd_getfd if the host allows it, then through the daemon
+# only, and fail if any rank fails
+for pidfd in 1 0; do
+	pids=
+	for i in $(seq 0 $((nprocs-1)) ); do
+		#strace -fo strace-$i ./test_fdproxy $jobid $nprocs $i $niter &
+		FDPROXY_PIDFD=$pidfd ./test_fdproxy $jobid $nprocs $i $niter &
+		pids="$pids $!"
+	done
+	for i in $pids; do
+		wait $i || rc=1
+	done
+	jobid=$((jobid+1))
 done
-wait
+
+# fd request rate with many concurrent clients
+./test_fdproxy -r 128 $niter || rc=1
+
+# invalidations lost when a client socket is full
+./test_fdproxy -o || rc=1
+exit $rc
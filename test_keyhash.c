@@ -0,0 +1,145 @@
+/*
+ * test_keyhash.c
+ *
+ * Copyright 2007 Jean-Marc Saffroy <saffroy@gmail.com>
+ * This file is part of the Driller library.
+ * Driller is free software, distributed under the terms of the
+ * GNU Lesser General Public License version 2.1.
+ *
+ */
+
+#include <stdio.h>
+#include <assert.h>
+#include <sys/time.h>
+
+#include "log.h"
+#include "keyhash.h"
+
+#define NKEYS (1 << 16)
+#define NOPS (1 << 22)
+
+/* reference: whether key i is in the table, and with which data */
+static char present[NKEYS];
+static long value[NKEYS];
+
+static void make_key(int i, struct fdkey *key) {
+	/* a few pids, many fds, like a job of 16 processes */
+	key->pid = 1000 + i % 16;
+	key->fd = i / 16;
+	key->gen = 0;
+}
+
+static void check_all(struct keyhash *kh) {
+	struct fdkey key;
+	void *data;
+	int i, found;
+
+	for(i = 0; i < NKEYS; i++) {
+		make_key(i, &key);
+		found = keyhash_find(kh, &key, &data);
+		assert(found == present[i]);
+		assert(!found || (long)data == value[i]);
+	}
+}
+
+int main(int argc, char **argv) {
+	struct keyhash kh;
+	struct fdkey key;
+	struct timeval tv1, tv2;
+	void *data;
+	long i, delta;
+	int k, rc;
+
+	keyhash_init(&kh, 0);
+
+	/* unknown and invalid keys */
+	key.pid = 0;
+	key.fd = 0;
+	assert(!keyhash_find(&kh, &key, &data));
+	assert(!keyhash_remove(&kh, &key, &data));
+
+	/* fill up, growing many times */
+	for(k = 0; k < NKEYS; k++) {
+		make_key(k, &key);
+		keyhash_insert(&kh, &key, (void*)(long)k);
+		present[k] = 1;
+		value[k] = k;
+	}
+	check_all(&kh);
+
+	/* a new generation of a key is another key */
+	make_key(0, &key);
+	key.gen = 1;
+	assert(!keyhash_find(&kh, &key, &data));
+	keyhash_insert(&kh, &key, (void*)-1L);
+	check_all(&kh);
+	rc = keyhash_remove(&kh, &key, &data);
+	assert(rc && (long)data == -1);
+	check_all(&kh);
+
+	/* remove every other key, replace some data */
+	for(k = 0; k < NKEYS; k += 2) {
+		make_key(k, &key);
+		rc = keyhash_remove(&kh, &key, &data);
+		assert(rc && (long)data == k);
+		present[k] = 0;
+	}
+	for(k = 1; k < NKEYS; k += 4) {
+		make_key(k, &key);
+		keyhash_insert(&kh, &key, (void*)(long)-k);
+		value[k] = -k;
+	}
+	check_all(&kh);
+
+	/* random mix, timed */
+	srandom(42);
+	gettimeofday(&tv1, NULL);
+	for(i = 0; i < NOPS; i++) {
+		k = random() % NKEYS;
+		make_key(k, &key);
+		switch(random() % 3) {
+		case 0:
+			keyhash_insert(&kh, &key, (void*)i);
+			present[k] = 1;
+			value[k] = i;
+			break;
+		case 1:
+			rc = keyhash_remove(&kh, &key, &data);
+			assert(rc == present[k]);
+			assert(!rc || (long)data == value[k]);
+			present[k] = 0;
+			break;
+		default:
+			rc = keyhash_find(&kh, &key, &data);
+			assert(rc == present[k]);
+			assert(!rc || (long)data == value[k]);
+		}
+	}
+	gettimeofday(&tv2, NULL);
+	check_all(&kh);
+	delta = (tv2.tv_sec - tv1.tv_sec) * 1000000
+		+ tv2.tv_usec - tv1.tv_usec;
+	printf("average operation time: %.3fusec\n",
+	       (float)delta/(float)NOPS);
+
+	/* empty it */
+	for(k = 0; k < NKEYS; k++) {
+		make_key(k, &key);
+		rc = keyhash_remove(&kh, &key, &data);
+		assert(rc == present[k]);
+		present[k] = 0;
+	}
+	check_all(&kh);
+
+	/* refill a little, then drop all */
+	for(k = 0; k < 100; k++) {
+		make_key(k, &key);
+		keyhash_insert(&kh, &key, (void*)(long)k);
+	}
+	keyhash_clear(&kh, NULL);
+	assert(keyhash_count(&kh) == 0);
+	check_all(&kh);
+
+	printf("SUCCESS!\n");
+	return 0;
+}
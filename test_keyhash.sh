@@ -0,0 +1,4 @@
+#!/bin/bash
+set -x
+
+./test_keyhash
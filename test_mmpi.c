@@ -14,6 +14,7 @@
 #include <time.h>
 #include <assert.h>
 #include <malloc.h>
+#include <string.h>
 
 #include "mmpi.h"
 #include "log.h"
@@ -21,6 +22,10 @@
 #define THRTEST_MIN_CHUNK_SIZE (1ULL << 8) /* 256 bytes */
 #define THRTEST_MAX_CHUNK_SIZE (1ULL << 23) /* 8 MB */
 #define THRTEST_VOLUME (1ULL << 27) /* 128 MB */
+#define NBTEST_DEPTH 16 /* outstanding requests per peer */
+#define COLLTEST_MAX_COUNT (1 << 18) /* longs, 2 MB */
+#define STREAMTEST_COUNT 64 /* messages per sender */
+#define STREAMTEST_SIZE (1 << 16) /* 64 kB, above the remap threshold */
 
 static void usage(char *progname) {
 	err("usage: %s <job id> <job size> <rank> <iter>", progname);
@@ -39,6 +44,9 @@ int main(int argc, char**argv) {
 	iter = atoi(argv[4]);
 
 	mmpi_init(jobid, nprocs, rank);
+	if(rank == 0)
+		printf("messages of %zd bytes or more are remapped\n",
+		       mmpi_driller_threshold());
 
 	/* demonstrate barrier */
 	printf("rank %d enters barrier\n", rank);
@@ -109,6 +117,193 @@ int main(int argc, char**argv) {
 
 	mmpi_barrier();
 
+	/* test non-blocking send/recv: exchange with all other ranks,
+	 * with several receives posted before any send */
+	{
+		int i, j, n;
+		int sbuf[NBTEST_DEPTH], rbuf[nprocs][NBTEST_DEPTH];
+		size_t rsize[nprocs][NBTEST_DEPTH];
+		struct mmpi_request *reqs[2 * nprocs * NBTEST_DEPTH];
+
+		n = 0;
+		for(j = 0; j < nprocs; j++)
+			for(i = 0; j != rank && i < NBTEST_DEPTH; i++)
+				reqs[n++] = mmpi_irecv(j, &rbuf[j][i],
+						       &rsize[j][i]);
+		for(i = 0; i < NBTEST_DEPTH; i++)
+			sbuf[i] = rank * NBTEST_DEPTH + i;
+		for(j = 0; j < nprocs; j++)
+			for(i = 0; j != rank && i < NBTEST_DEPTH; i++)
+				reqs[n++] = mmpi_isend(j, &sbuf[i],
+						       sizeof(sbuf[i]));
+		mmpi_waitall(n, reqs);
+
+		for(j = 0; j < nprocs; j++)
+			for(i = 0; j != rank && i < NBTEST_DEPTH; i++) {
+				assert(rsize[j][i] == sizeof(int));
+				assert(rbuf[j][i] == j * NBTEST_DEPTH + i);
+			}
+		printf("rank %d: non-blocking exchange ok\n", rank);
+	}
+
+	mmpi_barrier();
+
+	/* test collectives, with small and large data */
+	{
+		int i, j, count;
+		long *lbuf, *lres, expect;
+		int *ibuf, *ires;
+
+		for(count = 1; count <= COLLTEST_MAX_COUNT; count *= 64) {
+			lbuf = malloc(count * sizeof(*lbuf));
+			lres = malloc(nprocs * count * sizeof(*lres));
+			assert(lbuf != NULL && lres != NULL);
+
+			for(i = 0; i < count; i++)
+				lbuf[i] = rank + i;
+			mmpi_allreduce(lbuf, lres, count, MMPI_LONG, MMPI_SUM);
+			expect = (long)nprocs * (nprocs - 1) / 2;
+			for(i = 0; i < count; i++)
+				assert(lres[i] == expect + (long)nprocs * i);
+
+			mmpi_allreduce(lbuf, lres, count, MMPI_LONG, MMPI_MAX);
+			for(i = 0; i < count; i++)
+				assert(lres[i] == nprocs - 1 + i);
+
+			mmpi_reduce(lbuf, lres, count, MMPI_LONG, MMPI_MIN,
+				    nprocs - 1);
+			for(i = 0; rank == nprocs - 1 && i < count; i++)
+				assert(lres[i] == i);
+			/* leaves send it as is, others combine into a copy */
+			for(i = 0; i < count; i++)
+				assert(lbuf[i] == rank + i);
+
+			if(rank == 0)
+				for(i = 0; i < count; i++)
+					lbuf[i] = -i;
+			mmpi_bcast(lbuf, count * sizeof(*lbuf), 0);
+			for(i = 0; i < count; i++)
+				assert(lbuf[i] == -i);
+
+			for(i = 0; i < count; i++)
+				lbuf[i] = rank * count + i;
+			mmpi_gather(lbuf, count * sizeof(*lbuf), lres, 0);
+			for(i = 0; rank == 0 && i < nprocs * count; i++)
+				assert(lres[i] == i);
+
+			mmpi_scatter(lres, count * sizeof(*lbuf), lbuf, 0);
+			for(i = 0; i < count; i++)
+				assert(lbuf[i] == rank * count + i);
+
+			free(lres);
+			free(lbuf);
+		}
+
+		/* each rank sends j*nprocs + rank to rank j */
+		ibuf = malloc(nprocs * sizeof(*ibuf));
+		ires = malloc(nprocs * sizeof(*ires));
+		assert(ibuf != NULL && ires != NULL);
+		for(j = 0; j < nprocs; j++)
+			ibuf[j] = j * nprocs + rank;
+		mmpi_alltoall(ibuf, sizeof(*ibuf), ires);
+		for(j = 0; j < nprocs; j++)
+			assert(ires[j] == rank * nprocs + j);
+		free(ires);
+		free(ibuf);
+
+		printf("rank %d: collectives ok\n", rank);
+	}
+
+	mmpi_barrier();
+
+	/* test streaming: every rank but 0 sends many medium messages,
+	 * first one at a time, then all posted at once and flushed;
+	 * rank 0 receives them with non-blocking requests */
+	{
+		int i, j, n, pass;
+		char **sbufs, *rbuf;
+		size_t *rsize;
+		struct mmpi_request **reqs;
+		struct timeval tv1, tv2;
+		float delta;
+
+		sbufs = malloc(STREAMTEST_COUNT * sizeof(*sbufs));
+		assert(sbufs != NULL);
+		for(i = 0; rank != 0 && i < STREAMTEST_COUNT; i++) {
+			sbufs[i] = malloc(STREAMTEST_SIZE);
+			assert(sbufs[i] != NULL);
+			memset(sbufs[i], (char)(rank * STREAMTEST_COUNT + i),
+			       STREAMTEST_SIZE);
+		}
+		n = (nprocs - 1) * STREAMTEST_COUNT;
+		rbuf = malloc(rank == 0 ? (size_t)n * STREAMTEST_SIZE : 1);
+		rsize = malloc(n * sizeof(*rsize));
+		reqs = malloc(n * sizeof(*reqs));
+		assert(rbuf != NULL && rsize != NULL && reqs != NULL);
+
+		for(pass = 0; pass < 2; pass++) {
+			mmpi_barrier();
+			gettimeofday(&tv1, NULL);
+			if(rank != 0) {
+				for(i = 0; i < STREAMTEST_COUNT; i++)
+					if(pass == 0)
+						mmpi_send(0, sbufs[i],
+							  STREAMTEST_SIZE);
+					else
+						mmpi_post_send(0, sbufs[i],
+							       STREAMTEST_SIZE);
+				mmpi_flush_sends();
+				continue;
+			}
+
+			memset(rbuf, 0, (size_t)n * STREAMTEST_SIZE);
+			for(j = 1; j < nprocs; j++)
+				for(i = 0; i < STREAMTEST_COUNT; i++) {
+					int k = (j - 1) * STREAMTEST_COUNT + i;
+
+					reqs[k] = mmpi_irecv(j,
+						rbuf + (size_t)k * STREAMTEST_SIZE,
+						&rsize[k]);
+				}
+			/* poll all requests until they complete */
+			for(i = n; i > 0; )
+				for(j = 0; j < n; j++)
+					if(reqs[j] != NULL && mmpi_test(reqs[j])) {
+						reqs[j] = NULL;
+						i--;
+					}
+			gettimeofday(&tv2, NULL);
+
+			for(j = 1; j < nprocs; j++)
+				for(i = 0; i < STREAMTEST_COUNT; i++) {
+					int k = (j - 1) * STREAMTEST_COUNT + i;
+					char *b = rbuf + (size_t)k * STREAMTEST_SIZE;
+					char c = (char)(j * STREAMTEST_COUNT + i);
+
+					assert(rsize[k] == STREAMTEST_SIZE);
+					assert(b[0] == c);
+					assert(b[STREAMTEST_SIZE / 2] == c);
+					assert(b[STREAMTEST_SIZE - 1] == c);
+				}
+			delta = (float)(tv2.tv_usec - tv1.tv_usec) / 1E6
+				+ (float)(tv2.tv_sec - tv1.tv_sec);
+			printf("%s: %6.1f MB/s for %d messages of %d bytes\n",
+			       pass == 0 ? "lock-step sends" : "posted sends",
+			       (float)n * STREAMTEST_SIZE / (1 << 20) / delta,
+			       n, STREAMTEST_SIZE);
+		}
+
+		for(i = 0; rank != 0 && i < STREAMTEST_COUNT; i++)
+			free(sbufs[i]);
+		free(sbufs);
+		free(rbuf);
+		free(rsize);
+		free(reqs);
+		printf("rank %d: streaming ok\n", rank);
+	}
+
+	mmpi_barrier();
+
 	/* test throughput */
 
 #if 1 && defined(linux)
@@ -160,10 +355,21 @@ int main(int argc, char**argv) {
 
 				//printf("%d: recv from %d\n", rank, j);
 				for(i = 0; i < count; i++) {
-					mmpi_recv(j, buf, &sz);
+					struct mmpi_zc *zc;
+					const char *view;
+
+					/* every other message without copy */
+					if(i % 2) {
+						view = mmpi_recv_zc(j, &sz, &zc);
+					} else {
+						mmpi_recv(j, buf, &sz);
+						view = buf;
+					}
 					assert(sz == size);
-					assert(buf[0] == (char)i);
-					assert(buf[size-1] == (char)i);
+					assert(view[0] == (char)i);
+					assert(view[size-1] == (char)i);
+					if(i % 2)
+						mmpi_release_zc(zc);
 				}
 			}
 			gettimeofday(&tv2, NULL);
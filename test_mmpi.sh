@@ -5,9 +5,33 @@ jobid=$$
 nprocs=${1:-2}
 iter=${2:-1000000}
 
-for i in $(seq 0 $((nprocs-1)) ); do
-	#strace -fo strace-$i ./test_mmpi $jobid $nprocs $i $iter &
-	./test_mmpi $jobid $nprocs $i $iter &
-	#taskset -c $i ./test_mmpi $jobid $nprocs $i $iter &
+# run a job of $1 ranks with the $2 barrier and $3 iterations,
+# fail if any rank fails
+run() {
+	local pids= rc=0 i
+
+	for i in $(seq 0 $(($1-1)) ); do
+		#strace -fo strace-$i ./test_mmpi $jobid $1 $i $3 &
+		MMPI_BARRIER=$2 ./test_mmpi $jobid $1 $i $3 &
+		#MMPI_BARRIER=$2 taskset -c $i ./test_mmpi $jobid $1 $i $3 &
+		pids="$pids $!"
+	done
+	for i in $pids; do
+		wait $i || rc=1
+	done
+	jobid=$((jobid+1))
+	return $rc
+}
+
+rc=0
+for barrier in dissemination tree; do
+	run $nprocs $barrier $iter || rc=1
+done
+# sizes that are not a power of 2, where dissemination wraps around
+# with fewer iterations
+for n in 3 5; do
+	for barrier in dissemination tree; do
+		run $n $barrier $(( (iter + 9) / 10 )) || rc=1
+	done
 done
-wait
+exit $rc
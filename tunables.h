@@ -23,10 +23,43 @@
 #define TMPDIR "/tmp"
 #endif
 
+/* back segments with memfd_create(2), TMPDIR is then only a fallback */
+#ifdef linux
+#define USE_MEMFD 1
+#else
+#define USE_MEMFD 0
+#endif
+#define MAP_FD_NAME_MAX 128
+
 /* driller */
 
 #define MAP_TABLE_INITIAL_SIZE 32 /* items */
+#define MALLOC_STRIPES 8 /* allocation spaces, each with its own lock */
 #define DONT_MAP_TEXT 1
+/* chunk of /proc/self/maps read at once, longer than any line */
+#define MAPS_BUF_SIZE (PATH_MAX + 256)
+/* private mappings saved from /proc/self/maps before recording them
+ * (default vm.max_map_count), and room for their paths; static, so
+ * only pages actually used are touched */
+#define MAPS_MAX_TUPLES 65536
+#define MAPS_PATHS_SIZE (1 << 20)
+/* pages looked up at once when copying maps at init */
+#define MAP_PAGES_CHUNK 512
+
+/* carve anonymous maps out of one sparse pool file of this size,
+ * unless DRILLER_MAP_POOL=0 is in the environment */
+#ifdef linux
+#define USE_MAP_POOL 1
+#else
+#define USE_MAP_POOL 0
+#endif
+#ifdef _LP64
+#define MAP_POOL_SIZE (1UL << 36) /* 64 GB */
+#else
+#define MAP_POOL_SIZE (1UL << 28) /* 256 MB */
+#endif
+/* files of unmapped segments kept open for reuse */
+#define MAP_FD_CACHE_SIZE 16
 
 #ifdef _LP64
 # ifdef linux
@@ -37,16 +70,40 @@
 #else
 # define STACK_MAP_OFFSET	(1L << 30) /* 1GB */
 #endif
+/* map the whole stack window allowed by RLIMIT_STACK at init, rather
+ * than grow the stack on faults, unless DRILLER_STACK_RESERVE=0 is in
+ * the environment */
+#define USE_STACK_RESERVE	1
 #define ALTSTACK_SIZE		(1L << 16) /* 64KB */
 #define STACK_MIN_GROW		(1L << 20) /* 1MB */
 /* no HEAP_MIN_GROW: malloc should be smart with sbrk */
+/* map a window of this size over the heap file at init, so that brk
+ * only sizes the file, unless DRILLER_HEAP_WINDOW=0 is in the
+ * environment */
+#define USE_HEAP_WINDOW		1
+#ifdef _LP64
+#define HEAP_WINDOW_SIZE	(1UL << 32) /* 4GB */
+#else
+#define HEAP_WINDOW_SIZE	(1UL << 26) /* 64MB */
+#endif
 #define STACK_GUARD_SIZE	(1L << 20) /* 1MB */
 
 /* fdproxy */
 
-#define FDPROXY_MAX_CLIENTS 32
+#define FDPROXY_CLIENTS_INIT 32 /* initial size of the daemon client table */
+#define FDPROXY_EPOLL_EVENTS 64
 #define CONNECT_TIMEOUT 5 /* seconds */
-#define FDTABLE_HSIZE_INIT 32
+#define FDTABLE_HSIZE_INIT 64
+#define FDPROXY_MAX_BATCH 64 /* keys per request, below SCM_MAX_FD */
+#define FDPROXY_FDCACHE_MAX 256 /* fds a client keeps for reuse */
+#define PIDFD_CACHE_SIZE 64 /* pidfds of peers */
+#define FDPROXY_KEYTAB_SIZE 65536 /* fd nums a client serves in pidfd mode */
+
+
+/* keyhash */
+
+#define KEYHASH_MOVE_STEP 8 /* slots moved per update while growing */
+#define MAP_CACHE_HSIZE_INIT 64
 
 
 /* mmpi */
@@ -55,9 +112,29 @@
 #define CACHELINE_ALIGN 64
 
 #define MSG_PAYLOAD_SIZE_BYTES 4096
-#define MSG_POOL_SIZE 1024
-//#define MSG_DRILLER_SIZE_THRESHOLD (1<<11) /* 2kB */
-#define MSG_DRILLER_SIZE_THRESHOLD (0ULL)
+/* spin loops before sleeping on a futex, see also MMPI_WAIT_SPIN env var */
+#define MMPI_WAIT_SPIN_LOOPS (1U << 14)
+#define MSG_RING_SIZE 64 /* messages per (sender, receiver) pair, power of 2 */
+#define MSG_INLINE_RING_SIZE 64 /* cache-line messages per pair, power of 2 */
+/* barrier algorithm, see also MMPI_BARRIER env var */
+#define MMPI_BARRIER_DEFAULT "dissemination"
+#define MMPI_BARRIER_MAX_ROUNDS 32 /* log2 of the max job size */
+#define MMPI_BARRIER_TREE_ARITY 4
+/* allreduce: recursive doubling below, reduce-scatter + allgather above */
+#define MMPI_COLL_LARGE_SIZE (1UL << 15) /* 32kB */
+/*
+ * messages at least this large are remapped rather than copied:
+ * mmpi_init measures the crossover between ranks 0 and 1 for sizes in
+ * [MSG_CALIB_MIN_SIZE-MSG_CALIB_MAX_SIZE], and caches it in
+ * MSG_PROFILE_FILE (formatted with the uid); the MMPI_DRILLER_THRESHOLD
+ * env var overrides both, the default is only used for jobs with a
+ * single rank
+ */
+#define MSG_DRILLER_SIZE_THRESHOLD (1UL << 14) /* 16kB */
+#define MSG_CALIB_MIN_SIZE (1UL << 10) /* 1kB */
+#define MSG_CALIB_MAX_SIZE (1UL << 20) /* 1MB */
+#define MSG_CALIB_ITER 32 /* round trips per size */
+#define MSG_PROFILE_FILE TMPDIR "/mmpi_profile-%u"
 
 
 #endif /* TUNABLES_H */